@@ -0,0 +1,40 @@
+#!/bin/bash
+# train mnist with the distributed parameter server on the local machine,
+# once for each gradient compression method, and compare the logs
+# usage: ./run.sh [nworker] [nserver] [extra args of cxxnet]
+
+nworker=${1:-2}
+shift
+nserver=${1:-1}
+shift
+
+if [ ! -d "data" ]; then
+    mkdir data
+fi
+
+cd data
+for f in train-images-idx3-ubyte train-labels-idx1-ubyte \
+         t10k-images-idx3-ubyte t10k-labels-idx1-ubyte; do
+    if [ ! -f $f ]; then
+        wget http://yann.lecun.com/exdb/mnist/$f.gz
+        gzip -d $f.gz
+    fi
+done
+cd ..
+
+if [ ! -d "log" ]; then
+    mkdir log
+fi
+
+for method in none topk:0.01 onebit; do
+    name=${method%%:*}
+    ../../ps-lite/guide/local.sh $nserver $nworker \
+        ../../bin/cxxnet.ps mnist.conf param_server=dist \
+        grad_compress=$method $@ -local 2>&1 | tee log/$name.log
+done
+
+for method in none topk onebit; do
+    echo "== $method"
+    grep "grad_compress\[" log/$method.log | head -1
+    grep "test-error" log/$method.log | tail -1
+done
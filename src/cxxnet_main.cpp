@@ -324,9 +324,19 @@ class CXXNetLearnTask {
       const DataBatch& batch = itr_pred->Value();
       net_trainer->Predict(&pred, batch);
       CHECK(batch.num_batch_padd < batch.batch_size) << "num batch pad must be smaller";
-      mshadow::index_t sz = pred.size(0) - batch.num_batch_padd;
+      // number of values of each instance, more than 1 for top-k pairs
+      mshadow::index_t width = pred.size(0) / batch.batch_size;
+      mshadow::index_t sz = batch.batch_size - batch.num_batch_padd;
       for (mshadow::index_t j = 0; j < sz; ++j) {
-        fprintf(fo, "%g\n", pred[j]);
+        if (width == 1) {
+          fprintf(fo, "%g\n", pred[j]);
+          continue;
+        }
+        for (mshadow::index_t k = 0; k < width; k += 2) {
+          fprintf(fo, k == 0 ? "%g:%g" : " %g:%g",
+                  pred[j * width + k], pred[j * width + k + 1]);
+        }
+        fprintf(fo, "\n");
       }
     }
     fclose(fo);
@@ -19,6 +19,9 @@ class ActivationLayer : public ILayer<xpu>{
                  "ActivationLayer Layer only support 1-1 connection");
     nodes_out[0]->data.shape_ = nodes_in[0]->data.shape_;
   }
+  virtual bool ForwardInPlace(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
@@ -26,7 +29,9 @@ class ActivationLayer : public ILayer<xpu>{
     using namespace mshadow::expr;
     // InitConnection is already called, no need to check size again
     nodes_in[0]->data = F<ForwardOp>(nodes_in[0]->data);
-    mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+    if (nodes_out[0]->data.dptr_ != nodes_in[0]->data.dptr_) {
+      mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+    }
   }
   virtual void Backprop(bool prop_grad,
                         const std::vector<Node<xpu>*> &nodes_in,
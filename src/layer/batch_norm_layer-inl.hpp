@@ -2,6 +2,8 @@
 #define BATCH_NORM_LAYER_INL_HPP_
 #pragma once
 
+#include <cmath>
+#include <vector>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./op.h"
@@ -9,6 +11,176 @@
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief fused forward of batch normalization in training, cpu kernel is overloaded below,
+ *   mean and variance are computed in one pass, normalize and affine in another
+ * \param xhat output, normalized input, kept for backprop
+ * \param mean output, mean of each channel
+ * \param var output, variance of each channel
+ */
+template<typename xpu>
+inline void BatchNormForwardFused(mshadow::Tensor<xpu, 4> in, mshadow::Tensor<xpu, 4> out,
+                                  mshadow::Tensor<xpu, 4> xhat,
+                                  mshadow::Tensor<xpu, 1> mean, mshadow::Tensor<xpu, 1> var,
+                                  mshadow::Tensor<xpu, 1> slope, mshadow::Tensor<xpu, 1> bias,
+                                  real_t eps) {
+  utils::Error("BatchNorm: fused kernel is only supported on cpu");
+}
+/*!
+ * \brief fused backprop of batch normalization, two passes over the data,
+ *   in is replaced by its gradient, out holds the gradient of output
+ */
+template<typename xpu>
+inline void BatchNormBackpropFused(mshadow::Tensor<xpu, 4> in, mshadow::Tensor<xpu, 4> out,
+                                   mshadow::Tensor<xpu, 4> xhat, mshadow::Tensor<xpu, 1> var,
+                                   mshadow::Tensor<xpu, 1> slope, mshadow::Tensor<xpu, 1> gslope,
+                                   mshadow::Tensor<xpu, 1> gbias, real_t eps) {
+  utils::Error("BatchNorm: fused kernel is only supported on cpu");
+}
+inline void BatchNormForwardFused(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 4> out,
+                                  mshadow::Tensor<cpu, 4> xhat,
+                                  mshadow::Tensor<cpu, 1> mean, mshadow::Tensor<cpu, 1> var,
+                                  mshadow::Tensor<cpu, 1> slope, mshadow::Tensor<cpu, 1> bias,
+                                  real_t eps) {
+  if (in.size(1) != 1) {
+    // conv layout, channel is dim 1, a channel is made of rows of in[n][c]
+    const index_t h = in.size(2), w = in.size(3);
+    for (index_t c = 0; c < in.size(1); ++c) {
+      // statistics of each row are merged into the channel, Chan et al.
+      double cnt = 0.0, m = 0.0, m2 = 0.0;
+      for (index_t n = 0; n < in.size(0); ++n) {
+        for (index_t y = 0; y < h; ++y) {
+          const real_t *row = in[n][c][y].dptr_;
+          real_t rsum = 0.0f, rm2 = 0.0f;
+          for (index_t x = 0; x < w; ++x) rsum += row[x];
+          const real_t rmean = rsum / w;
+          for (index_t x = 0; x < w; ++x) {
+            rm2 += (row[x] - rmean) * (row[x] - rmean);
+          }
+          const double tot = cnt + w;
+          const double delta = rmean - m;
+          m += delta * w / tot;
+          m2 += rm2 + delta * delta * cnt * w / tot;
+          cnt = tot;
+        }
+      }
+      mean[c] = static_cast<real_t>(m);
+      var[c] = static_cast<real_t>(m2 / cnt);
+      const real_t mu = mean[c];
+      const real_t istd = 1.0f / std::sqrt(var[c] + eps);
+      const real_t a = slope[c], b = bias[c];
+      for (index_t n = 0; n < in.size(0); ++n) {
+        for (index_t y = 0; y < h; ++y) {
+          const real_t *row = in[n][c][y].dptr_;
+          real_t *pxhat = xhat[n][c][y].dptr_;
+          real_t *pout = out[n][c][y].dptr_;
+          for (index_t x = 0; x < w; ++x) {
+            pxhat[x] = (row[x] - mu) * istd;
+            pout[x] = pxhat[x] * a + b;
+          }
+        }
+      }
+    }
+  } else {
+    // fullc layout, channel is dim 3, each row holds all the channels
+    mshadow::Tensor<cpu, 2> src = in.FlatTo2D();
+    mshadow::Tensor<cpu, 2> dst = out.FlatTo2D();
+    mshadow::Tensor<cpu, 2> xh = xhat.FlatTo2D();
+    const index_t nch = src.size(1);
+    // welford update of all channels, var keeps sum of squared difference
+    mean = 0.0f; var = 0.0f;
+    for (index_t i = 0; i < src.size(0); ++i) {
+      const real_t r = 1.0f / (i + 1);
+      const real_t *row = src[i].dptr_;
+      for (index_t j = 0; j < nch; ++j) {
+        const real_t delta = row[j] - mean[j];
+        mean[j] += delta * r;
+        var[j] += delta * (row[j] - mean[j]);
+      }
+    }
+    std::vector<real_t> istd(nch);
+    for (index_t j = 0; j < nch; ++j) {
+      var[j] /= src.size(0);
+      istd[j] = 1.0f / std::sqrt(var[j] + eps);
+    }
+    for (index_t i = 0; i < src.size(0); ++i) {
+      const real_t *row = src[i].dptr_;
+      real_t *pxhat = xh[i].dptr_;
+      real_t *pout = dst[i].dptr_;
+      for (index_t j = 0; j < nch; ++j) {
+        pxhat[j] = (row[j] - mean[j]) * istd[j];
+        pout[j] = pxhat[j] * slope[j] + bias[j];
+      }
+    }
+  }
+}
+inline void BatchNormBackpropFused(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 4> out,
+                                   mshadow::Tensor<cpu, 4> xhat, mshadow::Tensor<cpu, 1> var,
+                                   mshadow::Tensor<cpu, 1> slope, mshadow::Tensor<cpu, 1> gslope,
+                                   mshadow::Tensor<cpu, 1> gbias, real_t eps) {
+  // gin = slope * istd * (grad - sum(grad) / m - xhat * sum(grad * xhat) / m)
+  if (in.size(1) != 1) {
+    const index_t h = in.size(2), w = in.size(3);
+    const real_t m = static_cast<real_t>(in.size(0) * h * w);
+    for (index_t c = 0; c < in.size(1); ++c) {
+      double sg = 0.0, sgx = 0.0;
+      for (index_t n = 0; n < in.size(0); ++n) {
+        for (index_t y = 0; y < h; ++y) {
+          const real_t *pgrad = out[n][c][y].dptr_;
+          const real_t *pxhat = xhat[n][c][y].dptr_;
+          real_t rg = 0.0f, rgx = 0.0f;
+          for (index_t x = 0; x < w; ++x) {
+            rg += pgrad[x]; rgx += pgrad[x] * pxhat[x];
+          }
+          sg += rg; sgx += rgx;
+        }
+      }
+      gbias[c] += static_cast<real_t>(sg);
+      gslope[c] += static_cast<real_t>(sgx);
+      const real_t k = slope[c] / std::sqrt(var[c] + eps);
+      const real_t mg = static_cast<real_t>(sg) / m;
+      const real_t mgx = static_cast<real_t>(sgx) / m;
+      for (index_t n = 0; n < in.size(0); ++n) {
+        for (index_t y = 0; y < h; ++y) {
+          real_t *pin = in[n][c][y].dptr_;
+          const real_t *pgrad = out[n][c][y].dptr_;
+          const real_t *pxhat = xhat[n][c][y].dptr_;
+          for (index_t x = 0; x < w; ++x) {
+            pin[x] = k * (pgrad[x] - mg - pxhat[x] * mgx);
+          }
+        }
+      }
+    }
+  } else {
+    mshadow::Tensor<cpu, 2> gin = in.FlatTo2D();
+    mshadow::Tensor<cpu, 2> grad = out.FlatTo2D();
+    mshadow::Tensor<cpu, 2> xh = xhat.FlatTo2D();
+    const index_t nch = gin.size(1);
+    const real_t m = static_cast<real_t>(gin.size(0));
+    std::vector<real_t> sg(nch, 0.0f), sgx(nch, 0.0f), k(nch);
+    for (index_t i = 0; i < gin.size(0); ++i) {
+      const real_t *pgrad = grad[i].dptr_;
+      const real_t *pxhat = xh[i].dptr_;
+      for (index_t j = 0; j < nch; ++j) {
+        sg[j] += pgrad[j]; sgx[j] += pgrad[j] * pxhat[j];
+      }
+    }
+    for (index_t j = 0; j < nch; ++j) {
+      gbias[j] += sg[j];
+      gslope[j] += sgx[j];
+      k[j] = slope[j] / std::sqrt(var[j] + eps);
+      sg[j] /= m; sgx[j] /= m;
+    }
+    for (index_t i = 0; i < gin.size(0); ++i) {
+      real_t *pin = gin[i].dptr_;
+      const real_t *pgrad = grad[i].dptr_;
+      const real_t *pxhat = xh[i].dptr_;
+      for (index_t j = 0; j < nch; ++j) {
+        pin[j] = k[j] * (pgrad[j] - sg[j] - pxhat[j] * sgx[j]);
+      }
+    }
+  }
+}
 
 template<typename xpu, bool moving_avg>
 class BatchNormLayer : public ILayer<xpu> {
@@ -18,12 +190,14 @@ class BatchNormLayer : public ILayer<xpu> {
     init_bias_ = 0.0f;
     eps_ = 1e-10f;
     bn_momentum_ = 0.9f;
+    fused_ = 0;
   }
   virtual void SetParam(const char *name, const char* val) {
     if (!strcmp(name, "init_slope")) init_slope_ = atof(val);
     if (!strcmp(name, "init_bias")) init_bias_ = atof(val);
     if (!strcmp(name, "eps")) eps_ = atof(val);
     if (!strcmp(name, "bn_momentum")) bn_momentum_ = atof(val);
+    if (!strcmp(name, "fused")) fused_ = atoi(val);
   }
   virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit("wmat", slope_, gslope_);
@@ -125,6 +299,15 @@ class BatchNormLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
     float scale = 1.0f / in.shape_.Size() * channel_;
     mshadow::TensorContainer<xpu,4> &temp_ = p_cstate->states[0];
+    if (xpu::kDevCPU && fused_ != 0 && (is_train || !moving_avg)) {
+      // state keeps normalized input instead of a copy of input
+      BatchNormForwardFused(in, out, temp_, exp_, var_, slope_, bias_, eps_);
+      if (moving_avg) {
+        running_exp_ = running_exp_ * bn_momentum_ + exp_ * (1 - bn_momentum_);
+        running_var_ = running_var_ * bn_momentum_ + var_ * (1 - bn_momentum_);
+      }
+      return;
+    }
     if (is_train) {
       mshadow::Copy(temp_, in, temp_.stream_);
       if (in.size(1) != 1) {
@@ -182,6 +365,10 @@ class BatchNormLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
     float scale = 1.0f / in.shape_.Size() * channel_;
     mshadow::TensorContainer<xpu,4> &temp_ = p_cstate->states[0];
+    if (xpu::kDevCPU && fused_ != 0) {
+      BatchNormBackpropFused(in, out, temp_, var_, slope_, gslope_, gbias_, eps_);
+      return;
+    }
     if (in.size(1) != 1){
       gvar_ = sumall_except_dim<1>((out * broadcast<1>(slope_, in.shape_)) *
                         (temp_ - broadcast<1>(exp_, in.shape_)) *
@@ -235,6 +422,8 @@ class BatchNormLayer : public ILayer<xpu> {
   float init_bias_;
   float eps_;
   float bn_momentum_;
+  /*! \brief use fused kernel on cpu */
+  int fused_;
 };  // class BatchNormLayer
 
 } // namespace layer
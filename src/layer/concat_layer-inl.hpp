@@ -16,7 +16,6 @@ class ConcatLayer : public ILayer<xpu> {
                               ConnectState<xpu> *p_cstate) {
     utils::Check(nodes_in.size() > 1 && nodes_out.size() == 1,
                  "Concat layer only support n-1 connection");
-    utils::Check(nodes_in.size() <= 4, "More than 4 input node is unspported");
     mshadow::Shape<4> oshape = nodes_in[0]->data.shape_;
     mshadow::index_t out_ch = 0;
     for (mshadow::index_t i = 0; i < nodes_in.size(); ++i) {
@@ -30,11 +29,16 @@ class ConcatLayer : public ILayer<xpu> {
     oshape[dim] = out_ch;
     nodes_out[0]->data.shape_ = oshape;
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
                        ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
+    // inputs are views of the output, nothing to do
+    if (this->IsAliased(nodes_in, nodes_out)) return;
     switch(nodes_in.size()) {
     case 2:
       nodes_out[0]->data = concat<dim>(nodes_in[0]->data, nodes_in[1]->data);
@@ -48,7 +52,7 @@ class ConcatLayer : public ILayer<xpu> {
                                      concat<dim>(nodes_in[2]->data, nodes_in[3]->data));
       break;
     default:
-      utils::Error("Too many node to concat");
+      this->CopySlices(nodes_in, nodes_out, true);
       break;
     };
   }
@@ -57,7 +61,7 @@ class ConcatLayer : public ILayer<xpu> {
                         const std::vector<Node<xpu>*> &nodes_out,
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
-    if (prop_grad) {
+    if (prop_grad && !this->IsAliased(nodes_in, nodes_out)) {
       switch(nodes_in.size()) {
       case 2:
         concat<dim>(nodes_in[0]->data, nodes_in[1]->data) = nodes_out[0]->data;
@@ -71,11 +75,61 @@ class ConcatLayer : public ILayer<xpu> {
                   concat<dim>(nodes_in[2]->data, nodes_in[3]->data)) = nodes_out[0]->data;
         break;
       default:
-        utils::Error("Too many nodes to concat");
+        this->CopySlices(nodes_in, nodes_out, false);
         break;
       };
     }
   }
+
+ private:
+  /*! \brief whether each input is the slice of the output it is concatenated to */
+  inline bool IsAliased(const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out) const {
+    if (dim != 3) return false;
+    const mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
+    index_t offset = 0;
+    for (index_t i = 0; i < nodes_in.size(); ++i) {
+      const mshadow::Tensor<xpu, 4> &in = nodes_in[i]->data;
+      if (in.dptr_ != out.dptr_ + offset || in.stride_ != out.stride_) return false;
+      offset += in.size(3);
+    }
+    return true;
+  }
+  /*!
+   * \brief copy between each input and its slice of output, used when
+   *  there are more inputs than the expressions cover
+   * \param to_out whether copy from inputs to output
+   */
+  inline void CopySlices(const std::vector<Node<xpu>*> &nodes_in,
+                         const std::vector<Node<xpu>*> &nodes_out,
+                         bool to_out) {
+    mshadow::Tensor<xpu, 4> out = nodes_out[0]->data;
+    index_t begin = 0;
+    for (index_t i = 0; i < nodes_in.size(); ++i) {
+      mshadow::Tensor<xpu, 4> in = nodes_in[i]->data;
+      if (dim == 3) {
+        // columns of the output are a strided view
+        mshadow::Tensor<xpu, 4> part = out;
+        part.dptr_ += begin;
+        part.shape_[3] = in.size(3);
+        if (to_out) {
+          mshadow::Copy(part, in, out.stream_);
+        } else {
+          mshadow::Copy(in, part, out.stream_);
+        }
+      } else {
+        for (index_t n = 0; n < out.size(0); ++n) {
+          mshadow::Tensor<xpu, 3> part = out[n].Slice(begin, begin + in.size(1));
+          if (to_out) {
+            mshadow::Copy(part, in[n], out.stream_);
+          } else {
+            mshadow::Copy(in[n], part, out.stream_);
+          }
+        }
+      }
+      begin += in.size(dim);
+    }
+  }
 }; //class ConcatLayer
 } // namespace layer
 } // namespace cxxnet
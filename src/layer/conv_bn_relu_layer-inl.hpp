@@ -0,0 +1,346 @@
+#ifndef CXXNET_LAYER_CONV_BN_RELU_LAYER_INL_HPP_
+#define CXXNET_LAYER_CONV_BN_RELU_LAYER_INL_HPP_
+/*!
+ * \file conv_bn_relu_layer-inl.hpp
+ * \brief convolution, batch normalization with moving average and relu as one layer,
+ *   the statistics are collected while the convolution output is produced and
+ *   normalize and relu are applied in one pass. the model is saved as the
+ *   concatenation of the conv and batch_norm models
+ */
+#include <cmath>
+#include <vector>
+#include <mshadow/tensor.h>
+#include "./layer.h"
+#include "./op.h"
+#include "./convolution_layer-inl.hpp"
+
+namespace cxxnet {
+namespace layer {
+/*!
+ * \brief merge the statistics of each channel of y into cnt, mean and m2 (sum of
+ *  squared difference), Chan et al. cpu kernel is overloaded below
+ */
+template<typename xpu>
+inline void ConvBNAccumulate(mshadow::Tensor<xpu, 4> y,
+                             double *cnt, double *mean, double *m2) {
+  utils::Error("ConvBNReluLayer: statistics in conv tiles is only supported on cpu");
+}
+/*!
+ * \brief y = (y - mean) / sqrt(var + eps), out = relu(y * slope + bias),
+ *   y keeps the normalized conv output for backprop. cpu kernel is overloaded below
+ */
+template<typename xpu>
+inline void ConvBNReluNormalize(mshadow::Tensor<xpu, 4> y, mshadow::Tensor<xpu, 4> out,
+                                mshadow::Tensor<xpu, 1> mean, mshadow::Tensor<xpu, 1> var,
+                                mshadow::Tensor<xpu, 1> slope, mshadow::Tensor<xpu, 1> bias,
+                                real_t eps) {
+  using namespace mshadow::expr;
+  y = (y - broadcast<1>(mean, y.shape_)) / F<op::square_root>(broadcast<1>(var + eps, y.shape_));
+  out = F<op::relu>(y * broadcast<1>(slope, y.shape_) + broadcast<1>(bias, y.shape_));
+}
+/*!
+ * \brief backprop of relu and batch normalization, grad holds the gradient of output
+ *   and is replaced by the gradient of the conv output. the relu mask is recomputed
+ *   from xhat. cpu kernel is overloaded below
+ * \param sg temp, sum of masked gradient of each channel
+ * \param sgx temp, sum of masked gradient times xhat of each channel
+ */
+template<typename xpu>
+inline void ConvBNReluBackprop(mshadow::Tensor<xpu, 4> grad, mshadow::Tensor<xpu, 4> xhat,
+                               mshadow::Tensor<xpu, 1> var,
+                               mshadow::Tensor<xpu, 1> slope, mshadow::Tensor<xpu, 1> bias,
+                               mshadow::Tensor<xpu, 1> gslope, mshadow::Tensor<xpu, 1> gbias,
+                               mshadow::Tensor<xpu, 1> sg, mshadow::Tensor<xpu, 1> sgx,
+                               real_t eps) {
+  using namespace mshadow::expr;
+  const real_t scale = static_cast<real_t>(grad.size(1)) / grad.shape_.Size();
+  grad *= F<op::relu_grad>(xhat * broadcast<1>(slope, grad.shape_) +
+                           broadcast<1>(bias, grad.shape_));
+  sg = sumall_except_dim<1>(grad);
+  sgx = sumall_except_dim<1>(grad * xhat);
+  gbias += sg;
+  gslope += sgx;
+  grad = broadcast<1>(slope / F<op::square_root>(var + eps), grad.shape_) *
+      (grad - broadcast<1>(sg, grad.shape_) * scale - xhat * broadcast<1>(sgx, grad.shape_) * scale);
+}
+inline void ConvBNAccumulate(mshadow::Tensor<cpu, 4> y,
+                             double *cnt, double *mean, double *m2) {
+  const index_t h = y.size(2), w = y.size(3);
+  for (index_t c = 0; c < y.size(1); ++c) {
+    for (index_t n = 0; n < y.size(0); ++n) {
+      for (index_t i = 0; i < h; ++i) {
+        const real_t *row = y[n][c][i].dptr_;
+        real_t rsum = 0.0f, rm2 = 0.0f;
+        for (index_t x = 0; x < w; ++x) rsum += row[x];
+        const real_t rmean = rsum / w;
+        for (index_t x = 0; x < w; ++x) {
+          rm2 += (row[x] - rmean) * (row[x] - rmean);
+        }
+        const double tot = cnt[c] + w;
+        const double delta = rmean - mean[c];
+        mean[c] += delta * w / tot;
+        m2[c] += rm2 + delta * delta * cnt[c] * w / tot;
+        cnt[c] = tot;
+      }
+    }
+  }
+}
+inline void ConvBNReluNormalize(mshadow::Tensor<cpu, 4> y, mshadow::Tensor<cpu, 4> out,
+                                mshadow::Tensor<cpu, 1> mean, mshadow::Tensor<cpu, 1> var,
+                                mshadow::Tensor<cpu, 1> slope, mshadow::Tensor<cpu, 1> bias,
+                                real_t eps) {
+  const index_t h = y.size(2), w = y.size(3);
+  for (index_t c = 0; c < y.size(1); ++c) {
+    const real_t mu = mean[c];
+    const real_t istd = 1.0f / std::sqrt(var[c] + eps);
+    const real_t a = slope[c], b = bias[c];
+    for (index_t n = 0; n < y.size(0); ++n) {
+      for (index_t i = 0; i < h; ++i) {
+        real_t *py = y[n][c][i].dptr_;
+        real_t *pout = out[n][c][i].dptr_;
+        for (index_t x = 0; x < w; ++x) {
+          py[x] = (py[x] - mu) * istd;
+          const real_t v = py[x] * a + b;
+          pout[x] = v > 0.0f ? v : 0.0f;
+        }
+      }
+    }
+  }
+}
+inline void ConvBNReluBackprop(mshadow::Tensor<cpu, 4> grad, mshadow::Tensor<cpu, 4> xhat,
+                               mshadow::Tensor<cpu, 1> var,
+                               mshadow::Tensor<cpu, 1> slope, mshadow::Tensor<cpu, 1> bias,
+                               mshadow::Tensor<cpu, 1> gslope, mshadow::Tensor<cpu, 1> gbias,
+                               mshadow::Tensor<cpu, 1> sg, mshadow::Tensor<cpu, 1> sgx,
+                               real_t eps) {
+  // g = grad * (xhat * slope + bias > 0)
+  // gy = slope * istd * (g - sum(g) / m - xhat * sum(g * xhat) / m)
+  const index_t h = grad.size(2), w = grad.size(3);
+  const real_t m = static_cast<real_t>(grad.size(0) * h * w);
+  for (index_t c = 0; c < grad.size(1); ++c) {
+    const real_t a = slope[c], b = bias[c];
+    double tg = 0.0, tgx = 0.0;
+    for (index_t n = 0; n < grad.size(0); ++n) {
+      for (index_t i = 0; i < h; ++i) {
+        const real_t *pgrad = grad[n][c][i].dptr_;
+        const real_t *pxhat = xhat[n][c][i].dptr_;
+        real_t rg = 0.0f, rgx = 0.0f;
+        for (index_t x = 0; x < w; ++x) {
+          const real_t g = pxhat[x] * a + b > 0.0f ? pgrad[x] : 0.0f;
+          rg += g; rgx += g * pxhat[x];
+        }
+        tg += rg; tgx += rgx;
+      }
+    }
+    sg[c] = static_cast<real_t>(tg);
+    sgx[c] = static_cast<real_t>(tgx);
+    gbias[c] += sg[c];
+    gslope[c] += sgx[c];
+    const real_t k = a / std::sqrt(var[c] + eps);
+    const real_t mg = sg[c] / m;
+    const real_t mgx = sgx[c] / m;
+    for (index_t n = 0; n < grad.size(0); ++n) {
+      for (index_t i = 0; i < h; ++i) {
+        real_t *pgrad = grad[n][c][i].dptr_;
+        const real_t *pxhat = xhat[n][c][i].dptr_;
+        for (index_t x = 0; x < w; ++x) {
+          const real_t g = pxhat[x] * a + b > 0.0f ? pgrad[x] : 0.0f;
+          pgrad[x] = k * (g - mg - pxhat[x] * mgx);
+        }
+      }
+    }
+  }
+}
+
+template<typename xpu>
+class ConvBNReluLayer : public ConvolutionLayer<xpu> {
+ private:
+  typedef ConvolutionLayer<xpu> Parent;
+
+ public:
+  ConvBNReluLayer(mshadow::Random<xpu> *p_rnd) : Parent(p_rnd) {
+    init_slope_ = 1.0f;
+    init_bn_bias_ = 0.0f;
+    eps_ = 1e-10f;
+    bn_momentum_ = 0.9f;
+    collect_stats_ = false;
+  }
+  virtual ~ConvBNReluLayer(void) {}
+  virtual void SetParam(const char *name, const char* val) {
+    Parent::SetParam(name, val);
+    if (!strcmp(name, "init_slope")) init_slope_ = atof(val);
+    if (!strcmp(name, "bn_init_bias")) init_bn_bias_ = atof(val);
+    if (!strcmp(name, "eps")) eps_ = atof(val);
+    if (!strcmp(name, "bn_momentum")) bn_momentum_ = atof(val);
+  }
+  virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
+    Parent::ApplyVisitor(pvisitor);
+    pvisitor->Visit("bn_wmat", slope_, gslope_);
+    pvisitor->Visit("bn_bias", bn_bias_, gbn_bias_);
+  }
+  virtual void InitModel(void) {
+    Parent::InitModel();
+    slope_.Resize(mshadow::Shape1(this->param_.num_channel));
+    bn_bias_.Resize(slope_.shape_);
+    running_exp_.Resize(slope_.shape_);
+    running_var_.Resize(slope_.shape_);
+    slope_ = init_slope_;
+    bn_bias_ = init_bn_bias_;
+    running_exp_ = 0.0f;
+    running_var_ = 0.0f;
+    this->InitBNTemp();
+  }
+  virtual void SaveModel(utils::IStream &fo) const {
+    // same as conv followed by batch_norm, relu has no model
+    Parent::SaveModel(fo);
+    slope_.SaveBinary(fo);
+    bn_bias_.SaveBinary(fo);
+    running_exp_.SaveBinary(fo);
+    running_var_.SaveBinary(fo);
+  }
+  virtual void LoadModel(utils::IStream &fi) {
+    Parent::LoadModel(fi);
+    slope_.LoadBinary(fi);
+    bn_bias_.LoadBinary(fi);
+    running_exp_.LoadBinary(fi);
+    running_var_.LoadBinary(fi);
+    utils::Check(slope_.size(0) == static_cast<index_t>(this->param_.num_channel),
+                 "ConvBNReluLayer: LoadModel batch_norm does not match conv");
+    this->InitBNTemp();
+  }
+  virtual void SetStream(mshadow::Stream<xpu> *stream) {
+    Parent::SetStream(stream);
+    slope_.set_stream(stream);
+    gslope_.set_stream(stream);
+    bn_bias_.set_stream(stream);
+    gbn_bias_.set_stream(stream);
+    exp_.set_stream(stream);
+    var_.set_stream(stream);
+    running_exp_.set_stream(stream);
+    running_var_.set_stream(stream);
+    sg_.set_stream(stream);
+    sgx_.set_stream(stream);
+  }
+  virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
+                              const std::vector<Node<xpu>*> &nodes_out,
+                              ConnectState<xpu> *p_cstate) {
+    Parent::InitConnection(nodes_in, nodes_out, p_cstate);
+    // conv output, normalized in place in training, the only activation kept for backprop
+    p_cstate->states.resize(1);
+    p_cstate->states[0].Resize(nodes_out[0]->data.shape_);
+  }
+  virtual void OnBatchSizeChanged(const std::vector<Node<xpu>*> &nodes_in,
+                                  const std::vector<Node<xpu>*> &nodes_out,
+                                  ConnectState<xpu> *p_cstate) {
+    p_cstate->states[0].Resize(nodes_out[0]->data.shape_);
+  }
+  virtual void Forward(bool is_train,
+                       const std::vector<Node<xpu>*> &nodes_in,
+                       const std::vector<Node<xpu>*> &nodes_out,
+                       ConnectState<xpu> *p_cstate) {
+    using namespace mshadow::expr;
+    mshadow::Tensor<xpu, 4> &in = nodes_in[0]->data;
+    mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
+    mshadow::Tensor<xpu, 4> y = p_cstate->states[0];
+    const index_t nch = static_cast<index_t>(this->param_.num_channel);
+    this->InitTemp(in.shape_, out.shape_);
+    // on cpu the statistics are merged while each step of conv output is written
+    collect_stats_ = is_train && xpu::kDevCPU;
+    if (collect_stats_) {
+      stats_.assign(this->nthread_used_ * 3 * nch, 0.0);
+    }
+    // the conv bias is cancelled by the mean in training, it is added to the running mean
+    this->ForwardConv(in, y, p_cstate->workspace);
+    collect_stats_ = false;
+    if (is_train) {
+      if (xpu::kDevCPU) {
+        this->MergeStats(nch);
+      } else {
+        const real_t scale = static_cast<real_t>(nch) / y.shape_.Size();
+        exp_ = scale * sumall_except_dim<1>(y);
+        var_ = scale * sumall_except_dim<1>(F<op::square>(y - broadcast<1>(exp_, y.shape_)));
+      }
+      ConvBNReluNormalize(y, out, exp_, var_, slope_, bn_bias_, eps_);
+      running_exp_ = running_exp_ * bn_momentum_ + exp_ * (1 - bn_momentum_);
+      if (this->param_.no_bias == 0) {
+        running_exp_ += this->bias_ * (1 - bn_momentum_);
+      }
+      running_var_ = running_var_ * bn_momentum_ + var_ * (1 - bn_momentum_);
+    } else {
+      // out = relu(y * a + b), the conv bias is folded into b
+      exp_ = slope_ / F<op::square_root>(running_var_ + eps_);
+      var_ = bn_bias_ - exp_ * running_exp_;
+      if (this->param_.no_bias == 0) {
+        var_ += exp_ * this->bias_;
+      }
+      out = F<op::relu>(y * broadcast<1>(exp_, y.shape_) + broadcast<1>(var_, y.shape_));
+    }
+  }
+  virtual void Backprop(bool prop_grad,
+                        const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out,
+                        ConnectState<xpu> *p_cstate) {
+    // out is replaced by the gradient of conv output, then goes through conv
+    ConvBNReluBackprop(nodes_out[0]->data, p_cstate->states[0], var_,
+                       slope_, bn_bias_, gslope_, gbn_bias_, sg_, sgx_, eps_);
+    Parent::Backprop(prop_grad, nodes_in, nodes_out, p_cstate);
+  }
+
+ protected:
+  virtual void OnForwardStep(int tid, mshadow::Tensor<xpu, 4> out_step) {
+    if (!collect_stats_) return;
+    const size_t nch = static_cast<size_t>(this->param_.num_channel);
+    double *pstat = &stats_[tid * 3 * nch];
+    ConvBNAccumulate(out_step, pstat, pstat + nch, pstat + 2 * nch);
+  }
+
+ private:
+  inline void InitBNTemp(void) {
+    gslope_.Resize(slope_.shape_);
+    gbn_bias_.Resize(slope_.shape_);
+    exp_.Resize(slope_.shape_);
+    var_.Resize(slope_.shape_);
+    sg_.Resize(slope_.shape_);
+    sgx_.Resize(slope_.shape_);
+    gslope_ = 0.0f; gbn_bias_ = 0.0f;
+  }
+  // merge the statistics of the threads in order, exp_ and var_ are on cpu
+  inline void MergeStats(index_t nch) {
+    for (index_t c = 0; c < nch; ++c) {
+      double cnt = 0.0, m = 0.0, m2 = 0.0;
+      for (int tid = 0; tid < this->nthread_used_; ++tid) {
+        const double *pstat = &stats_[tid * 3 * nch];
+        const double pcnt = pstat[c];
+        if (pcnt == 0.0) continue;
+        const double tot = cnt + pcnt;
+        const double delta = pstat[nch + c] - m;
+        m += delta * pcnt / tot;
+        m2 += pstat[2 * nch + c] + delta * delta * cnt * pcnt / tot;
+        cnt = tot;
+      }
+      exp_.dptr_[c] = static_cast<real_t>(m);
+      var_.dptr_[c] = static_cast<real_t>(m2 / cnt);
+    }
+  }
+  /*! \brief batch norm slope and bias */
+  mshadow::TensorContainer<xpu, 1> slope_, bn_bias_;
+  /*! \brief gradient of batch norm slope and bias */
+  mshadow::TensorContainer<xpu, 1> gslope_, gbn_bias_;
+  /*! \brief mean and variance of the conv output without bias in the batch */
+  mshadow::TensorContainer<xpu, 1> exp_, var_;
+  /*! \brief moving average of mean and variance of the conv output, with bias */
+  mshadow::TensorContainer<xpu, 1> running_exp_, running_var_;
+  /*! \brief temp of backprop */
+  mshadow::TensorContainer<xpu, 1> sg_, sgx_;
+  /*! \brief count, mean and m2 of each channel in each thread */
+  std::vector<double> stats_;
+  /*! \brief whether OnForwardStep collects the statistics */
+  bool collect_stats_;
+  float init_slope_;
+  float init_bn_bias_;
+  float eps_;
+  float bn_momentum_;
+};
+}  // namespace layer
+}  // namespace cxxnet
+#endif  // CXXNET_LAYER_CONV_BN_RELU_LAYER_INL_HPP_
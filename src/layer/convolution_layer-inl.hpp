@@ -1,6 +1,9 @@
 #ifndef CXXNET_LAYER_CONVOLUTION_LAYER_INL_HPP_
 #define CXXNET_LAYER_CONVOLUTION_LAYER_INL_HPP_
 
+#include <vector>
+#include <algorithm>
+#include <dmlc/omp.h>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./param.h"
@@ -8,15 +11,176 @@
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief limits the threads of BLAS while the batch of convolution
+ *  is partitioned over worker threads, restores the setting when destroyed
+ */
+class BLASThreadGuard {
+ public:
+  explicit BLASThreadGuard(int nworker) {
+#if MSHADOW_USE_MKL
+    // mkl is thread safe, share the cores between the workers
+    nthread_ = mkl_get_max_threads();
+    mkl_set_num_threads(std::max(nthread_ / nworker, 1));
+#elif defined(OPENBLAS_VERSION)
+    // threaded openblas cannot be called concurrently, run it in caller thread
+    nthread_ = openblas_get_num_threads();
+    openblas_set_num_threads(1);
+#endif
+  }
+  ~BLASThreadGuard(void) {
+#if MSHADOW_USE_MKL
+    mkl_set_num_threads(nthread_);
+#elif defined(OPENBLAS_VERSION)
+    openblas_set_num_threads(nthread_);
+#endif
+  }
+ private:
+  /*! \brief number of BLAS threads before the guard */
+  int nthread_;
+};
+/*!
+ * \brief unpack_patch2col of a square kernel whose size and stride are known at
+ *   compile time, col has the same layout as mshadow: row (c * ksize + ky) * ksize + kx,
+ *   column (n * oh + y) * ow + x, the padding reads as zero
+ */
+template<int ksize, int kstride>
+inline void UnpackPatchToColFixed(mshadow::Tensor<cpu, 2> col,
+                                  mshadow::Tensor<cpu, 4> in,
+                                  int pad_y, int pad_x) {
+  const int ih = static_cast<int>(in.size(2)), iw = static_cast<int>(in.size(3));
+  const int oh = (ih + 2 * pad_y - ksize) / kstride + 1;
+  const int ow = (iw + 2 * pad_x - ksize) / kstride + 1;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      for (int ky = 0; ky < ksize; ++ky) {
+        for (int kx = 0; kx < ksize; ++kx) {
+          real_t *pc = col[(c * ksize + ky) * ksize + kx].dptr_ + n * oh * ow;
+          // [xlo, xhi) of a row reads inside the input
+          const int off = kx - pad_x;
+          int xlo = 0, xhi = ow;
+          while (xlo < ow && xlo * kstride + off < 0) ++xlo;
+          while (xhi > xlo && (xhi - 1) * kstride + off >= iw) --xhi;
+          for (int y = 0; y < oh; ++y, pc += ow) {
+            const int sy = y * kstride + ky - pad_y;
+            if (sy < 0 || sy >= ih) {
+              std::fill(pc, pc + ow, 0.0f); continue;
+            }
+            const real_t *ps = src[sy].dptr_;
+            for (int x = 0; x < xlo; ++x) pc[x] = 0.0f;
+            for (int x = xlo; x < xhi; ++x) pc[x] = ps[x * kstride + off];
+            for (int x = xhi; x < ow; ++x) pc[x] = 0.0f;
+          }
+        }
+      }
+    }
+  }
+}
+/*!
+ * \brief pack_col2patch of a square kernel whose size and stride are known at
+ *   compile time, the part that falls in the padding is dropped
+ */
+template<int ksize, int kstride>
+inline void PackColToPatchFixed(mshadow::Tensor<cpu, 4> in,
+                                mshadow::Tensor<cpu, 2> col,
+                                int pad_y, int pad_x) {
+  const int ih = static_cast<int>(in.size(2)), iw = static_cast<int>(in.size(3));
+  const int oh = (ih + 2 * pad_y - ksize) / kstride + 1;
+  const int ow = (iw + 2 * pad_x - ksize) / kstride + 1;
+  in = 0.0f;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      for (int ky = 0; ky < ksize; ++ky) {
+        for (int kx = 0; kx < ksize; ++kx) {
+          const real_t *pc = col[(c * ksize + ky) * ksize + kx].dptr_ + n * oh * ow;
+          const int off = kx - pad_x;
+          int xlo = 0, xhi = ow;
+          while (xlo < ow && xlo * kstride + off < 0) ++xlo;
+          while (xhi > xlo && (xhi - 1) * kstride + off >= iw) --xhi;
+          for (int y = 0; y < oh; ++y, pc += ow) {
+            const int sy = y * kstride + ky - pad_y;
+            if (sy < 0 || sy >= ih) continue;
+            real_t *ps = src[sy].dptr_;
+            for (int x = xlo; x < xhi; ++x) ps[x * kstride + off] += pc[x];
+          }
+        }
+      }
+    }
+  }
+}
+/*!
+ * \brief im2col and col2im kernels specialized for the common convolution shapes,
+ *   selected once the shape is known, both are NULL for other shapes
+ */
+struct ConvShapeKernel {
+  typedef void (*UnpackFn)(mshadow::Tensor<cpu, 2> col, mshadow::Tensor<cpu, 4> in,
+                           int pad_y, int pad_x);
+  typedef void (*PackFn)(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 2> col,
+                         int pad_y, int pad_x);
+  UnpackFn unpack;
+  PackFn pack;
+  ConvShapeKernel(void) : unpack(NULL), pack(NULL) {}
+  inline void Select(int ksize_y, int ksize_x, int stride) {
+    unpack = NULL; pack = NULL;
+    if (ksize_y != ksize_x) return;
+    if (ksize_y == 1 && stride == 1) this->Set<1, 1>();
+    if (ksize_y == 3 && stride == 1) this->Set<3, 1>();
+    if (ksize_y == 3 && stride == 2) this->Set<3, 2>();
+    if (ksize_y == 5 && stride == 1) this->Set<5, 1>();
+    if (ksize_y == 7 && stride == 2) this->Set<7, 2>();
+  }
+
+ private:
+  template<int ksize, int kstride>
+  inline void Set(void) {
+    unpack = UnpackPatchToColFixed<ksize, kstride>;
+    pack = PackColToPatchFixed<ksize, kstride>;
+  }
+};
+/*! \brief col = unpack_patch2col(pad(in)) by the specialized kernel, cpu version is overloaded below */
+template<typename xpu>
+inline void UnpackPatchToCol(const ConvShapeKernel &kernel,
+                             mshadow::Tensor<xpu, 2> col,
+                             mshadow::Tensor<xpu, 4> in,
+                             int pad_y, int pad_x) {
+  utils::Error("ConvolutionLayer: shape_kernel is only supported on cpu");
+}
+/*! \brief in = crop(pack_col2patch(col)) by the specialized kernel, cpu version is overloaded below */
+template<typename xpu>
+inline void PackColToPatch(const ConvShapeKernel &kernel,
+                           mshadow::Tensor<xpu, 4> in,
+                           mshadow::Tensor<xpu, 2> col,
+                           int pad_y, int pad_x) {
+  utils::Error("ConvolutionLayer: shape_kernel is only supported on cpu");
+}
+inline void UnpackPatchToCol(const ConvShapeKernel &kernel,
+                             mshadow::Tensor<cpu, 2> col,
+                             mshadow::Tensor<cpu, 4> in,
+                             int pad_y, int pad_x) {
+  kernel.unpack(col, in, pad_y, pad_x);
+}
+inline void PackColToPatch(const ConvShapeKernel &kernel,
+                           mshadow::Tensor<cpu, 4> in,
+                           mshadow::Tensor<cpu, 2> col,
+                           int pad_y, int pad_x) {
+  kernel.pack(in, col, pad_y, pad_x);
+}
 
 template<typename xpu>
 class ConvolutionLayer : public ILayer<xpu> {
  public:
   ConvolutionLayer(mshadow::Random<xpu> *p_rnd)
-      : prnd_(p_rnd), wmat_(false), bias_(false), gwmat_(false), gbias_(false) {}
+      : prnd_(p_rnd), wmat_(false), bias_(false), gwmat_(false), gbias_(false) {
+    nthread_ = 1; nthread_used_ = 1;
+    use_shape_kernel_ = 1;
+  }
   virtual ~ConvolutionLayer(void) {}
   virtual void SetParam(const char *name, const char* val) {
     param_.SetParam(name, val);
+    if (!strcmp(name, "conv_nthread")) nthread_ = atoi(val);
+    if (!strcmp(name, "shape_kernel")) use_shape_kernel_ = atoi(val);
   }
   virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit("wmat", wmat_, gwmat_);
@@ -57,8 +221,6 @@ class ConvolutionLayer : public ILayer<xpu> {
     bias_.set_stream(stream);
     gwmat_.set_stream(stream);
     gbias_.set_stream(stream);
-    temp_dst_.set_stream(stream);
-    temp_col_.set_stream(stream);
   }
   virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                               const std::vector<Node<xpu>*> &nodes_out,
@@ -66,6 +228,11 @@ class ConvolutionLayer : public ILayer<xpu> {
     this->InitNode(nodes_in, nodes_out);
     this->InitTemp(nodes_in[0]->data.shape_,
                    nodes_out[0]->data.shape_);
+    // temp_col, temp_dst of each thread and weight gradient partials
+    p_cstate->workspace->Request(wsize_);
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
   }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
@@ -75,30 +242,7 @@ class ConvolutionLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 4> &in = nodes_in[0]->data;
     mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
     this->InitTemp(in.shape_, out.shape_);
-    const index_t nbatch = in.size(0);
-    for (index_t i = 0; i < nbatch; i += nstep_) {
-      // resize, incase last batch is smaller
-      const index_t step = std::min(nstep_, nbatch - i);
-      temp_col_.Resize(mshadow::Shape2(shape_colunit_[0], shape_colunit_[1] * step));
-      temp_dst_.Resize(mshadow::Shape3(shape_dstunit_[0], shape_dstunit_[1], shape_dstunit_[2] * step));
-
-      if (param_.pad_x == 0 && param_.pad_y == 0) {
-        temp_col_ = unpack_patch2col(in.Slice(i, i+step), param_.kernel_height, param_.kernel_width, param_.stride);
-      }else{
-        temp_col_ = unpack_patch2col(pad(in.Slice(i,i+step), param_.pad_y, param_.pad_x),
-                                     param_.kernel_height, param_.kernel_width, param_.stride);
-      }
-
-      const index_t gstride = temp_col_.size(0) / param_.num_group;
-      for (int gid = 0; gid < param_.num_group; ++ gid) {
-        mshadow::Tensor<xpu,2> tmpc = temp_col_.Slice(gstride * gid, gstride * (gid + 1));
-        temp_dst_[gid] = dot(wmat_[gid], tmpc);
-      }
-      out.Slice(i, i + step) =
-          swapaxis<1,0>(reshape(temp_dst_,
-                                mshadow::Shape4(param_.num_channel, step, out.size(2), out.size(3))));
-      
-    }
+    this->ForwardConv(in, out, p_cstate->workspace);
     if (param_.no_bias == 0) {
       // add bias, broadcast bias to dim 1: channel
       out += broadcast<1>(bias_, out.shape_);
@@ -112,45 +256,28 @@ class ConvolutionLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 4> &in = nodes_in[0]->data;
     mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
     this->InitTemp(in.shape_, out.shape_);
-    const index_t nbatch = in.size(0);
+    Workspace<xpu> *ws = p_cstate->workspace;
 
     if (param_.no_bias == 0) {
       gbias_ += sumall_except_dim<1>(out);
     }
-
-    for (index_t i = 0; i < nbatch; i += nstep_) {
-      const index_t step = std::min(nstep_, nbatch-i);
-      temp_col_.Resize(mshadow::Shape2(shape_colunit_[0], shape_colunit_[1] * step));
-      temp_dst_.Resize(mshadow::Shape3(shape_dstunit_[0], shape_dstunit_[1], shape_dstunit_[2] * step));
-
-      temp_dst_ = reshape(swapaxis<1,0>(out.Slice(i, i + step)), temp_dst_.shape_);
-
-      if (param_.pad_x == 0 && param_.pad_y == 0) {
-        temp_col_ = unpack_patch2col(in.Slice(i, i + step), param_.kernel_height, param_.kernel_width, param_.stride);
-      } else {
-        temp_col_ = unpack_patch2col(pad(in.Slice(i,i + step),param_.pad_y, param_.pad_x), param_.kernel_height, param_.kernel_width, param_.stride);
-      }
-
-      const index_t gstride = temp_col_.size(0) / param_.num_group;
-      for (int gid = 0; gid < param_.num_group; ++ gid) {
-        mshadow::Tensor<xpu,2> tmpc = temp_col_.Slice(gstride * gid, gstride * (gid+1));
-        gwmat_[gid] += dot(temp_dst_[gid], tmpc.T());
-      }
-
-      if (prop_grad) {
-        for (int gid = 0; gid < param_.num_group; ++ gid) {
-          mshadow::Tensor<xpu,2> tmpc = temp_col_.Slice(gstride * gid, gstride * (gid+1));
-          tmpc = dot(wmat_[gid].T(), temp_dst_[gid]);
-        }
-
-        if (param_.pad_x == 0 && param_.pad_y == 0) {
-          in.Slice(i,i+step) = pack_col2patch(temp_col_, in.Slice(i, i + step).shape_, param_.kernel_height, param_.kernel_width, param_.stride);
-        }else{
-          mshadow::Shape<4> pshape = in.Slice(i, i + step).shape_;
-          pshape[2] += 2 * param_.pad_y; pshape[3] += 2 * param_.pad_x;
-          in.Slice(i, i + step) = crop(pack_col2patch(temp_col_, pshape, param_.kernel_height, param_.kernel_width, param_.stride), in[i][0].shape_);
+    if (nthread_used_ > 1) {
+      const int npart = nthread_used_;
+      {
+        BLASThreadGuard guard(npart);
+        #pragma omp parallel num_threads(npart)
+        {
+          for (int tid = omp_get_thread_num(); tid < npart; tid += omp_get_num_threads()) {
+            this->BackpropPart(tid, prop_grad, in, out, ws);
+          }
         }
       }
+      // reduce the partials of weight gradient
+      for (int tid = 1; tid < npart; ++tid) {
+        gwmat_ += this->GetGradPartial(tid, ws);
+      }
+    } else {
+      this->BackpropPart(0, prop_grad, in, out, ws);
     }
   }
 
@@ -176,6 +303,9 @@ class ConvolutionLayer : public ILayer<xpu> {
                 (ishape[2] + 2 * param_.pad_y - ksize_y) / kstride + 1,
                 (ishape[3] + 2 * param_.pad_x - ksize_x) / kstride + 1);
       nodes_out[0]->data.shape_ = oshape;
+      if (xpu::kDevCPU && use_shape_kernel_ != 0) {
+        shape_kernel_.Select(param_.kernel_height, param_.kernel_width, param_.stride);
+      }
 
       if (param_.num_input_channel == 0) {
         param_.num_input_channel = static_cast<int>(ishape[1]);
@@ -193,14 +323,146 @@ class ConvolutionLayer : public ILayer<xpu> {
     // this is the unit size of eacj temp structure
     shape_colunit_ = mshadow::Shape2(ishape[1] * ksize_y * ksize_x, oshape[2] * oshape[3]);
     shape_dstunit_ = mshadow::Shape3(param_.num_group, param_.num_channel/param_.num_group, oshape[2] * oshape[3]);
-    nstep_ = std::max(std::min((index_t)(param_.temp_col_max / shape_colunit_.Size()), ishape[0]), 1U);
+    shape_gwmat_ = mshadow::Shape3(param_.num_group, param_.num_channel / param_.num_group,
+                                   ishape[1] / param_.num_group * ksize_y * ksize_x);
+    // batch partition across threads is only done on cpu
+    nthread_used_ = xpu::kDevCPU ? std::min(std::max(nthread_, 1), static_cast<int>(ishape[0])) : 1;
+    // temp_col_max is shared by all the threads
+    const index_t col_max = param_.temp_col_max / nthread_used_;
+    const index_t nbatch = (ishape[0] + nthread_used_ - 1) / nthread_used_;
+    nstep_ = std::max(std::min((index_t)(col_max / shape_colunit_.Size()), nbatch), 1U);
     // make nstep more balanced,  nstep will use exactly same number of operations to finish,
-    index_t nop = (ishape[0]+nstep_-1) / nstep_;
-    nstep_ = (ishape[0] + nop - 1)/ nop;
+    index_t nop = (nbatch + nstep_ - 1) / nstep_;
+    nstep_ = (nbatch + nop - 1)/ nop;
     CHECK(nstep_ > 0);
-    // helper structure
-    temp_col_.Resize(mshadow::Shape2(shape_colunit_[0], shape_colunit_[1] * nstep_));
-    temp_dst_.Resize(mshadow::Shape3(shape_dstunit_[0], shape_dstunit_[1], shape_dstunit_[2] * nstep_));
+    // layout of workspace: [temp_col, temp_dst] of each thread, then gwmat partials of thread 1..
+    wsize_thread_ = (shape_colunit_.Size() + shape_dstunit_.Size()) * nstep_;
+    wsize_ = wsize_thread_ * nthread_used_ + shape_gwmat_.Size() * (nthread_used_ - 1);
+  }
+  /*! \brief out = conv(in) without bias, the batch is partitioned over the threads */
+  inline void ForwardConv(mshadow::Tensor<xpu, 4> in,
+                          mshadow::Tensor<xpu, 4> out,
+                          Workspace<xpu> *ws) {
+    if (nthread_used_ > 1) {
+      const int npart = nthread_used_;
+      BLASThreadGuard guard(npart);
+      #pragma omp parallel num_threads(npart)
+      {
+        // loop over parts, so the result is the same if fewer threads are launched
+        for (int tid = omp_get_thread_num(); tid < npart; tid += omp_get_num_threads()) {
+          this->ForwardPart(tid, in, out, ws);
+        }
+      }
+    } else {
+      this->ForwardPart(0, in, out, ws);
+    }
+  }
+  /*!
+   * \brief called by ForwardPart once the output of a step of the batch is written,
+   *  from the thread that runs part tid
+   */
+  virtual void OnForwardStep(int tid, mshadow::Tensor<xpu, 4> out_step) {}
+  /*! \brief get the weight gradient partial of thread tid > 0 from workspace */
+  inline mshadow::Tensor<xpu, 3> GetGradPartial(int tid, Workspace<xpu> *ws) {
+    return ws->Get(shape_gwmat_, wsize_thread_ * nthread_used_ + shape_gwmat_.Size() * (tid - 1));
+  }
+  /*! \brief forward part tid of the batch, using the temp space of thread tid */
+  inline void ForwardPart(int tid,
+                          mshadow::Tensor<xpu, 4> in,
+                          mshadow::Tensor<xpu, 4> out,
+                          Workspace<xpu> *ws) {
+    using namespace mshadow::expr;
+    const index_t nbatch = in.size(0);
+    const index_t begin = nbatch * tid / nthread_used_;
+    const index_t end = nbatch * (tid + 1) / nthread_used_;
+    const size_t offset = wsize_thread_ * tid;
+    for (index_t i = begin; i < end; i += nstep_) {
+      // view of temp space, incase last batch is smaller
+      const index_t step = std::min(nstep_, end - i);
+      mshadow::Tensor<xpu, 2> temp_col =
+          ws->Get(mshadow::Shape2(shape_colunit_[0], shape_colunit_[1] * step), offset);
+      mshadow::Tensor<xpu, 3> temp_dst =
+          ws->Get(mshadow::Shape3(shape_dstunit_[0], shape_dstunit_[1], shape_dstunit_[2] * step),
+                  offset + temp_col.shape_.Size());
+      if (shape_kernel_.unpack != NULL) {
+        UnpackPatchToCol(shape_kernel_, temp_col, in.Slice(i, i + step), param_.pad_y, param_.pad_x);
+      } else if (param_.pad_x == 0 && param_.pad_y == 0) {
+        temp_col = unpack_patch2col(in.Slice(i, i + step), param_.kernel_height, param_.kernel_width, param_.stride);
+      }else{
+        temp_col = unpack_patch2col(pad(in.Slice(i, i + step), param_.pad_y, param_.pad_x),
+                                    param_.kernel_height, param_.kernel_width, param_.stride);
+      }
+
+      const index_t gstride = temp_col.size(0) / param_.num_group;
+      for (int gid = 0; gid < param_.num_group; ++ gid) {
+        mshadow::Tensor<xpu,2> tmpc = temp_col.Slice(gstride * gid, gstride * (gid + 1));
+        temp_dst[gid] = dot(wmat_[gid], tmpc);
+      }
+      out.Slice(i, i + step) =
+          swapaxis<1,0>(reshape(temp_dst,
+                                mshadow::Shape4(param_.num_channel, step, out.size(2), out.size(3))));
+      this->OnForwardStep(tid, out.Slice(i, i + step));
+    }
+  }
+  /*!
+   * \brief backprop part tid of the batch, using the temp space of thread tid,
+   *  part 0 accumulates into gwmat_, other parts into partials reduced afterwards
+   */
+  inline void BackpropPart(int tid, bool prop_grad,
+                           mshadow::Tensor<xpu, 4> in,
+                           mshadow::Tensor<xpu, 4> out,
+                           Workspace<xpu> *ws) {
+    using namespace mshadow::expr;
+    mshadow::Tensor<xpu, 3> gwmat = gwmat_;
+    if (tid != 0) {
+      gwmat = this->GetGradPartial(tid, ws);
+      gwmat = 0.0f;
+    }
+    const index_t nbatch = in.size(0);
+    const index_t begin = nbatch * tid / nthread_used_;
+    const index_t end = nbatch * (tid + 1) / nthread_used_;
+    const size_t offset = wsize_thread_ * tid;
+    for (index_t i = begin; i < end; i += nstep_) {
+      const index_t step = std::min(nstep_, end - i);
+      mshadow::Tensor<xpu, 2> temp_col =
+          ws->Get(mshadow::Shape2(shape_colunit_[0], shape_colunit_[1] * step), offset);
+      mshadow::Tensor<xpu, 3> temp_dst =
+          ws->Get(mshadow::Shape3(shape_dstunit_[0], shape_dstunit_[1], shape_dstunit_[2] * step),
+                  offset + temp_col.shape_.Size());
+
+      temp_dst = reshape(swapaxis<1,0>(out.Slice(i, i + step)), temp_dst.shape_);
+
+      if (shape_kernel_.unpack != NULL) {
+        UnpackPatchToCol(shape_kernel_, temp_col, in.Slice(i, i + step), param_.pad_y, param_.pad_x);
+      } else if (param_.pad_x == 0 && param_.pad_y == 0) {
+        temp_col = unpack_patch2col(in.Slice(i, i + step), param_.kernel_height, param_.kernel_width, param_.stride);
+      } else {
+        temp_col = unpack_patch2col(pad(in.Slice(i,i + step),param_.pad_y, param_.pad_x), param_.kernel_height, param_.kernel_width, param_.stride);
+      }
+
+      const index_t gstride = temp_col.size(0) / param_.num_group;
+      for (int gid = 0; gid < param_.num_group; ++ gid) {
+        mshadow::Tensor<xpu,2> tmpc = temp_col.Slice(gstride * gid, gstride * (gid+1));
+        gwmat[gid] += dot(temp_dst[gid], tmpc.T());
+      }
+
+      if (prop_grad) {
+        for (int gid = 0; gid < param_.num_group; ++ gid) {
+          mshadow::Tensor<xpu,2> tmpc = temp_col.Slice(gstride * gid, gstride * (gid+1));
+          tmpc = dot(wmat_[gid].T(), temp_dst[gid]);
+        }
+
+        if (shape_kernel_.pack != NULL) {
+          PackColToPatch(shape_kernel_, in.Slice(i, i + step), temp_col, param_.pad_y, param_.pad_x);
+        } else if (param_.pad_x == 0 && param_.pad_y == 0) {
+          in.Slice(i,i+step) = pack_col2patch(temp_col, in.Slice(i, i + step).shape_, param_.kernel_height, param_.kernel_width, param_.stride);
+        }else{
+          mshadow::Shape<4> pshape = in.Slice(i, i + step).shape_;
+          pshape[2] += 2 * param_.pad_y; pshape[3] += 2 * param_.pad_x;
+          in.Slice(i, i + step) = crop(pack_col2patch(temp_col, pshape, param_.kernel_height, param_.kernel_width, param_.stride), in[i][0].shape_);
+        }
+      }
+    }
   }
 
   /*! \brief random number generator */
@@ -215,16 +477,26 @@ class ConvolutionLayer : public ILayer<xpu> {
   mshadow::TensorContainer<xpu,3> gwmat_;
   /*! \brief accumulates the gradient of bias */
   mshadow::TensorContainer<xpu,1> gbias_;
-  /*! \brief temporary data structure to store patches */
-  mshadow::TensorContainer<xpu,2> temp_col_;
-  /*! \brief temporary data structure to store results */
-  mshadow::TensorContainer<xpu,3> temp_dst_;
   /*! \brief shape of column unit */
   mshadow::Shape<2> shape_colunit_;
   /*! \brief shape of dst unit */
   mshadow::Shape<3> shape_dstunit_;
+  /*! \brief shape of weight gradient */
+  mshadow::Shape<3> shape_gwmat_;
   /*! \brief how many number of batches to be unpacked together */
   mshadow::index_t nstep_;
+  /*! \brief number of threads the batch is partitioned over, set by conv_nthread */
+  int nthread_;
+  /*! \brief number of threads used for current batch */
+  int nthread_used_;
+  /*! \brief whether to use the kernels specialized for common shapes on cpu, set by shape_kernel */
+  int use_shape_kernel_;
+  /*! \brief specialized kernels of the shape of this layer */
+  ConvShapeKernel shape_kernel_;
+  /*! \brief workspace size of temp_col and temp_dst of one thread */
+  size_t wsize_thread_;
+  /*! \brief total workspace size needed */
+  size_t wsize_;
 };
 }  // namespace layer
 }  // namespace cxxnet
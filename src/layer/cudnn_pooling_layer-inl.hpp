@@ -27,6 +27,8 @@ class CuDNNPoolingLayer<Reducer, mode, gpu> : public PoolingLayer<Reducer, mode,
                                 const std::vector<Node<gpu>*> &nodes_out,
                                 ConnectState<gpu> *p_cstate) {
       Parent::InitNode(nodes_in, nodes_out, p_cstate);
+      // gradient buffer of backprop is taken from workspace
+      p_cstate->workspace->Request(nodes_in[0]->data.shape_.Size());
       this->InitCuDNN();
       nodes_in[0]->must_contiguous = true;
       nodes_out[0]->must_contiguous = true;
@@ -71,7 +73,7 @@ class CuDNNPoolingLayer<Reducer, mode, gpu> : public PoolingLayer<Reducer, mode,
                           const std::vector<Node<gpu>*> &nodes_out,
                           ConnectState<gpu> *p_cstate) {
       mshadow::Tensor<gpu,4> &tmp = p_cstate->states[0];
-      mshadow::Tensor<gpu,4> &tmp2 = p_cstate->states[1];
+      mshadow::Tensor<gpu,4> tmp2 = p_cstate->workspace->Get(nodes_in[0]->data.shape_);
       float alpha = 1.0f;
       float beta = 0.0f;
       if (prop_grad) {
@@ -1,12 +1,71 @@
 #ifndef CXXNET_LAYER_DROPOUT_LAYER_INL_HPP_
 #define CXXNET_LAYER_DROPOUT_LAYER_INL_HPP_
 
+#include <cstring>
+#include <dmlc/omp.h>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./op.h"
+#include "../utils/philox.h"
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief apply dropout with mask drawn from counter based random numbers,
+ *   element i of data is kept if random number i of the stream starting at
+ *   block counter is smaller than pkeep * 2^32. cpu kernel is overloaded below
+ * \param bits if not NULL, record keep flag of each element as one bit
+ * \param nthread number of threads, the mask does not depend on it
+ */
+template<typename xpu>
+inline void DropoutForward(mshadow::Tensor<xpu, 2> data,
+                           const utils::Philox4x32 &rng, uint64_t counter,
+                           real_t pkeep, uint32_t *bits, int nthread) {
+  utils::Error("DropoutLayer: dropout_mask is only supported on cpu");
+}
+/*! \brief apply dropout with recorded bit mask */
+template<typename xpu>
+inline void DropoutBackward(mshadow::Tensor<xpu, 2> data,
+                            const uint32_t *bits, real_t pkeep) {
+  utils::Error("DropoutLayer: dropout_mask is only supported on cpu");
+}
+inline void DropoutForward(mshadow::Tensor<cpu, 2> data,
+                           const utils::Philox4x32 &rng, uint64_t counter,
+                           real_t pkeep, uint32_t *bits, int nthread) {
+  const uint64_t thresh = static_cast<uint64_t>(pkeep * 4294967296.0);
+  const real_t scale = 1.0f / pkeep;
+  const index_t ncol = data.size(1);
+  const int nrow = static_cast<int>(data.size(0));
+  // rows share bit words unless each row is a whole number of words
+  if (bits != NULL && ncol % 32 != 0) nthread = 1;
+  #pragma omp parallel for num_threads(nthread) schedule(static)
+  for (int y = 0; y < nrow; ++y) {
+    real_t *p = data[y].dptr_;
+    uint64_t i = static_cast<uint64_t>(y) * ncol;
+    uint32_t rnd[4];
+    if ((i & 3) != 0) rng.Generate(counter + (i >> 2), rnd);
+    for (index_t x = 0; x < ncol; ++x, ++i) {
+      if ((i & 3) == 0) rng.Generate(counter + (i >> 2), rnd);
+      const uint32_t keep = rnd[i & 3] < thresh ? 1U : 0U;
+      p[x] = keep != 0 ? p[x] * scale : 0.0f;
+      if (bits != NULL) {
+        if ((i & 31) == 0) bits[i >> 5] = 0;
+        bits[i >> 5] |= keep << (i & 31);
+      }
+    }
+  }
+}
+inline void DropoutBackward(mshadow::Tensor<cpu, 2> data,
+                            const uint32_t *bits, real_t pkeep) {
+  const real_t scale = 1.0f / pkeep;
+  uint64_t i = 0;
+  for (index_t y = 0; y < data.size(0); ++y) {
+    real_t *p = data[y].dptr_;
+    for (index_t x = 0; x < data.size(1); ++x, ++i) {
+      p[x] = ((bits[i >> 5] >> (i & 31)) & 1U) != 0 ? p[x] * scale : 0.0f;
+    }
+  }
+}
 
 template<typename xpu>
 class DropoutLayer : public ILayer<xpu> {
@@ -14,9 +73,20 @@ class DropoutLayer : public ILayer<xpu> {
   DropoutLayer(mshadow::Random<xpu> *p_rnd) : prnd_(p_rnd) {
     // setup default value
     dropout_threshold = 0.0f;
+    mask_mode_ = kFloatMask;
+    rand_nthread_ = 0;
+    philox_seed_ = 0;
   }
   virtual void SetParam(const char *name, const char* val) {
     if (!strcmp("threshold", name)) dropout_threshold = static_cast<real_t>(atof(val));
+    if (!strcmp("dropout_mask", name)) {
+      if (!strcmp(val, "float")) mask_mode_ = kFloatMask;
+      else if (!strcmp(val, "bit")) mask_mode_ = kBitMask;
+      else if (!strcmp(val, "regen")) mask_mode_ = kRegenMask;
+      else utils::Error("DropoutLayer: unknown dropout_mask \"%s\"", val);
+    }
+    if (!strcmp("rand_nthread", name)) rand_nthread_ = atoi(val);
+    if (!strcmp("philox_seed", name)) philox_seed_ = utils::ParsePhiloxSeed(val);
   }
   virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                               const std::vector<Node<xpu>*> &nodes_out,
@@ -26,14 +96,21 @@ class DropoutLayer : public ILayer<xpu> {
     utils::Check(nodes_in[0] == nodes_out[0], "DropoutLayer is an self-loop Layer");
     utils::Check(dropout_threshold >= 0.0f && dropout_threshold < 1.0f,
                  "DropoutLayer: invalid dropout_threshold\n");
+    if (xpu::kDevCPU && (mask_mode_ != kFloatMask || rand_nthread_ != 0)) {
+      rng_.Seed(philox_seed_);
+      rng_.set_nthread(rand_nthread_);
+    } else {
+      mask_mode_ = kFloatMask;
+      rand_nthread_ = 0;
+    }
     // use 1 temp state for mask
     p_cstate->states.resize(1);
-    p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
+    this->InitMask(nodes_in[0]->data.shape_, p_cstate);
   }
   virtual void OnBatchSizeChanged(const std::vector<Node<xpu>*> &nodes_in,
                                   const std::vector<Node<xpu>*> &nodes_out,
                                   ConnectState<xpu> *p_cstate) {
-    p_cstate->states[0].Resize(nodes_in[0]->data.shape_);  
+    this->InitMask(nodes_in[0]->data.shape_, p_cstate);
   }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
@@ -42,7 +119,24 @@ class DropoutLayer : public ILayer<xpu> {
     using namespace mshadow::expr;
     mshadow::TensorContainer<xpu,4> &mask = p_cstate->states[0];
     const real_t pkeep = 1.0f - dropout_threshold;
-    if (is_train) {
+    if (is_train && mask_mode_ != kFloatMask) {
+      // each forward takes a new part of the random stream
+      const uint64_t counter = rng_.Take(nodes_out[0]->data.shape_.Size());
+      if (mask_mode_ == kBitMask) {
+        DropoutForward(nodes_out[0]->data.FlatTo2D(), rng_.generator(), counter, pkeep,
+                       reinterpret_cast<uint32_t*>(mask.dptr_), rng_.nthread());
+      } else {
+        std::memcpy(mask.dptr_, &counter, sizeof(counter));
+        DropoutForward(nodes_out[0]->data.FlatTo2D(), rng_.generator(), counter, pkeep,
+                       NULL, rng_.nthread());
+      }
+      return;
+    }
+    if (is_train && rand_nthread_ != 0) {
+      rng_.SampleUniform(mask.FlatTo2D(), 0.0f, 1.0f);
+      mask = F<op::threshold>(mask, pkeep) * (1.0f/pkeep);
+      nodes_out[0]->data = nodes_out[0]->data * mask;
+    } else if (is_train) {
       mask = F<op::threshold>(prnd_->uniform(mask.shape_), pkeep)  * (1.0f/pkeep);
       nodes_out[0]->data = nodes_out[0]->data * mask;
     }
@@ -53,16 +147,54 @@ class DropoutLayer : public ILayer<xpu> {
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
     mshadow::TensorContainer<xpu,4> &mask = p_cstate->states[0];
+    const real_t pkeep = 1.0f - dropout_threshold;
     if (prop_grad) {
-      nodes_out[0]->data *= mask;
+      if (mask_mode_ == kBitMask) {
+        DropoutBackward(nodes_out[0]->data.FlatTo2D(),
+                        reinterpret_cast<const uint32_t*>(mask.dptr_), pkeep);
+      } else if (mask_mode_ == kRegenMask) {
+        // same mask as forward, generated again from the counter
+        uint64_t counter;
+        std::memcpy(&counter, mask.dptr_, sizeof(counter));
+        DropoutForward(nodes_out[0]->data.FlatTo2D(), rng_.generator(), counter, pkeep,
+                       NULL, rng_.nthread());
+      } else {
+        nodes_out[0]->data *= mask;
+      }
     }    
   }
 
  private:
+  /*! \brief type of mask */
+  enum MaskMode {
+    kFloatMask = 0,
+    kBitMask = 1,
+    kRegenMask = 2
+  };
+  /*! \brief allocate mask in state, one bit per element for bit mask */
+  inline void InitMask(mshadow::Shape<4> shape, ConnectState<xpu> *p_cstate) {
+    mshadow::TensorContainer<xpu,4> &mask = p_cstate->states[0];
+    if (mask_mode_ == kFloatMask) {
+      mask.Resize(shape);
+    } else {
+      // uint32 words of bits, or the uint64 counter of forward for regen
+      const index_t nword = mask_mode_ == kBitMask ? (shape.Size() + 31) / 32 : 2;
+      mask.set_pad(false);
+      mask.Resize(mshadow::Shape4(1, 1, 1, nword));
+    }
+  }
   /*! \brief random number generator */
   mshadow::Random<xpu> *prnd_;
   /*! \brief dropout  */
   real_t dropout_threshold;
+  /*! \brief how mask is kept between forward and backprop */
+  int mask_mode_;
+  /*! \brief number of threads of counter based generator, 0 to use prnd_ */
+  int rand_nthread_;
+  /*! \brief seed of counter based generator, set by the net */
+  uint64_t philox_seed_;
+  /*! \brief counter based generator of mask on cpu */
+  utils::PhiloxStream rng_;
 };  // class DropoutLayer
 }  // namespace layer
 }  // namespace cxxnet
@@ -0,0 +1,152 @@
+#ifndef CXXNET_LAYER_EMBEDDING_LAYER_INL_HPP_
+#define CXXNET_LAYER_EMBEDDING_LAYER_INL_HPP_
+/*!
+ * \file embedding_layer-inl.hpp
+ * \brief lookup of rows in a (vocab_size, nhidden) table, the input node
+ *   holds integer ids, the output is the concatenation of their rows
+ */
+#include <vector>
+#include <cstring>
+#include <mshadow/tensor.h>
+#include "./layer.h"
+#include "./param.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace layer {
+/*! \brief gather the rows of ids into out, cpu kernel is overloaded below */
+template<typename xpu>
+inline void EmbeddingForward(mshadow::Tensor<xpu, 2> ids,
+                             mshadow::Tensor<xpu, 2> wmat,
+                             mshadow::Tensor<xpu, 2> out) {
+  utils::Error("EmbeddingLayer: only supported on cpu");
+}
+/*! \brief add grad to the rows of ids in gwmat, appends the rows to rows */
+template<typename xpu>
+inline void EmbeddingBackward(mshadow::Tensor<xpu, 2> ids,
+                              mshadow::Tensor<xpu, 2> grad,
+                              mshadow::Tensor<xpu, 2> gwmat,
+                              std::vector<index_t> *rows) {
+  utils::Error("EmbeddingLayer: only supported on cpu");
+}
+/*! \brief check that a row of ids is in [0, vocab_size) */
+inline void EmbeddingCheckRow(mshadow::Tensor<cpu, 1> ids, index_t vocab_size) {
+  bool ok = true;
+  for (index_t j = 0; j < ids.size(0); ++j) {
+    ok = ok && ids[j] >= 0.0f && ids[j] < static_cast<real_t>(vocab_size);
+  }
+  utils::Check(ok, "EmbeddingLayer: id exceed vocab_size");
+}
+inline void EmbeddingForward(mshadow::Tensor<cpu, 2> ids,
+                             mshadow::Tensor<cpu, 2> wmat,
+                             mshadow::Tensor<cpu, 2> out) {
+  const index_t dim = wmat.size(1);
+  for (index_t i = 0; i < ids.size(0); ++i) {
+    EmbeddingCheckRow(ids[i], wmat.size(0));
+    for (index_t j = 0; j < ids.size(1); ++j) {
+      const index_t id = static_cast<index_t>(ids[i][j]);
+      const real_t *pw = wmat[id].dptr_;
+      real_t *po = out[i].dptr_ + j * dim;
+      for (index_t k = 0; k < dim; ++k) po[k] = pw[k];
+    }
+  }
+}
+inline void EmbeddingBackward(mshadow::Tensor<cpu, 2> ids,
+                              mshadow::Tensor<cpu, 2> grad,
+                              mshadow::Tensor<cpu, 2> gwmat,
+                              std::vector<index_t> *rows) {
+  const index_t dim = gwmat.size(1);
+  for (index_t i = 0; i < ids.size(0); ++i) {
+    EmbeddingCheckRow(ids[i], gwmat.size(0));
+    for (index_t j = 0; j < ids.size(1); ++j) {
+      const index_t id = static_cast<index_t>(ids[i][j]);
+      const real_t *pg = grad[i].dptr_ + j * dim;
+      real_t *pw = gwmat[id].dptr_;
+      for (index_t k = 0; k < dim; ++k) pw[k] += pg[k];
+      rows->push_back(id);
+    }
+  }
+}
+
+template<typename xpu>
+class EmbeddingLayer : public ILayer<xpu> {
+ public:
+  EmbeddingLayer(mshadow::Random<xpu> *p_rnd) : prnd_(p_rnd) {}
+  virtual ~EmbeddingLayer(void) {}
+  virtual void SetParam(const char *name, const char* val) {
+    param_.SetParam(name, val);
+    if (!strcmp(name, "vocab_size")) param_.num_input_node = atoi(val);
+  }
+  virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
+    pvisitor->Visit("wmat", wmat_, gwmat_);
+  }
+  virtual std::vector<index_t> *GradRows(const char *tag) {
+    if (!strcmp(tag, "wmat")) return &grad_rows_;
+    return NULL;
+  }
+  virtual void InitModel(void) {
+    wmat_.Resize(mshadow::Shape2(param_.num_input_node, param_.num_hidden));
+    param_.RandInitWeight(this->prnd_, wmat_, wmat_.size(0), wmat_.size(1));
+    gwmat_.Resize(wmat_.shape_);
+    gwmat_ = 0.0f;
+  }
+  virtual void SaveModel(utils::IStream &fo) const {
+    fo.Write(&param_, sizeof(LayerParam));
+    wmat_.SaveBinary(fo);
+  }
+  virtual void LoadModel(utils::IStream &fi) {
+    utils::Check(fi.Read(&param_, sizeof(LayerParam)) != 0,
+                 "EmbeddingLayer:LoadModel invalid model file");
+    wmat_.LoadBinary(fi);
+    gwmat_.Resize(wmat_.shape_);
+    gwmat_ = 0.0f;
+  }
+  virtual void SetStream(mshadow::Stream<xpu> *stream) {
+    wmat_.set_stream(stream);
+    gwmat_.set_stream(stream);
+  }
+  virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
+                              const std::vector<Node<xpu>*> &nodes_out,
+                              ConnectState<xpu> *p_cstate) {
+    utils::Check(xpu::kDevCPU, "EmbeddingLayer: only supported on cpu");
+    utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
+                 "EmbeddingLayer: Layer only support 1-1 connection");
+    utils::Check(nodes_in[0]->is_mat(), "EmbeddingLayer: input need to be a matrix of ids");
+    utils::Check(param_.num_hidden > 0, "EmbeddingLayer: must set nhidden correctly");
+    utils::Check(param_.num_input_node > 0, "EmbeddingLayer: must set vocab_size correctly");
+    nodes_out[0]->data.shape_ =
+        mshadow::Shape4(nodes_in[0]->data.size(0), 1, 1,
+                        nodes_in[0]->data.size(3) * param_.num_hidden);
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
+  virtual void Forward(bool is_train,
+                       const std::vector<Node<xpu>*> &nodes_in,
+                       const std::vector<Node<xpu>*> &nodes_out,
+                       ConnectState<xpu> *p_cstate) {
+    EmbeddingForward(nodes_in[0]->mat(), wmat_, nodes_out[0]->mat());
+  }
+  virtual void Backprop(bool prop_grad,
+                        const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out,
+                        ConnectState<xpu> *p_cstate) {
+    // only rows of the ids in the batch get gradient, ids get no gradient
+    EmbeddingBackward(nodes_in[0]->mat(), nodes_out[0]->mat(), gwmat_, &grad_rows_);
+  }
+
+ protected:
+  /*! \brief random number generator */
+  mshadow::Random<xpu> *prnd_;
+  /*! \brief parameters that potentially be useful */
+  LayerParam param_;
+  /*! \brief embedding table, of shape (vocab_size, nhidden) */
+  mshadow::TensorContainer<xpu,2> wmat_;
+  /*! \brief accumulates the gradient of the table */
+  mshadow::TensorContainer<xpu,2> gwmat_;
+  /*! \brief rows of gwmat_ touched since the last update, can repeat */
+  std::vector<index_t> grad_rows_;
+};
+}  // namespace layer
+}  // namespace cxxnet
+#endif  // CXXNET_LAYER_EMBEDDING_LAYER_INL_HPP_
@@ -1,25 +1,182 @@
 #ifndef CXXNET_LAYER_FIXCONN_LAYER_INL_HPP_
 #define CXXNET_LAYER_FIXCONN_LAYER_INL_HPP_
 
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./param.h"
 #include "./op.h"
 #include "../utils/utils.h"
+#include "../utils/io.h"
 
 namespace cxxnet {
 namespace layer {
+/*! \brief fixed connection matrix in CSR format, kept on cpu */
+struct FixConnCSR {
+  /*! \brief shape of the matrix */
+  unsigned nrow, ncol;
+  /*! \brief array[nrow + 1], start of each row in col and value */
+  std::vector<unsigned> row_ptr;
+  /*! \brief column index of each element */
+  std::vector<unsigned> col;
+  /*! \brief value of each element */
+  std::vector<float> value;
+  /*!
+   * \brief load from text file, the first line is nrow ncol nonzero,
+   *  followed by nonzero lines of row col value in any order
+   */
+  inline void LoadText(const char *fname) {
+    // read the whole file and parse it in memory
+    std::string buf;
+    {
+      utils::StdFile fi(fname, "rb");
+      buf.resize(fi.Size());
+      utils::Check(buf.length() == 0 || fi.Read(&buf[0], buf.length()) != 0,
+                   "FixConnLayer: fail to read fixconn_weight");
+    }
+    const char *p = buf.c_str();
+    unsigned nonzero = 0;
+    utils::Check(ParseUInt(&p, &nrow) && ParseUInt(&p, &ncol) && ParseUInt(&p, &nonzero),
+                 "FixConnLayer: fixconn_weight invalid sparse matrix format");
+    std::vector<unsigned> row(nonzero);
+    col.resize(nonzero); value.resize(nonzero);
+    for (unsigned i = 0; i < nonzero; ++i) {
+      char *end;
+      utils::Check(ParseUInt(&p, &row[i]) && ParseUInt(&p, &col[i]),
+                   "FixConnLayer: fixconn_weight invalid sparse matrix format");
+      value[i] = strtof(p, &end);
+      utils::Check(end != p, "FixConnLayer: fixconn_weight invalid sparse matrix format");
+      p = end;
+      utils::Check(row[i] < nrow && col[i] < ncol,
+                   "FixConnLayer: fixconn_weight index exceed matrix shape");
+    }
+    this->SortByRow(row);
+  }
+  /*!
+   * \brief load from binary file: uint32 nrow, uint32 ncol, then arrays
+   *  row_ptr, col and value, each as uint64 length followed by the elements
+   */
+  inline void LoadBinary(const char *fname) {
+    utils::StdFile file(fname, "rb");
+    utils::IStream &fi = file;
+    utils::Check(fi.Read(&nrow, sizeof(nrow)) != 0 && fi.Read(&ncol, sizeof(ncol)) != 0 &&
+                 fi.Read(&row_ptr) && fi.Read(&col) && fi.Read(&value),
+                 "FixConnLayer: fixconn_weight invalid binary format");
+    utils::Check(row_ptr.size() == nrow + 1 && row_ptr[0] == 0 &&
+                 row_ptr[nrow] == col.size() && col.size() == value.size(),
+                 "FixConnLayer: fixconn_weight invalid binary format");
+    // with row_ptr[0] == 0 and row_ptr[nrow] == col.size(), every row stays in bound
+    for (unsigned i = 0; i < nrow; ++i) {
+      utils::Check(row_ptr[i] <= row_ptr[i + 1],
+                   "FixConnLayer: fixconn_weight row_ptr must be non-decreasing");
+    }
+    for (size_t i = 0; i < col.size(); ++i) {
+      utils::Check(col[i] < ncol, "FixConnLayer: fixconn_weight index exceed matrix shape");
+    }
+  }
+
+ private:
+  inline static bool ParseUInt(const char **p, unsigned *out) {
+    char *end;
+    unsigned long v = strtoul(*p, &end, 10);
+    if (end == *p) return false;
+    *out = static_cast<unsigned>(v); *p = end;
+    return true;
+  }
+  // order of triplets by position, ties keep file order
+  struct PosLess {
+    const unsigned *row, *col;
+    PosLess(const unsigned *row, const unsigned *col) : row(row), col(col) {}
+    inline bool operator()(unsigned a, unsigned b) const {
+      return row[a] < row[b] || (row[a] == row[b] && col[a] < col[b]);
+    }
+  };
+  // sort the triplets into rows, the last one of a repeated position wins
+  inline void SortByRow(const std::vector<unsigned> &row) {
+    std::vector<unsigned> idx(row.size());
+    for (size_t i = 0; i < idx.size(); ++i) idx[i] = static_cast<unsigned>(i);
+    if (idx.size() != 0) {
+      std::stable_sort(idx.begin(), idx.end(), PosLess(&row[0], &col[0]));
+    }
+    std::vector<unsigned> c; std::vector<float> v;
+    row_ptr.assign(nrow + 1, 0);
+    for (size_t i = 0; i < idx.size(); ++i) {
+      const unsigned k = idx[i];
+      if (i + 1 < idx.size() && row[idx[i + 1]] == row[k] && col[idx[i + 1]] == col[k]) {
+        continue;
+      }
+      c.push_back(col[k]); v.push_back(value[k]);
+      ++row_ptr[row[k] + 1];
+    }
+    for (unsigned i = 0; i < nrow; ++i) row_ptr[i + 1] += row_ptr[i];
+    col.swap(c); value.swap(v);
+  }
+};
+/*! \brief out = in * csr.T(), cpu kernel is overloaded below */
+template<typename xpu>
+inline void FixConnForward(const FixConnCSR &csr,
+                           mshadow::Tensor<xpu, 2> in,
+                           mshadow::Tensor<xpu, 2> out) {
+  utils::Error("FixConnLayer: CSR weight is only supported on cpu");
+}
+/*! \brief in = out * csr */
+template<typename xpu>
+inline void FixConnBackward(const FixConnCSR &csr,
+                            mshadow::Tensor<xpu, 2> in,
+                            mshadow::Tensor<xpu, 2> out) {
+  utils::Error("FixConnLayer: CSR weight is only supported on cpu");
+}
+inline void FixConnForward(const FixConnCSR &csr,
+                           mshadow::Tensor<cpu, 2> in,
+                           mshadow::Tensor<cpu, 2> out) {
+  const unsigned *col = csr.col.size() != 0 ? &csr.col[0] : NULL;
+  const float *value = csr.value.size() != 0 ? &csr.value[0] : NULL;
+  for (index_t i = 0; i < in.size(0); ++i) {
+    const real_t *pi = in[i].dptr_;
+    real_t *po = out[i].dptr_;
+    for (unsigned r = 0; r < csr.nrow; ++r) {
+      real_t sum = 0.0f;
+      for (unsigned k = csr.row_ptr[r]; k < csr.row_ptr[r + 1]; ++k) {
+        sum += value[k] * pi[col[k]];
+      }
+      po[r] = sum;
+    }
+  }
+}
+inline void FixConnBackward(const FixConnCSR &csr,
+                            mshadow::Tensor<cpu, 2> in,
+                            mshadow::Tensor<cpu, 2> out) {
+  const unsigned *col = csr.col.size() != 0 ? &csr.col[0] : NULL;
+  const float *value = csr.value.size() != 0 ? &csr.value[0] : NULL;
+  in = 0.0f;
+  for (index_t i = 0; i < in.size(0); ++i) {
+    real_t *pi = in[i].dptr_;
+    const real_t *po = out[i].dptr_;
+    for (unsigned r = 0; r < csr.nrow; ++r) {
+      const real_t g = po[r];
+      if (g == 0.0f) continue;
+      for (unsigned k = csr.row_ptr[r]; k < csr.row_ptr[r + 1]; ++k) {
+        pi[col[k]] += g * value[k];
+      }
+    }
+  }
+}
 // layer that fix the con weight
 template<typename xpu>
 class FixConnectLayer : public ILayer<xpu> {
  public:
   FixConnectLayer(void) {
     fname_weight_ = "NULL";
+    binary_ = 0;
     init = false;
   }
   virtual void SetParam(const char *name, const char* val) {
     param_.SetParam(name, val);
     if (!strcmp(name, "fixconn_weight")) fname_weight_ = val;
+    if (!strcmp(name, "fixconn_binary")) binary_ = atoi(val);
   }
   virtual void SetStream(mshadow::Stream<xpu> *stream) {
     wmat_.set_stream(stream);
@@ -34,37 +191,38 @@ class FixConnectLayer : public ILayer<xpu> {
     // we change matrix convention
     nodes_out[0]->data.shape_ =
         mshadow::Shape4(nodes_in[0]->data.size(0), 1, 1, param_.num_hidden);
-    wmat_.Resize(mshadow::Shape2(param_.num_hidden, nodes_in[0]->mat().size(1)));
     utils::Check(fname_weight_ != "NULL", "FixConnLayer: must specify fixconn_weight");
-    // mshadow::TensorContainer<cpu, 2> tmp(false);
+    if (binary_ != 0) {
+      csr_.LoadBinary(fname_weight_.c_str());
+    } else {
+      csr_.LoadText(fname_weight_.c_str());
+    }
+    utils::Check(csr_.nrow == static_cast<unsigned>(param_.num_hidden) &&
+                 csr_.ncol == nodes_in[0]->mat().size(1),
+                 "FixConnLayer: fixconn_weight shape do not match architecture");
+    if (xpu::kDevCPU) return;
+    // dense weight on device, copied in first forward
+    wmat_.Resize(mshadow::Shape2(param_.num_hidden, nodes_in[0]->mat().size(1)));
     tmp.set_pad(false);
     tmp.Resize(wmat_.shape_); tmp = 0.0f;
-    FILE *fi = utils::FopenCheck(fname_weight_.c_str(), "r");
-    unsigned nrow, ncol, nonzero;
-    utils::Check(fscanf(fi, "%u%u%u", &nrow, &ncol, &nonzero) == 3,
-                 "FixConnLayer: fixconn_weight invalid sparse matrix format");
-    utils::Check(nrow == tmp.size(0) && ncol == tmp.size(1),
-                 "FixConnLayer: fixconn_weight shape do not match architecture");
-    while (nonzero--) {
-      float value;
-      unsigned x, y;
-      utils::Check(fscanf(fi, "%u%u%f", &x, &y, &value) == 3,
-                   "FixConnLayer: fixconn_weight invalid sparse matrix format");
-      utils::Check(x < tmp.size(0) && y < tmp.size(1),
-                   "FixConnLayer: fixconn_weight index exceed matrix shape");
-      tmp[x][y] = value;
+    for (unsigned r = 0; r < csr_.nrow; ++r) {
+      for (unsigned k = csr_.row_ptr[r]; k < csr_.row_ptr[r + 1]; ++k) {
+        tmp[r][csr_.col[k]] = csr_.value[k];
+      }
     }
-    fclose(fi);
-    //mshadow::Stream<xpu> *stream = wmat_.stream_;
-    // mshadow::Copy(wmat_, tmp, stream);
-    // must wait till copy end, otherwise tmp will be de-allocated
-    // if (stream != NULL) stream->Wait();
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
   }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
                        ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
+    if (xpu::kDevCPU) {
+      FixConnForward(csr_, nodes_in[0]->mat(), nodes_out[0]->mat());
+      return;
+    }
     if (!init) {
       mshadow::Copy(wmat_, tmp, wmat_.stream_);
       init = true;
@@ -76,16 +234,23 @@ class FixConnectLayer : public ILayer<xpu> {
                         const std::vector<Node<xpu>*> &nodes_out,
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
-    if (prop_grad) {
+    if (!prop_grad) return;
+    if (xpu::kDevCPU) {
+      FixConnBackward(csr_, nodes_in[0]->mat(), nodes_out[0]->mat());
+    } else {
       nodes_in[0]->mat() = dot(nodes_out[0]->mat(), wmat_);
     }
   }
  private:
   /*! \brief name to the weight */
   std::string fname_weight_;
+  /*! \brief whether the weight file is binary CSR */
+  int binary_;
   /*! \brief parameters that potentially be useful */
   LayerParam param_;
-  /*! \brief weight matrix */
+  /*! \brief weight matrix in CSR, used on cpu */
+  FixConnCSR csr_;
+  /*! \brief dense weight matrix, used on gpu */
   mshadow::TensorContainer<xpu, 2> wmat_;
   /*! \brief temp weight */
   mshadow::TensorContainer<cpu, 2> tmp;
@@ -20,11 +20,16 @@ class FlattenLayer : public ILayer<xpu> {
     nodes_out[0]->data.shape_ = 
         mshadow::Shape4(ishape[0], 1, 1, ishape[1] * ishape[2] * ishape[3]);
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
                        ConnectState<xpu> *p_cstate) {
-    using namespace mshadow::expr;    
+    using namespace mshadow::expr;
+    // output can be a reshape view of the input
+    if (nodes_out[0]->data.dptr_ == nodes_in[0]->data.dptr_) return;
     nodes_out[0]->data = reshape(nodes_in[0]->data, nodes_out[0]->data.shape_);
   }
   virtual void Backprop(bool prop_grad,
@@ -32,7 +37,7 @@ class FlattenLayer : public ILayer<xpu> {
                         const std::vector<Node<xpu>*> &nodes_out,
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
-    if (prop_grad) {
+    if (prop_grad && nodes_out[0]->data.dptr_ != nodes_in[0]->data.dptr_) {
       nodes_in[0]->data = reshape(nodes_out[0]->data, nodes_in[0]->data.shape_);
     }    
   }
@@ -1,20 +1,156 @@
 #ifndef CXXNET_LAYER_FULLC_LAYER_INL_HPP_
 #define CXXNET_LAYER_FULLC_LAYER_INL_HPP_
 
+#include <algorithm>
+#include <vector>
+#include <dmlc/omp.h>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./param.h"
 #include "./op.h"
 #include "../utils/utils.h"
+#include "../utils/io.h"
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief weight matrix in block sparse row format, the matrix is cut into
+ *   block x block tiles and only the non-zero tiles are kept, tiles on the
+ *   border are padded with zeros
+ */
+struct BlockSparseMat {
+  /*! \brief shape of the dense matrix */
+  unsigned nrow, ncol;
+  /*! \brief size of the tile */
+  unsigned block;
+  /*! \brief start of each row of tiles in col, of size nrow / block + 1 */
+  std::vector<unsigned> row_ptr;
+  /*! \brief column of each tile, in units of tiles */
+  std::vector<unsigned> col;
+  /*! \brief content of the tiles, block * block row major values per tile */
+  std::vector<float> value;
+  BlockSparseMat(void) : nrow(0), ncol(0), block(1) {}
+  /*! \brief number of kept tiles */
+  inline size_t num_block(void) const {
+    return col.size();
+  }
+  /*! \brief build from dense matrix, cpu version is overloaded below */
+  template<typename xpu>
+  inline void FromDense(mshadow::Tensor<xpu, 2> w, unsigned block) {
+    utils::Error("BlockSparseMat: only supported on cpu");
+  }
+  /*! \brief build from dense matrix, keeping the tiles with a non-zero entry */
+  inline void FromDense(mshadow::Tensor<cpu, 2> w, unsigned block) {
+    this->nrow = w.size(0); this->ncol = w.size(1); this->block = block;
+    const unsigned nbrow = (nrow + block - 1) / block;
+    const unsigned nbcol = (ncol + block - 1) / block;
+    row_ptr.resize(1, 0); col.clear(); value.clear();
+    for (unsigned br = 0; br < nbrow; ++br) {
+      const unsigned rn = std::min(block, nrow - br * block);
+      for (unsigned bc = 0; bc < nbcol; ++bc) {
+        const unsigned cn = std::min(block, ncol - bc * block);
+        bool nonzero = false;
+        for (unsigned r = 0; r < rn && !nonzero; ++r) {
+          const real_t *pw = w[br * block + r].dptr_ + bc * block;
+          for (unsigned c = 0; c < cn; ++c) {
+            if (pw[c] != 0.0f) {
+              nonzero = true; break;
+            }
+          }
+        }
+        if (!nonzero) continue;
+        const size_t top = value.size();
+        value.resize(top + block * block, 0.0f);
+        for (unsigned r = 0; r < rn; ++r) {
+          const real_t *pw = w[br * block + r].dptr_ + bc * block;
+          std::copy(pw, pw + cn, &value[top + r * block]);
+        }
+        col.push_back(bc);
+      }
+      row_ptr.push_back(static_cast<unsigned>(col.size()));
+    }
+  }
+  /*! \brief write the matrix into dense w, which has shape (nrow, ncol) */
+  inline void ToDense(mshadow::Tensor<cpu, 2> w) const {
+    w = 0.0f;
+    for (unsigned br = 0; br + 1 < row_ptr.size(); ++br) {
+      const unsigned rn = std::min(block, nrow - br * block);
+      for (unsigned k = row_ptr[br]; k < row_ptr[br + 1]; ++k) {
+        const unsigned cn = std::min(block, ncol - col[k] * block);
+        for (unsigned r = 0; r < rn; ++r) {
+          const float *pv = &value[k * block * block + r * block];
+          std::copy(pv, pv + cn, w[br * block + r].dptr_ + col[k] * block);
+        }
+      }
+    }
+  }
+  inline void Save(utils::IStream &fo) const {
+    fo.Write(&nrow, sizeof(nrow));
+    fo.Write(&ncol, sizeof(ncol));
+    fo.Write(&block, sizeof(block));
+    fo.Write(row_ptr);
+    fo.Write(col);
+    fo.Write(value);
+  }
+  inline void Load(utils::IStream &fi) {
+    utils::Check(fi.Read(&nrow, sizeof(nrow)) != 0 && fi.Read(&ncol, sizeof(ncol)) != 0 &&
+                 fi.Read(&block, sizeof(block)) != 0 &&
+                 fi.Read(&row_ptr) && fi.Read(&col) && fi.Read(&value),
+                 "BlockSparseMat: invalid model file");
+    utils::Check(block != 0 && row_ptr.size() == (nrow + block - 1) / block + 1 &&
+                 row_ptr.back() == col.size() &&
+                 value.size() == col.size() * block * block,
+                 "BlockSparseMat: invalid model file");
+  }
+};
+/*! \brief out = in * w.T(), cpu kernel is overloaded below */
+template<typename xpu>
+inline void BlockSparseDot(const BlockSparseMat &w,
+                           mshadow::Tensor<xpu, 2> in,
+                           mshadow::Tensor<xpu, 2> out) {
+  utils::Error("BlockSparseMat: only supported on cpu");
+}
+/*!
+ * \brief out = in * w.T(), each thread takes whole rows of tiles, so the
+ *   columns of out written by threads do not overlap
+ */
+inline void BlockSparseDot(const BlockSparseMat &w,
+                           mshadow::Tensor<cpu, 2> in,
+                           mshadow::Tensor<cpu, 2> out) {
+  const unsigned bs = w.block;
+  const int nbrow = static_cast<int>(w.row_ptr.size()) - 1;
+  const index_t nbatch = in.size(0);
+  #pragma omp parallel for schedule(static)
+  for (int br = 0; br < nbrow; ++br) {
+    const unsigned r0 = br * bs, rn = std::min(bs, w.nrow - r0);
+    for (index_t i = 0; i < nbatch; ++i) {
+      std::fill(out[i].dptr_ + r0, out[i].dptr_ + r0 + rn, 0.0f);
+    }
+    for (unsigned k = w.row_ptr[br]; k < w.row_ptr[br + 1]; ++k) {
+      const unsigned c0 = w.col[k] * bs, cn = std::min(bs, w.ncol - c0);
+      const float *pv = &w.value[k * bs * bs];
+      for (index_t i = 0; i < nbatch; ++i) {
+        const real_t *pi = in[i].dptr_ + c0;
+        real_t *po = out[i].dptr_ + r0;
+        for (unsigned r = 0; r < rn; ++r) {
+          const float *pvr = pv + r * bs;
+          real_t sum = 0.0f;
+          for (unsigned c = 0; c < cn; ++c) {
+            sum += pvr[c] * pi[c];
+          }
+          po[r] += sum;
+        }
+      }
+    }
+  }
+}
 
 template<typename xpu>
 class FullConnectLayer : public ILayer<xpu> {
  public:
   FullConnectLayer(mshadow::Random<xpu> *p_rnd) : prnd_(p_rnd) {
     fullc_gather = 0;
+    sparse_dirty_ = true;
   }
   virtual ~FullConnectLayer(void) {}
   virtual void SetParam(const char *name, const char* val) {
@@ -27,6 +163,8 @@ class FullConnectLayer : public ILayer<xpu> {
     }
   }
   virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
+    // the visitor may write the weight
+    sparse_dirty_ = true;
     pvisitor->Visit("wmat", wmat_, gwmat_);
     if (param_.no_bias == 0) {
       pvisitor->Visit("bias", bias_, gbias_);
@@ -45,13 +183,33 @@ class FullConnectLayer : public ILayer<xpu> {
   }
   virtual void SaveModel(utils::IStream &fo) const {
     fo.Write(&param_, sizeof(LayerParam));
-    wmat_.SaveBinary(fo);
+    if (param_.sparse_block != 0) {
+      mshadow::TensorContainer<cpu, 2> hwmat(false);
+      hwmat.Resize(wmat_.shape_);
+      mshadow::Copy(hwmat, wmat_, wmat_.stream_);
+      BlockSparseMat bsr;
+      bsr.FromDense(hwmat, static_cast<unsigned>(param_.sparse_block));
+      bsr.Save(fo);
+    } else {
+      wmat_.SaveBinary(fo);
+    }
     bias_.SaveBinary(fo);
   }
   virtual void LoadModel(utils::IStream &fi) {
     utils::Check(fi.Read(&param_, sizeof(LayerParam)) != 0,
                   "FullConnectLayer:LoadModel invalid model file");    
-    wmat_.LoadBinary(fi);
+    if (param_.sparse_block != 0) {
+      // pruned weight, dense copy is kept for training and device
+      bsr_.Load(fi);
+      mshadow::TensorContainer<cpu, 2> hwmat(false);
+      hwmat.Resize(mshadow::Shape2(bsr_.nrow, bsr_.ncol));
+      bsr_.ToDense(hwmat);
+      wmat_.Resize(hwmat.shape_);
+      mshadow::Copy(wmat_, hwmat, wmat_.stream_);
+      sparse_dirty_ = false;
+    } else {
+      wmat_.LoadBinary(fi);
+    }
     bias_.LoadBinary(fi);
     // setup gradient weight
     gwmat_.Resize(wmat_.shape_);
@@ -82,6 +240,9 @@ class FullConnectLayer : public ILayer<xpu> {
                    "FullcLayer: input hidden nodes is not consistent");
     }
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
@@ -94,6 +255,51 @@ class FullConnectLayer : public ILayer<xpu> {
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
     this->Backprop_(prop_grad, wmat_, nodes_in[0], nodes_out[0]);
+    sparse_dirty_ = true;
+  }
+  /*!
+   * \brief prune the weight by magnitude, zero the fraction ratio of
+   *   block x block tiles with smallest l2 norm, and keep the weight in
+   *   block sparse form from now on. only called on a cpu net by tools
+   */
+  inline void Prune(float ratio, int block) {
+    utils::Check(block > 0, "FullcLayer: prune block must be positive");
+    const unsigned bs = static_cast<unsigned>(block);
+    const unsigned nrow = wmat_.size(0), ncol = wmat_.size(1);
+    const unsigned nbrow = (nrow + bs - 1) / bs, nbcol = (ncol + bs - 1) / bs;
+    std::vector<std::pair<real_t, unsigned> > score;
+    for (unsigned br = 0; br < nbrow; ++br) {
+      for (unsigned bc = 0; bc < nbcol; ++bc) {
+        real_t sum = 0.0f;
+        for (unsigned r = br * bs; r < std::min(nrow, br * bs + bs); ++r) {
+          for (unsigned c = bc * bs; c < std::min(ncol, bc * bs + bs); ++c) {
+            sum += wmat_[r][c] * wmat_[r][c];
+          }
+        }
+        score.push_back(std::make_pair(sum, br * nbcol + bc));
+      }
+    }
+    std::sort(score.begin(), score.end());
+    const size_t nprune = static_cast<size_t>(ratio * score.size());
+    for (size_t i = 0; i < nprune && i < score.size(); ++i) {
+      const unsigned br = score[i].second / nbcol, bc = score[i].second % nbcol;
+      for (unsigned r = br * bs; r < std::min(nrow, br * bs + bs); ++r) {
+        for (unsigned c = bc * bs; c < std::min(ncol, bc * bs + bs); ++c) {
+          wmat_[r][c] = 0.0f;
+        }
+      }
+    }
+    param_.sparse_block = block;
+    bsr_.FromDense(wmat_, bs);
+    sparse_dirty_ = false;
+  }
+  /*! \brief weight in block sparse form, valid after Prune */
+  inline const BlockSparseMat &sparse_weight(void) const {
+    return bsr_;
+  }
+  /*! \brief dense weight matrix */
+  inline mshadow::Tensor<xpu, 2> weight(void) {
+    return wmat_;
   }
 
  protected:
@@ -105,7 +311,16 @@ class FullConnectLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 2> m_in = pnode_in->mat();
     mshadow::Tensor<xpu, 2> m_out = pnode_out->mat();
     index_t nbatch = m_in.size(0);
-    m_out = dot(m_in, wmat.T());
+    if (xpu::kDevCPU && param_.sparse_block != 0 && !is_train) {
+      // pruned weight, rebuilt when the dense weight may have changed
+      if (sparse_dirty_) {
+        bsr_.FromDense(wmat_, static_cast<unsigned>(param_.sparse_block));
+        sparse_dirty_ = false;
+      }
+      BlockSparseDot(bsr_, m_in, m_out);
+    } else {
+      m_out = dot(m_in, wmat.T());
+    }
     if (param_.no_bias == 0) {
       m_out += repmat(bias_, nbatch);
     }
@@ -143,6 +358,10 @@ class FullConnectLayer : public ILayer<xpu> {
   mshadow::TensorContainer<xpu,1> gbias_;
   /*! \brief use gather to do fullc */
   int fullc_gather;
+  /*! \brief weight in block sparse form, used in cpu inference if param_.sparse_block != 0 */
+  BlockSparseMat bsr_;
+  /*! \brief whether wmat_ may have changed since bsr_ was built */
+  bool sparse_dirty_;
 };
 }  // namespace layer
 }  // namespace cxxnet
@@ -0,0 +1,212 @@
+#ifndef CXXNET_LAYER_FUSED_ELEMENTWISE_LAYER_INL_HPP_
+#define CXXNET_LAYER_FUSED_ELEMENTWISE_LAYER_INL_HPP_
+/*!
+ * \file fused_elementwise_layer-inl.hpp
+ * \brief a chain of elementwise operations done in one pass over the node,
+ *   the chain is scale/shift, up to two activations and scale/shift between them
+ */
+#include <string>
+#include <cstdlib>
+#include <mshadow/tensor.h>
+#include "./layer.h"
+#include "./op.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace layer {
+/*! \brief activations allowed in the chain */
+const int kFusedIdentity = 0;
+const int kFusedRelu = 1;
+const int kFusedSigmoid = 2;
+const int kFusedTanh = 3;
+const int kFusedXelu = 4;
+/*!
+ * \brief the chain in normal form
+ *  out = act2(act1(in * scale[0] + shift[0]) * scale[1] + shift[1]) * scale[2] + shift[2]
+ */
+struct FusedElementwiseParam {
+  /*! \brief type of the two activations, kFusedIdentity if not used */
+  int act[2];
+  /*! \brief parameter of the activations, b of xelu */
+  real_t act_param[2];
+  /*! \brief affine transform before, between and after the activations */
+  real_t scale[3], shift[3];
+  FusedElementwiseParam(void) {
+    for (int i = 0; i < 2; ++i) {
+      act[i] = kFusedIdentity; act_param[i] = 0.0f;
+    }
+    for (int i = 0; i < 3; ++i) {
+      scale[i] = 1.0f; shift[i] = 0.0f;
+    }
+  }
+  /*!
+   * \brief set the chain from a comma separated list of operations,
+   *  each is relu, sigmoid, tanh, xelu[:b], scale:a or shift:b.
+   *  consecutive scale and shift are folded into one affine transform
+   */
+  inline void SetOps(const char *val) {
+    *this = FusedElementwiseParam();
+    int nact = 0;
+    std::string ops(val);
+    size_t start = 0;
+    while (start < ops.length()) {
+      size_t end = ops.find(',', start);
+      if (end == std::string::npos) end = ops.length();
+      std::string name = ops.substr(start, end - start);
+      real_t arg = 0.0f;
+      bool has_arg = false;
+      size_t colon = name.find(':');
+      if (colon != std::string::npos) {
+        arg = static_cast<real_t>(atof(name.c_str() + colon + 1));
+        name = name.substr(0, colon);
+        has_arg = true;
+      }
+      if (name == "scale") {
+        utils::Check(has_arg, "fused_elementwise: scale need a value, e.g. scale:0.5");
+        scale[nact] *= arg; shift[nact] *= arg;
+      } else if (name == "shift") {
+        utils::Check(has_arg, "fused_elementwise: shift need a value, e.g. shift:0.1");
+        shift[nact] += arg;
+      } else {
+        utils::Check(nact < 2, "fused_elementwise: at most two activations in ops");
+        if (name == "relu") {
+          act[nact] = kFusedRelu;
+        } else if (name == "sigmoid") {
+          act[nact] = kFusedSigmoid;
+        } else if (name == "tanh") {
+          act[nact] = kFusedTanh;
+        } else if (name == "xelu") {
+          act[nact] = kFusedXelu;
+          act_param[nact] = has_arg ? arg : 5.0f;
+        } else {
+          utils::Error("fused_elementwise: unknown op %s", name.c_str());
+        }
+        ++nact;
+      }
+      start = end + 1;
+    }
+  }
+};
+/*!
+ * \brief forward and backward of the chain, each as one mshadow expression.
+ *  Act and Grad are binary ops that take the activation parameter as second
+ *  operand, Grad is evaluated on the output of Act as in ActivationLayer
+ */
+template<typename Act1, typename Grad1, typename Act2, typename Grad2>
+struct FusedElementwise {
+  template<typename xpu>
+  inline static void Forward(mshadow::Tensor<xpu, 4> in,
+                             mshadow::Tensor<xpu, 4> out,
+                             const FusedElementwiseParam &p) {
+    using namespace mshadow::expr;
+    out = F<Act2>(F<Act1>(in * p.scale[0] + p.shift[0], p.act_param[0])
+                  * p.scale[1] + p.shift[1], p.act_param[1]) * p.scale[2] + p.shift[2];
+  }
+  /*! \brief in = d out / d in * grad, the activations are recomputed from in */
+  template<typename xpu>
+  inline static void Backward(mshadow::Tensor<xpu, 4> in,
+                              mshadow::Tensor<xpu, 4> grad,
+                              const FusedElementwiseParam &p) {
+    using namespace mshadow::expr;
+    const real_t scale = p.scale[0] * p.scale[1] * p.scale[2];
+    in = grad * F<Grad1>(F<Act1>(in * p.scale[0] + p.shift[0], p.act_param[0]), p.act_param[0])
+        * F<Grad2>(F<Act2>(F<Act1>(in * p.scale[0] + p.shift[0], p.act_param[0])
+                           * p.scale[1] + p.shift[1], p.act_param[1]), p.act_param[1])
+        * scale;
+  }
+};
+
+template<typename xpu>
+class FusedElementwiseLayer : public ILayer<xpu> {
+ public:
+  virtual ~FusedElementwiseLayer(void) {}
+  virtual void SetParam(const char *name, const char* val) {
+    if (!strcmp(name, "ops")) param_.SetOps(val);
+  }
+  virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
+                              const std::vector<Node<xpu>*> &nodes_out,
+                              ConnectState<xpu> *p_cstate) {
+    utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
+                 "FusedElementwiseLayer: only support 1-1 connection");
+    nodes_out[0]->data.shape_ = nodes_in[0]->data.shape_;
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
+  virtual void Forward(bool is_train,
+                       const std::vector<Node<xpu>*> &nodes_in,
+                       const std::vector<Node<xpu>*> &nodes_out,
+                       ConnectState<xpu> *p_cstate) {
+    this->Dispatch(false, nodes_in[0]->data, nodes_out[0]->data);
+  }
+  virtual void Backprop(bool prop_grad,
+                        const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out,
+                        ConnectState<xpu> *p_cstate) {
+    if (prop_grad) {
+      this->Dispatch(true, nodes_in[0]->data, nodes_out[0]->data);
+    }
+  }
+
+ private:
+  template<typename Act1, typename Grad1, typename Act2, typename Grad2>
+  inline void Run(bool backward,
+                  mshadow::Tensor<xpu, 4> in,
+                  mshadow::Tensor<xpu, 4> out) {
+    if (backward) {
+      FusedElementwise<Act1, Grad1, Act2, Grad2>::Backward(in, out, param_);
+    } else {
+      FusedElementwise<Act1, Grad1, Act2, Grad2>::Forward(in, out, param_);
+    }
+  }
+  // select the second activation
+  template<typename Act1, typename Grad1>
+  inline void Dispatch2(bool backward,
+                        mshadow::Tensor<xpu, 4> in,
+                        mshadow::Tensor<xpu, 4> out) {
+    switch (param_.act[1]) {
+      case kFusedIdentity:
+        this->template Run<Act1, Grad1, op::with_param<op::identity>,
+                           op::with_param<op::identity_grad> >(backward, in, out); break;
+      case kFusedRelu:
+        this->template Run<Act1, Grad1, op::with_param<op::relu>,
+                           op::with_param<op::relu_grad> >(backward, in, out); break;
+      case kFusedSigmoid:
+        this->template Run<Act1, Grad1, op::with_param<op::sigmoid>,
+                           op::with_param<op::sigmoid_grad> >(backward, in, out); break;
+      case kFusedTanh:
+        this->template Run<Act1, Grad1, op::with_param<op::tanh>,
+                           op::with_param<op::tanh_grad> >(backward, in, out); break;
+      case kFusedXelu:
+        this->template Run<Act1, Grad1, op::xelu, op::xelu_grad>(backward, in, out); break;
+      default: utils::Error("FusedElementwiseLayer: unknown activation");
+    }
+  }
+  // select the first activation
+  inline void Dispatch(bool backward,
+                       mshadow::Tensor<xpu, 4> in,
+                       mshadow::Tensor<xpu, 4> out) {
+    switch (param_.act[0]) {
+      case kFusedIdentity:
+        this->template Dispatch2<op::with_param<op::identity>,
+                                 op::with_param<op::identity_grad> >(backward, in, out); break;
+      case kFusedRelu:
+        this->template Dispatch2<op::with_param<op::relu>,
+                                 op::with_param<op::relu_grad> >(backward, in, out); break;
+      case kFusedSigmoid:
+        this->template Dispatch2<op::with_param<op::sigmoid>,
+                                 op::with_param<op::sigmoid_grad> >(backward, in, out); break;
+      case kFusedTanh:
+        this->template Dispatch2<op::with_param<op::tanh>,
+                                 op::with_param<op::tanh_grad> >(backward, in, out); break;
+      case kFusedXelu:
+        this->template Dispatch2<op::xelu, op::xelu_grad>(backward, in, out); break;
+      default: utils::Error("FusedElementwiseLayer: unknown activation");
+    }
+  }
+  /*! \brief the chain of operations */
+  FusedElementwiseParam param_;
+};
+}  // namespace layer
+}  // namespace cxxnet
+#endif  // CXXNET_LAYER_FUSED_ELEMENTWISE_LAYER_INL_HPP_
@@ -0,0 +1,147 @@
+#ifndef CXXNET_LAYER_GLOBAL_POOLING_LAYER_INL_HPP_
+#define CXXNET_LAYER_GLOBAL_POOLING_LAYER_INL_HPP_
+/*!
+ * \file global_pooling_layer-inl.hpp
+ * \brief pooling over the whole spatial plane of each channel,
+ *   output node is of shape (batch, channel, 1, 1)
+ */
+#include <mshadow/tensor.h>
+#include "./layer.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace layer {
+/*!
+ * \brief reduce each plane of in into out, cpu kernel is overloaded below
+ * \param tmp state of shape of out, keeps the pooled result for max pooling,
+ *        the cpu kernel keeps offset of the maximum of each plane instead
+ */
+template<int mode, typename xpu>
+inline void GlobalPoolForward(mshadow::Tensor<xpu, 4> in,
+                              mshadow::Tensor<xpu, 4> out,
+                              mshadow::Tensor<xpu, 4> tmp) {
+  using namespace mshadow::expr;
+  const index_t h = in.size(2), w = in.size(3);
+  mshadow::Shape<2> pshape = mshadow::Shape2(1, 1);
+  if (mode == kGlobalMaxPooling) {
+    tmp = pool<mshadow::red::maximum>(in, pshape, h, w, 1);
+    mshadow::Copy(out, tmp, out.stream_);
+  } else {
+    out = pool<mshadow::red::sum>(in, pshape, h, w, 1) * (1.0f / (h * w));
+  }
+}
+template<int mode, typename xpu>
+inline void GlobalPoolBackward(mshadow::Tensor<xpu, 4> in,
+                               mshadow::Tensor<xpu, 4> out,
+                               mshadow::Tensor<xpu, 4> tmp) {
+  using namespace mshadow::expr;
+  const index_t h = in.size(2), w = in.size(3);
+  if (mode == kGlobalMaxPooling) {
+    in = unpool<mshadow::red::maximum>(in, tmp, out, h, w, 1);
+  } else {
+    in = unpool<mshadow::red::sum>(in, tmp, out, h, w, 1) * (1.0f / (h * w));
+  }
+}
+template<int mode>
+inline void GlobalPoolForward(mshadow::Tensor<cpu, 4> in,
+                              mshadow::Tensor<cpu, 4> out,
+                              mshadow::Tensor<cpu, 4> tmp) {
+  const index_t h = in.size(2), w = in.size(3);
+  // argmax is stored as int32 in the state
+  int *argmax = reinterpret_cast<int*>(tmp.dptr_);
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      if (mode == kGlobalMaxPooling) {
+        real_t vmax = src[0][0]; int imax = 0;
+        for (index_t y = 0; y < h; ++y) {
+          const real_t *row = src[y].dptr_;
+          for (index_t x = 0; x < w; ++x) {
+            if (row[x] > vmax) {
+              vmax = row[x]; imax = static_cast<int>(y * src.stride_ + x);
+            }
+          }
+        }
+        out[n][c][0][0] = vmax;
+        argmax[n * in.size(1) + c] = imax;
+      } else {
+        // independent partial sums, so the loop can be vectorized
+        real_t sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (index_t y = 0; y < h; ++y) {
+          const real_t *row = src[y].dptr_;
+          index_t x = 0;
+          for (; x + 4 <= w; x += 4) {
+            sum[0] += row[x]; sum[1] += row[x + 1];
+            sum[2] += row[x + 2]; sum[3] += row[x + 3];
+          }
+          for (; x < w; ++x) sum[0] += row[x];
+        }
+        out[n][c][0][0] = (sum[0] + sum[1] + sum[2] + sum[3]) / (h * w);
+      }
+    }
+  }
+}
+template<int mode>
+inline void GlobalPoolBackward(mshadow::Tensor<cpu, 4> in,
+                               mshadow::Tensor<cpu, 4> out,
+                               mshadow::Tensor<cpu, 4> tmp) {
+  const index_t h = in.size(2), w = in.size(3);
+  const int *argmax = reinterpret_cast<const int*>(tmp.dptr_);
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      const real_t grad = out[n][c][0][0];
+      if (mode == kGlobalMaxPooling) {
+        src = 0.0f;
+        src.dptr_[argmax[n * in.size(1) + c]] = grad;
+      } else {
+        src = grad / (h * w);
+      }
+    }
+  }
+}
+
+template<int mode, typename xpu>
+class GlobalPoolingLayer : public ILayer<xpu> {
+ public:
+  virtual ~GlobalPoolingLayer(void) {}
+  virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
+                              const std::vector<Node<xpu>*> &nodes_out,
+                              ConnectState<xpu> *p_cstate) {
+    utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
+                 "GlobalPoolingLayer: only support 1-1 connection");
+    mshadow::Shape<4> ishape = nodes_in[0]->data.shape_;
+    nodes_out[0]->data.shape_ = mshadow::Shape4(ishape[0], ishape[1], 1, 1);
+    // pooled result for max pooling, argmax index on cpu
+    p_cstate->states.resize(1);
+    p_cstate->states[0].set_pad(false);
+    p_cstate->states[0].Resize(nodes_out[0]->data.shape_);
+  }
+  virtual void OnBatchSizeChanged(const std::vector<Node<xpu>*> &nodes_in,
+                                  const std::vector<Node<xpu>*> &nodes_out,
+                                  ConnectState<xpu> *p_cstate) {
+    p_cstate->states[0].Resize(nodes_out[0]->data.shape_);
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
+  virtual void Forward(bool is_train,
+                       const std::vector<Node<xpu>*> &nodes_in,
+                       const std::vector<Node<xpu>*> &nodes_out,
+                       ConnectState<xpu> *p_cstate) {
+    GlobalPoolForward<mode>(nodes_in[0]->data, nodes_out[0]->data,
+                            p_cstate->states[0]);
+  }
+  virtual void Backprop(bool prop_grad,
+                        const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out,
+                        ConnectState<xpu> *p_cstate) {
+    if (prop_grad) {
+      GlobalPoolBackward<mode>(nodes_in[0]->data, nodes_out[0]->data,
+                               p_cstate->states[0]);
+    }
+  }
+};
+}  // namespace layer
+}  // namespace cxxnet
+#endif  // LAYER_GLOBAL_POOLING_LAYER_INL_HPP_
@@ -5,6 +5,7 @@
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./op.h"
+#include "../utils/philox.h"
 
 
 namespace cxxnet {
@@ -22,18 +23,28 @@ class InsanityLayer : public ILayer<xpu> {
     saturation_end_ = 0;
     delta_ = 0.0f;
     init_ = false;
+    rand_nthread_ = 0;
+    philox_seed_ = 0;
   }
   virtual void SetParam(const char *name, const char* val) {
     if (!strcmp("lb", name)) lb_ = atof(val);
     if (!strcmp("ub", name)) ub_ = atof(val);
     if (!strcmp("calm_start", name)) saturation_start_ = atol(val);
     if (!strcmp("calm_end",  name)) saturation_end_ = atol(val);
+    if (!strcmp("rand_nthread", name)) rand_nthread_ = atoi(val);
+    if (!strcmp("philox_seed", name)) philox_seed_ = utils::ParsePhiloxSeed(val);
   }
   virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                               const std::vector<Node<xpu>*> &nodes_out,
                               ConnectState<xpu> *p_cstate) {
     utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
                  "InsanityLayer: only support 1-1 connection");
+    if (xpu::kDevCPU && rand_nthread_ != 0) {
+      rng_.Seed(philox_seed_);
+      rng_.set_nthread(rand_nthread_);
+    } else {
+      rand_nthread_ = 0;
+    }
     // use 1 temp state for mask
     p_cstate->states.resize(1);
     p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
@@ -44,6 +55,9 @@ class InsanityLayer : public ILayer<xpu> {
                                   ConnectState<xpu> *p_cstate) {
     p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
   }
+  virtual bool ForwardInPlace(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
@@ -62,15 +76,23 @@ class InsanityLayer : public ILayer<xpu> {
     }
     mshadow::TensorContainer<xpu,4> &mask = p_cstate->states[0];
     if (is_train) {
-      mask = prnd_->uniform(mask.shape_);
-      mask = mask * (ub_ - lb_) + lb_;
+      if (rand_nthread_ != 0) {
+        rng_.SampleUniform(mask.FlatTo2D(), lb_, ub_);
+      } else {
+        mask = prnd_->uniform(mask.shape_);
+        mask = mask * (ub_ - lb_) + lb_;
+      }
       nodes_in[0]->data = F<op::xelu>(nodes_in[0]->data, mask);
-      mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+      if (nodes_out[0]->data.dptr_ != nodes_in[0]->data.dptr_) {
+        mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+      }
     } else {
       // nodes_in[0]->data = F<op::xelu>(nodes_in[0]->data, (ub_ - lb_) / (log(ub_) - log(lb_)));
       // better performance
       nodes_in[0]->data = F<op::xelu>(nodes_in[0]->data, (ub_ + lb_) / 2.0f);
-      mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+      if (nodes_out[0]->data.dptr_ != nodes_in[0]->data.dptr_) {
+        mshadow::Copy(nodes_out[0]->data, nodes_in[0]->data, nodes_out[0]->data.stream_);
+      }
     }
   }
   virtual void Backprop(bool prop_grad,
@@ -87,6 +109,12 @@ class InsanityLayer : public ILayer<xpu> {
  private:
   /*! \brief random number generator */
   mshadow::Random<xpu> *prnd_;
+  /*! \brief number of threads of counter based generator, 0 to use prnd_ */
+  int rand_nthread_;
+  /*! \brief seed of counter based generator, set by the net */
+  uint64_t philox_seed_;
+  /*! \brief counter based generator on cpu */
+  utils::PhiloxStream rng_;
   /*! \brief whether initialized */
   bool init_;
   /*! \brief lower bound */
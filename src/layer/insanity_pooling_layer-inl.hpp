@@ -5,6 +5,7 @@
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./param.h"
+#include "../utils/philox.h"
 
 namespace mshadow {
 namespace expr {
@@ -224,16 +225,28 @@ class InsanityPoolingLayer : public PoolingLayer<Reducer, mode, xpu> {
   private:
     typedef PoolingLayer<Reducer, mode, xpu> Parent;
   public:
-    InsanityPoolingLayer(mshadow::Random<xpu> *p_rnd) : prnd(p_rnd) {p_keep = 1.0f;};
+    InsanityPoolingLayer(mshadow::Random<xpu> *p_rnd) : prnd(p_rnd) {
+      p_keep = 1.0f;
+      rand_nthread = 0;
+      philox_seed = 0;
+    }
     virtual ~InsanityPoolingLayer() {}
     virtual void SetParam(const char *name, const char *val) {
       Parent::SetParam(name, val);
       if (!strcmp(name, "keep")) p_keep = atof(val);
+      if (!strcmp(name, "rand_nthread")) rand_nthread = atoi(val);
+      if (!strcmp(name, "philox_seed")) philox_seed = utils::ParsePhiloxSeed(val);
     }
     virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                                 const std::vector<Node<xpu>*> &nodes_out,
                                 ConnectState<xpu> *p_cstate) {
       this->InitNode(nodes_in, nodes_out, p_cstate);
+      if (xpu::kDevCPU && rand_nthread != 0) {
+        rng.Seed(philox_seed);
+        rng.set_nthread(rand_nthread);
+      } else {
+        rand_nthread = 0;
+      }
     }
     virtual void Forward(bool is_train,
                          const std::vector<Node<xpu>*> &nodes_in,
@@ -244,7 +257,11 @@ class InsanityPoolingLayer : public PoolingLayer<Reducer, mode, xpu> {
       mshadow::Shape<2> pshape = nodes_out[0]->data[0][0].shape_;
       using namespace mshadow::expr;
       if (is_train) {
-        mask = prnd->uniform(mask.shape_);
+        if (rand_nthread != 0) {
+          rng.SampleUniform(mask.FlatTo2D(), 0.0f, 1.0f);
+        } else {
+          mask = prnd->uniform(mask.shape_);
+        }
         tmp = insanity_pool<Reducer>(nodes_in[0]->data, mask,
                                      Parent::param_.kernel_height,
                                      Parent::param_.kernel_width,
@@ -283,6 +300,12 @@ class InsanityPoolingLayer : public PoolingLayer<Reducer, mode, xpu> {
   private:
     mshadow::Random<xpu> *prnd;
     float p_keep;
+    /*! \brief number of threads of counter based generator, 0 to use prnd */
+    int rand_nthread;
+    /*! \brief seed of counter based generator, set by the net */
+    uint64_t philox_seed;
+    /*! \brief counter based generator on cpu */
+    utils::PhiloxStream rng;
 }; // class InsanityPoolingLayer
 
 } // namespace layer
@@ -7,12 +7,14 @@
  */
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <string>
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
 #include "../global.h"
 #include "../utils/utils.h"
 #include "../utils/io.h"
+#include "../io/data.h"
 #if CXXNET_USE_CUDNN == 1
  #ifdef __CUDACC__
   #include <cudnn.h>
@@ -23,6 +25,29 @@
 namespace cxxnet {
 /*! \brief namespace of layer defintiion */
 namespace layer {
+/*!
+ * \brief rows of a sparse input batch in CSR format, the content is
+ *   kept on cpu and owned by the data iterator
+ */
+struct SparseInput {
+  /*! \brief array[nrow + 1], row pointer of each row into data */
+  const size_t *row_ptr;
+  /*! \brief content of the sparse elements */
+  const SparseInst::Entry *data;
+  /*! \brief number of rows */
+  index_t nrow;
+  // constructor
+  SparseInput(void) : row_ptr(NULL), data(NULL), nrow(0) {}
+  /*! \brief take rows [begin, end) */
+  inline SparseInput Slice(index_t begin, index_t end) const {
+    SparseInput ret;
+    if (row_ptr == NULL) return ret;
+    ret.row_ptr = row_ptr + begin;
+    ret.data = data;
+    ret.nrow = end - begin;
+    return ret;
+  }
+};
 /*!
  * \brief node structure, this is used to store forward activation,
  *    and backproped gradient in the network
@@ -40,9 +65,30 @@ struct Node {
   /*! \brief whether the underlying data must be contiguous */
   bool must_contiguous;
   bool inited;
+  /*!
+   * \brief if not NULL, the node does not own memory but is a view of
+   *  this node, set by the net before space is allocated
+   */
+  Node<xpu> *alias_src;
+  /*! \brief offset of the view in the last dimension of alias_src */
+  index_t alias_offset;
+  /*!
+   * \brief whether the view only lasts through forward, the node then
+   *  gets its own memory in buffer by Materialize before backprop
+   */
+  bool alias_lazy;
+  /*! \brief own memory of a lazy view, allocated on first use */
+  mshadow::Tensor<xpu, 4> buffer;
+  /*!
+   * \brief sparse content of the node, only set on the input node
+   *  when the batch is sparse, data is then not filled
+   */
+  SparseInput sparse;
   // constructor
-  Node(void) : must_contiguous(false) {
+  Node(void) : must_contiguous(false), alias_src(NULL), alias_offset(0),
+               alias_lazy(false) {
     data.shape_ = mshadow::Shape4(0,0,0,0);
+    buffer.dptr_ = NULL;
     inited = false;
   }
   /*! \brief matrix view of the node */
@@ -53,15 +99,73 @@ struct Node {
   inline bool is_mat(void) const {
     return data.size(1) == 1 && data.size(2) == 1;
   }
+  /*!
+   * \brief make the node a view of src, columns [offset, offset + size(3))
+   *  of src when the first three dimensions agree, otherwise a reshape
+   *  of src, which then must be contiguous
+   */
+  inline void Alias(Node<xpu> *src, index_t offset) {
+    alias_src = src;
+    alias_offset = offset;
+    if (!this->is_slice_of(*src)) {
+      CHECK(offset == 0 && data.shape_.Size() == src->data.shape_.Size())
+          << "Node: reshape view must cover whole node";
+      src->must_contiguous = true;
+    }
+  }
+  /*!
+   * \brief make the node the same as src in forward, the content is copied
+   *  into its own memory by Materialize before the node is used in backprop
+   */
+  inline void AliasUntilBackprop(Node<xpu> *src) {
+    CHECK(data.shape_ == src->data.shape_) << "Node: lazy view must be of same shape";
+    alias_src = src;
+    alias_offset = 0;
+    alias_lazy = true;
+  }
+  /*! \brief point a lazy view back to its source */
+  inline void ResetView(void) {
+    if (!alias_lazy) return;
+    data.dptr_ = alias_src->data.dptr_;
+    data.stride_ = alias_src->data.stride_;
+  }
+  /*! \brief copy content of a lazy view into own memory and use it from now on */
+  inline void Materialize(mshadow::Stream<xpu> *stream) {
+    if (!alias_lazy || data.dptr_ == buffer.dptr_) return;
+    if (buffer.dptr_ == NULL) {
+      // buffer.shape_ keeps the full shape set in AllocSpace
+      mshadow::AllocSpace(&buffer, !must_contiguous);
+    }
+    buffer.shape_ = data.shape_;
+    mshadow::Copy(buffer, data, stream);
+    data.dptr_ = buffer.dptr_;
+    data.stride_ = buffer.stride_;
+  }
   /*! \brief helper rountine to free space */
   inline void FreeSpace(void) {
-    if (inited){
+    if (inited && alias_lazy) {
+      if (buffer.dptr_ != NULL) mshadow::FreeSpace(&buffer);
+      buffer.dptr_ = NULL;
+    } else if (inited && alias_src == NULL){
       mshadow::FreeSpace(&data);
     }
+    inited = false;
   }
   /*! \brief helper rountine to allocate space */
   inline void AllocSpace(void) {
-    if (must_contiguous) {
+    if (inited) return;
+    if (alias_lazy) {
+      alias_src->AllocSpace();
+      buffer.shape_ = data.shape_;
+      this->ResetView();
+    } else if (alias_src != NULL) {
+      alias_src->AllocSpace();
+      const mshadow::Tensor<xpu, 4> &src = alias_src->data;
+      data.dptr_ = src.dptr_ + alias_offset;
+      data.stride_ = this->is_slice_of(*alias_src) ? src.stride_ : data.size(3);
+      CHECK(!must_contiguous || data.CheckContiguous())
+          << "Node: view of another node is not contiguous";
+    } else if (must_contiguous) {
       mshadow::AllocSpace(&data, false);
       CHECK(data.CheckContiguous());
     } else {
@@ -69,6 +173,12 @@ struct Node {
     }
     inited = true;
   }
+
+ private:
+  inline bool is_slice_of(const Node<xpu> &src) const {
+    return data.size(0) == src.data.size(0) && data.size(1) == src.data.size(1) &&
+        data.size(2) == src.data.size(2);
+  }
 }; // struct Node
 
 /*!
@@ -120,6 +230,47 @@ struct LabelInfo {
     return ret;
   }
 };
+/*!
+ * \brief scratch space shared by all the connections in a net
+ *   connections run one at a time, so temporal data that does not go
+ *   across forward/backprop can be taken from this space instead of being kept in the layer.
+ *   a layer requests the size it needs in InitConnection, the net allocates
+ *   the maximum request once, and the layer takes views of it in Forward/Backprop
+ */
+template<typename xpu>
+struct Workspace {
+  /*! \brief the space */
+  mshadow::TensorContainer<xpu, 1> data;
+  /*! \brief maximum number of elements requested */
+  size_t max_request;
+  // constructor
+  Workspace(void) : data(false), max_request(0) {}
+  /*!
+   * \brief request space, called in InitConnection
+   * \param size number of elements needed
+   */
+  inline void Request(size_t size) {
+    max_request = std::max(max_request, size);
+  }
+  /*! \brief allocate space that satisfies all the requests */
+  inline void AllocSpace(void) {
+    if (data.size(0) < max_request) {
+      data.Resize(mshadow::Shape1(max_request));
+    }
+  }
+  /*!
+   * \brief get a contiguous view of the space
+   * \param shape shape of the view
+   * \param offset offset in number of elements from the beginning of the space
+   */
+  template<int dim>
+  inline mshadow::Tensor<xpu, dim> Get(mshadow::Shape<dim> shape, size_t offset = 0) {
+    utils::Check(offset + shape.Size() <= data.size(0),
+                 "Workspace: view exceed the requested space");
+    return mshadow::Tensor<xpu, dim>(data.dptr_ + offset, shape,
+                                     shape[dim - 1], data.stream_);
+  }
+};
 /*!
  * \brief connection states
  *   temporal state space that can be used to share information between forward and backprop
@@ -129,6 +280,10 @@ template<typename xpu>
 struct ConnectState {
   /*! \brief the contents of states */
   std::vector< mshadow::TensorContainer<xpu, 4> > states;
+  /*! \brief scratch space shared with other connections, set by the net */
+  Workspace<xpu> *workspace;
+  // constructor
+  ConnectState(void) : workspace(NULL) {}
 };
 
 /*!
@@ -190,6 +345,31 @@ class ILayer {
     virtual void Visit(const char *field_name,
                        mshadow::Tensor<xpu, 4> weight,
                        mshadow::Tensor<xpu, 4> grad) = 0;
+    /*!
+     * \brief visit weight and gradient owned by the layer in containers,
+     *    the visitor can move them into memory it owns, see nnet::ParamArena.
+     *    in default it visits them as tensors
+     */
+    virtual void Visit(const char *field_name,
+                       mshadow::TensorContainer<xpu, 1> &weight,
+                       mshadow::TensorContainer<xpu, 1> &grad) {
+      this->Visit(field_name, mshadow::Tensor<xpu, 1>(weight), mshadow::Tensor<xpu, 1>(grad));
+    }
+    virtual void Visit(const char *field_name,
+                       mshadow::TensorContainer<xpu, 2> &weight,
+                       mshadow::TensorContainer<xpu, 2> &grad) {
+      this->Visit(field_name, mshadow::Tensor<xpu, 2>(weight), mshadow::Tensor<xpu, 2>(grad));
+    }
+    virtual void Visit(const char *field_name,
+                       mshadow::TensorContainer<xpu, 3> &weight,
+                       mshadow::TensorContainer<xpu, 3> &grad) {
+      this->Visit(field_name, mshadow::Tensor<xpu, 3>(weight), mshadow::Tensor<xpu, 3>(grad));
+    }
+    virtual void Visit(const char *field_name,
+                       mshadow::TensorContainer<xpu, 4> &weight,
+                       mshadow::TensorContainer<xpu, 4> &grad) {
+      this->Visit(field_name, mshadow::Tensor<xpu, 4>(weight), mshadow::Tensor<xpu, 4>(grad));
+    }
   };
  public:
   /*! \brief virtual destructor */
@@ -247,6 +427,28 @@ class ILayer {
   virtual bool AllowSharing(void) const {
     return true;
   }
+  /*!
+   * \brief return whether Forward leaves the content of nodes_in unchanged,
+   *  an input node can be shared with other nodes only if all its readers do
+   */
+  virtual bool ForwardKeepsInput(void) const {
+    return false;
+  }
+  /*!
+   * \brief return whether Forward computes the result in place in nodes_in[0]
+   *  and only copies it to nodes_out[0], which can then share the input memory
+   */
+  virtual bool ForwardInPlace(void) const {
+    return false;
+  }
+  /*!
+   * \brief return the rows of the gradient of weight tag that can be non-zero
+   *  since last update, NULL if the gradient is dense. the updater
+   *  updates only these rows and clears the list after each update
+   */
+  virtual std::vector<index_t> *GradRows(const char *tag) {
+    return NULL;
+  }
   /*!
    * \brief set the stream of internal computation to be stream
    * \param stream the stream to be used
@@ -313,6 +515,12 @@ const int kPRelu = 29;
 const int kBatchNorm = 30;
 const int kFixConnect = 31;
 const int kBatchNorm_no_ma = 32;
+const int kGlobalAvgPooling = 33;
+const int kGlobalMaxPooling = 34;
+const int kSparseFullConnect = 35;
+const int kEmbedding = 36;
+const int kFusedElementwise = 37;
+const int kConvBNRelu = 38;
 /*! \brief gap used to encode pairtest layer */
 const int kPairTestGap = 1024;
 /*! \brief use integer to encode layer types */
@@ -324,20 +532,26 @@ typedef int LayerType;
 inline LayerType GetLayerType(const char *type) {
   if (!strncmp(type, "share", 5)) return kSharedLayer;
   if (!strcmp(type, "fullc")) return kFullConnect;
+  if (!strcmp(type, "sparse_fullc")) return kSparseFullConnect;
+  if (!strcmp(type, "embedding")) return kEmbedding;
   if (!strcmp(type, "fixconn")) return kFixConnect;
   if (!strcmp(type, "bias")) return kBias;
   if (!strcmp(type, "softmax")) return kSoftmax;
   if (!strcmp(type, "relu")) return kRectifiedLinear;
   if (!strcmp(type, "sigmoid")) return kSigmoid;
+  if (!strcmp(type, "fused_elementwise")) return kFusedElementwise;
   if (!strcmp(type, "tanh")) return kTanh;
   if (!strcmp(type, "softplus")) return kSoftplus;
   if (!strcmp(type, "flatten")) return kFlatten;
   if (!strcmp(type, "dropout")) return kDropout;
   if (!strcmp(type, "conv")) return kConv;
+  if (!strcmp(type, "conv_bn_relu")) return kConvBNRelu;
   if (!strcmp(type, "relu_max_pooling")) return kReluMaxPooling;
   if (!strcmp(type, "max_pooling")) return kMaxPooling;
   if (!strcmp(type, "sum_pooling")) return kSumPooling;
   if (!strcmp(type, "avg_pooling")) return kAvgPooling;
+  if (!strcmp(type, "global_avg_pooling")) return kGlobalAvgPooling;
+  if (!strcmp(type, "global_max_pooling")) return kGlobalMaxPooling;
   if (!strcmp(type, "lrn")) return kLRN;
   if (!strcmp(type, "concat")) return kConcat;
   if (!strcmp(type, "xelu")) return kXelu;
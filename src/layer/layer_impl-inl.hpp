@@ -8,19 +8,24 @@
 #include "./layer.h"
 #include "./activation_layer-inl.hpp"
 #include "./convolution_layer-inl.hpp"
+#include "./conv_bn_relu_layer-inl.hpp"
 #include "./bias_layer-inl.hpp"
 #include "./dropout_layer-inl.hpp"
 #include "./fullc_layer-inl.hpp"
+#include "./sparse_fullc_layer-inl.hpp"
+#include "./embedding_layer-inl.hpp"
 #include "./fixconn_layer-inl.hpp"
 #include "./lrn_layer-inl.hpp"
 #include "./flatten_layer-inl.hpp"
 #include "./pooling_layer-inl.hpp"
+#include "./global_pooling_layer-inl.hpp"
 #include "./pairtest_layer-inl.hpp"
 #include "./concat_layer-inl.hpp"
 #include "./cudnn_convolution_layer-inl.hpp"
 #include "./split_layer-inl.hpp"
 #include "./cudnn_pooling_layer-inl.hpp"
 #include "./xelu_layer-inl.hpp"
+#include "./fused_elementwise_layer-inl.hpp"
 #include "./insanity_layer-inl.hpp"
 #include "./insanity_pooling_layer-inl.hpp"
 #include "./prelu_layer-inl.hpp"
@@ -46,9 +51,12 @@ ILayer<xpu>* CreateLayer_(LayerType type,
     case kTanh: return new ActivationLayer<xpu, op::tanh, op::tanh_grad>();
     case kRectifiedLinear: return new ActivationLayer<xpu, op::relu, op::relu_grad>();
     case kConv: return new CuDNNConvolutionLayer<xpu>(p_rnd);
+    case kConvBNRelu: return new ConvBNReluLayer<xpu>(p_rnd);
     case kBias: return new BiasLayer<xpu>();
     case kDropout: return new DropoutLayer<xpu>(p_rnd);
     case kFullConnect: return new FullConnectLayer<xpu>(p_rnd);
+    case kSparseFullConnect: return new SparseFullConnectLayer<xpu>(p_rnd);
+    case kEmbedding: return new EmbeddingLayer<xpu>(p_rnd);
     case kFixConnect: return new FixConnectLayer<xpu>();
     case kLRN: return new LRNLayer<xpu>();
     case kFlatten: return new FlattenLayer<xpu>();
@@ -57,11 +65,14 @@ ILayer<xpu>* CreateLayer_(LayerType type,
     case kMaxPooling: return new CuDNNPoolingLayer<mshadow::red::maximum, kMaxPooling, xpu>();
     case kSumPooling: return new PoolingLayer<mshadow::red::sum, kSumPooling, xpu>();
     case kAvgPooling: return new CuDNNPoolingLayer<mshadow::red::sum, kAvgPooling, xpu>();
+    case kGlobalAvgPooling: return new GlobalPoolingLayer<kGlobalAvgPooling, xpu>();
+    case kGlobalMaxPooling: return new GlobalPoolingLayer<kGlobalMaxPooling, xpu>();
     case kSoftmax: return new SoftmaxLayer<xpu>(label_info);
     case kConcat: return new ConcatLayer<xpu, 3>();
     case kChConcat: return new ConcatLayer<xpu, 1>();
     case kSplit: return new SplitLayer<xpu>();
     case kXelu: return new XeluLayer<xpu>();
+    case kFusedElementwise: return new FusedElementwiseLayer<xpu>();
     case kInsanity: return new InsanityLayer<xpu>(p_rnd);
     case kInsanityPooling: return new InsanityPoolingLayer<mshadow::red::maximum, kMaxPooling, xpu>(p_rnd);
     case kPRelu: return new PReluLayer<xpu>(p_rnd);
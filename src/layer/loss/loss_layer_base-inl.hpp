@@ -12,7 +12,7 @@ template<typename xpu>
 class LossLayerBase: public ILayer<xpu> {
  public:
   LossLayerBase(const LabelInfo *label_info)
-      : stream_(NULL) {
+      : stream_(NULL), dlabel_(false) {
     this->plabelinfo = label_info;
     this->target = "label";
     update_period = 1;
@@ -54,11 +54,11 @@ class LossLayerBase: public ILayer<xpu> {
                         const std::vector<Node<xpu>*> &nodes_out,
                         ConnectState<xpu> *p_cstate) {
     CHECK(target_index < plabelinfo->fields.size());
-    this->SetGrad(nodes_in[0]->mat(),
-                  plabelinfo->fields[target_index],
-                  stream_);                  
     // scale gradient by dividing global batch size
-    nodes_in[0]->mat() *= (grad_scale / (batch_size * update_period));
+    this->SetGradScaled(nodes_in[0]->mat(),
+                        plabelinfo->fields[target_index],
+                        grad_scale / (batch_size * update_period),
+                        stream_);
   }
   
  protected:
@@ -93,6 +93,35 @@ class LossLayerBase: public ILayer<xpu> {
     this->SetGradCPU(temp_, label);
     mshadow::Copy(inout_data, temp_, stream);
   }
+  /*!
+   * \brief set the gradient value multiplied by scale, by default SetGrad
+   *  followed by scaling, child class can override it to do both in one pass
+   * \param inout_data the data used as both input and output
+   * \param label label sequence of the data
+   * \param scale the scale of gradient
+   * \param stream the computing stream
+   */
+  virtual void SetGradScaled(mshadow::Tensor<xpu, 2> inout_data,
+                             const LabelRecord &label,
+                             real_t scale,
+                             mshadow::Stream<xpu> *stream) {
+    this->SetGrad(inout_data, label, stream);
+    inout_data *= scale;
+  }
+  /*!
+   * \brief copy the label into device memory of the layer, so SetGrad
+   *  can be done by device side expressions without copying inout_data
+   * \param label label sequence of the data
+   * \param stream the computing stream
+   * \return label on device, of the same shape as label.label
+   */
+  inline mshadow::Tensor<xpu, 2> StageLabel(const LabelRecord &label,
+                                            mshadow::Stream<xpu> *stream) {
+    dlabel_.set_stream(stream);
+    dlabel_.Resize(label.label.shape_);
+    mshadow::Copy(dlabel_, label.label, stream);
+    return dlabel_;
+  }
   /*!
    * \brief same as SetGrad, but everything is now on CPU
    * normally you only need to implement this function
@@ -112,6 +141,8 @@ class LossLayerBase: public ILayer<xpu> {
   mshadow::Stream<xpu> *stream_;
   /*! \brief temp memory to do CPU side computation*/
   mshadow::TensorContainer<cpu, 2> temp_;
+  /*! \brief label staged in device memory */
+  mshadow::TensorContainer<xpu, 2> dlabel_;
   /*!
    * \brief global batch_size set by user, this 
    *        is not necessarily the batch_size in plabelinfo,
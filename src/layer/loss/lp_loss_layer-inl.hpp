@@ -4,6 +4,7 @@
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
 #include "../layer.h"
+#include "../op.h"
 #include "./loss_layer_base-inl.hpp"
 
 namespace cxxnet {
@@ -27,16 +28,15 @@ class LpLossLayer: public LossLayerBase<xpu> {
                         mshadow::Stream<xpu> *stream) {
     // Do Nothing
   }
-  virtual void SetGradCPU(mshadow::Tensor<cpu, 2> inout_data,
-                          const LabelRecord &label) {
-    mshadow::Tensor<cpu, 2> lb = label.label;
-    CHECK(lb.size(0) == inout_data.size(0) && lb.size(1) == inout_data.size(1));
-    for (index_t i = 0; i < inout_data.size(0); ++i) {
-      for (index_t j = 0; j < inout_data.size(1); ++j) {
-        inout_data[i][j] = p * std::pow(std::abs(inout_data[i][j] - lb[i][j]), p - 1)
-          * (inout_data[i][j] > lb[i][j] ? 1 : -1);
-      }
-    }
+  virtual void SetGrad(mshadow::Tensor<xpu, 2> inout_data,
+                       const LabelRecord &label,
+                       mshadow::Stream<xpu> *stream) {
+    using namespace mshadow::expr;
+    CHECK(label.label.size(0) == inout_data.size(0) &&
+          label.label.size(1) == inout_data.size(1));
+    mshadow::Tensor<xpu, 2> lb = this->StageLabel(label, stream);
+    inout_data = F<op::power>(F<op::abs>(inout_data - lb), scalar<real_t>(p - 1.0f))
+        * F<op::sign>(inout_data - lb) * p;
   }
  private:
   // L_p loss
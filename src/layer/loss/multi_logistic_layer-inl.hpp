@@ -21,16 +21,13 @@ class MultiLogisticLayer: public LossLayerBase<xpu> {
                         mshadow::Stream<xpu> *stream) {
     inout_data = mshadow::expr::F<op::sigmoid>(inout_data);
   }
-  virtual void SetGradCPU(mshadow::Tensor<cpu, 2> inout_data,
-                          const LabelRecord &label) {
-    mshadow::Tensor<cpu, 2> lb = label.label;
-    CHECK(lb.size(0) == inout_data.size(0) && lb.size(1) == inout_data.size(1))
+  virtual void SetGrad(mshadow::Tensor<xpu, 2> inout_data,
+                       const LabelRecord &label,
+                       mshadow::Stream<xpu> *stream) {
+    CHECK(label.label.size(0) == inout_data.size(0) &&
+          label.label.size(1) == inout_data.size(1))
         << " MultiLogisticLayer: label size mismatch";
-    for (index_t i = 0; i < inout_data.size(0); ++i) {
-      for (index_t j = 0; j < inout_data.size(1); ++j) {
-        inout_data[i][j] -= lb[i][j];
-      }
-    }
+    inout_data -= this->StageLabel(label, stream);
   }
 };
 }  // namespace layer
@@ -1,36 +1,129 @@
 #ifndef CXXNET_LAYER_SOFTMAX_LAYER_INL_HPP_
 #define CXXNET_LAYER_SOFTMAX_LAYER_INL_HPP_
 
+#include <cmath>
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
 #include "../layer.h"
+#include "../op.h"
 #include "./loss_layer_base-inl.hpp"
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief softmax of each row of the logits in place, cpu kernel is overloaded below.
+ *   one pass reads the row and keeps a running maximum and sum of exp, the sum is
+ *   rescaled when the maximum grows, one pass writes exp(x - log-sum-exp)
+ */
+template<typename xpu>
+inline void SoftmaxForwardFused(mshadow::Tensor<xpu, 2> data) {
+  utils::Error("SoftmaxLayer: fused kernel is only supported on cpu");
+}
+/*!
+ * \brief gradient of softmax cross entropy, (prob - onehot(label)) * scale,
+ *   written in one pass over the probabilities
+ */
+template<typename xpu>
+inline void SoftmaxGradFused(mshadow::Tensor<xpu, 2> data,
+                             mshadow::Tensor<cpu, 2> label, real_t scale) {
+  utils::Error("SoftmaxLayer: fused kernel is only supported on cpu");
+}
+inline void SoftmaxForwardFused(mshadow::Tensor<cpu, 2> data) {
+  const index_t n = data.size(1);
+  if (n == 0) return;
+  for (index_t i = 0; i < data.size(0); ++i) {
+    real_t *p = data[i].dptr_;
+    real_t vmax = p[0], sum = 1.0f;
+    for (index_t j = 1; j < n; ++j) {
+      if (p[j] > vmax) {
+        sum = sum * expf(vmax - p[j]) + 1.0f;
+        vmax = p[j];
+      } else {
+        sum += expf(p[j] - vmax);
+      }
+    }
+    const real_t lse = vmax + logf(sum);
+    for (index_t j = 0; j < n; ++j) {
+      p[j] = expf(p[j] - lse);
+    }
+  }
+}
+inline void SoftmaxGradFused(mshadow::Tensor<cpu, 2> data,
+                             mshadow::Tensor<cpu, 2> label, real_t scale) {
+  const index_t n = data.size(1);
+  for (index_t i = 0; i < data.size(0); ++i) {
+    real_t *p = data[i].dptr_;
+    const real_t k = label[i][0];
+    utils::Check(k >= 0.0f && k < static_cast<real_t>(n),
+                 "SoftmaxLayer: label exceeds number of classes");
+    for (index_t j = 0; j < n; ++j) {
+      p[j] *= scale;
+    }
+    p[static_cast<index_t>(k)] -= scale;
+  }
+}
+
 /*! \brief loss function layer */
 template<typename xpu>
 class SoftmaxLayer: public LossLayerBase<xpu> {
  public:
   SoftmaxLayer(const LabelInfo *label_info)
-      : LossLayerBase<xpu>(label_info) {}
+      : LossLayerBase<xpu>(label_info), colidx_(false) {
+    fused_ = 0;
+  }
   virtual ~SoftmaxLayer(void) {
   }
+  virtual void SetParam(const char *name, const char *val) {
+    LossLayerBase<xpu>::SetParam(name, val);
+    if (!strcmp(name, "fused")) fused_ = atoi(val);
+  }
  protected:
   virtual void Forward_(mshadow::Tensor<xpu, 2> inout_data,
                         mshadow::Stream<xpu> *stream) {
-    mshadow::Softmax(inout_data, inout_data);
+    if (xpu::kDevCPU && fused_ != 0) {
+      SoftmaxForwardFused(inout_data);
+    } else {
+      mshadow::Softmax(inout_data, inout_data);
+    }
   }
-  virtual void SetGradCPU(mshadow::Tensor<cpu, 2> inout_data,
-                          const LabelRecord &label) {
-    mshadow::Tensor<cpu, 2> lb = label.label;
-    CHECK(lb.size(0) == inout_data.size(0) && lb.size(1) == 1)
+  virtual void SetGradScaled(mshadow::Tensor<xpu, 2> inout_data,
+                             const LabelRecord &label,
+                             real_t scale,
+                             mshadow::Stream<xpu> *stream) {
+    if (xpu::kDevCPU && fused_ != 0) {
+      CHECK(label.label.size(0) == inout_data.size(0) && label.label.size(1) == 1)
+          << "SoftmaxLayer: label size mismatch";
+      SoftmaxGradFused(inout_data, label.label, scale);
+    } else {
+      LossLayerBase<xpu>::SetGradScaled(inout_data, label, scale, stream);
+    }
+  }
+  virtual void SetGrad(mshadow::Tensor<xpu, 2> inout_data,
+                       const LabelRecord &label,
+                       mshadow::Stream<xpu> *stream) {
+    using namespace mshadow::expr;
+    CHECK(label.label.size(0) == inout_data.size(0) && label.label.size(1) == 1)
         << "SoftmaxLayer: label size mismatch";
-    for (mshadow::index_t i = 0; i < inout_data.size(0); ++i) {
-      index_t k = static_cast<index_t>(lb[i][0]);
-      inout_data[i][k] -= 1.0f;
+    mshadow::Tensor<xpu, 1> lb = this->StageLabel(label, stream).FlatTo1D();
+    if (colidx_.size(0) != inout_data.size(1)) {
+      // index of each column, compared with label to get the one hot mask
+      mshadow::TensorContainer<cpu, 1> tmp(mshadow::Shape1(inout_data.size(1)));
+      for (index_t k = 0; k < tmp.size(0); ++k) {
+        tmp[k] = static_cast<real_t>(k);
+      }
+      colidx_.set_stream(stream);
+      colidx_.Resize(tmp.shape_);
+      mshadow::Copy(colidx_, tmp, stream);
     }
+    inout_data -= F<op::equal>(broadcast<0>(lb, inout_data.shape_),
+                               repmat(colidx_, inout_data.size(0)));
   }
+
+ private:
+  /*! \brief index of each class */
+  mshadow::TensorContainer<xpu, 1> colidx_;
+  /*! \brief use fused kernel on cpu */
+  int fused_;
 };
 }  // namespace layer
 }  // namespace cxxnet
@@ -1,12 +1,137 @@
 #ifndef CXXNET_LAYER_LRN_LAYER_INL_HPP_
 #define CXXNET_LAYER_LRN_LAYER_INL_HPP_
 
+#include <cmath>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./op.h"
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief fused forward of LRN, the cross channel sum of squares is kept
+ *   as a running window while going through the channels, cpu kernel is overloaded below
+ * \param norm output, the normalizer knorm + salpha * sum(in^2)
+ * \param scale output, pow(norm, -beta)
+ * \param acc temp space of size of one plane
+ */
+template<typename xpu>
+inline void LRNForwardFused(mshadow::Tensor<xpu, 4> in, mshadow::Tensor<xpu, 4> out,
+                            mshadow::Tensor<xpu, 4> norm, mshadow::Tensor<xpu, 4> scale,
+                            mshadow::Tensor<xpu, 2> acc, index_t nsize,
+                            real_t salpha, real_t beta, real_t knorm) {
+  utils::Error("LRN: fused kernel is only supported on cpu");
+}
+/*!
+ * \brief fused backprop of LRN, in is replaced by its gradient
+ * \param tmp temp space of size of one instance
+ */
+template<typename xpu>
+inline void LRNBackpropFused(mshadow::Tensor<xpu, 4> in, mshadow::Tensor<xpu, 4> out,
+                             mshadow::Tensor<xpu, 4> norm, mshadow::Tensor<xpu, 4> scale,
+                             mshadow::Tensor<xpu, 2> acc, mshadow::Tensor<xpu, 3> tmp,
+                             index_t nsize, real_t salpha, real_t beta) {
+  utils::Error("LRN: fused kernel is only supported on cpu");
+}
+/*!
+ * \brief add sign * src[c]^2 (or src[c] when not square) to acc,
+ *   do nothing if c is out of range
+ */
+template<bool square>
+inline void LRNAccumulate(mshadow::Tensor<cpu, 2> acc, mshadow::Tensor<cpu, 3> src,
+                          int c, real_t sign) {
+  if (c < 0 || c >= static_cast<int>(src.size(0))) return;
+  for (index_t y = 0; y < acc.size(0); ++y) {
+    real_t *a = acc[y].dptr_;
+    const real_t *s = src[c][y].dptr_;
+    for (index_t x = 0; x < acc.size(1); ++x) {
+      a[x] += sign * (square ? s[x] * s[x] : s[x]);
+    }
+  }
+}
+inline void LRNForwardFused(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 4> out,
+                            mshadow::Tensor<cpu, 4> norm, mshadow::Tensor<cpu, 4> scale,
+                            mshadow::Tensor<cpu, 2> acc, index_t nsize,
+                            real_t salpha, real_t beta, real_t knorm) {
+  const int half = static_cast<int>(nsize / 2);
+  const int nchannel = static_cast<int>(in.size(1));
+  for (index_t n = 0; n < in.size(0); ++n) {
+    // window of channel 0 is [-half, half]
+    acc = 0.0f;
+    for (int c = 0; c < half; ++c) {
+      LRNAccumulate<true>(acc, in[n], c, 1.0f);
+    }
+    for (int c = 0; c < nchannel; ++c) {
+      // move window to [c - half, c + half]
+      LRNAccumulate<true>(acc, in[n], c + half, 1.0f);
+      LRNAccumulate<true>(acc, in[n], c - half - 1, -1.0f);
+      for (index_t y = 0; y < acc.size(0); ++y) {
+        const real_t *a = acc[y].dptr_;
+        const real_t *pin = in[n][c][y].dptr_;
+        real_t *pout = out[n][c][y].dptr_;
+        real_t *pnorm = norm[n][c][y].dptr_;
+        real_t *pscale = scale[n][c][y].dptr_;
+        for (index_t x = 0; x < acc.size(1); ++x) {
+          pnorm[x] = a[x] * salpha + knorm;
+        }
+        if (beta == 0.75f) {
+          // common setting, pow(norm, -0.75) = 1 / (sqrt(norm) * sqrt(sqrt(norm)))
+          for (index_t x = 0; x < acc.size(1); ++x) {
+            const real_t r = std::sqrt(pnorm[x]);
+            pscale[x] = 1.0f / (r * std::sqrt(r));
+          }
+        } else {
+          for (index_t x = 0; x < acc.size(1); ++x) {
+            pscale[x] = std::pow(pnorm[x], -beta);
+          }
+        }
+        for (index_t x = 0; x < acc.size(1); ++x) {
+          pout[x] = pin[x] * pscale[x];
+        }
+      }
+    }
+  }
+}
+inline void LRNBackpropFused(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 4> out,
+                             mshadow::Tensor<cpu, 4> norm, mshadow::Tensor<cpu, 4> scale,
+                             mshadow::Tensor<cpu, 2> acc, mshadow::Tensor<cpu, 3> tmp,
+                             index_t nsize, real_t salpha, real_t beta) {
+  const int half = static_cast<int>(nsize / 2);
+  const int nchannel = static_cast<int>(in.size(1));
+  const real_t k = -2.0f * beta * salpha;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    // tmp = grad * in * pow(norm, -beta - 1)
+    for (int c = 0; c < nchannel; ++c) {
+      for (index_t y = 0; y < acc.size(0); ++y) {
+        const real_t *pin = in[n][c][y].dptr_;
+        const real_t *pgrad = out[n][c][y].dptr_;
+        const real_t *pnorm = norm[n][c][y].dptr_;
+        const real_t *pscale = scale[n][c][y].dptr_;
+        real_t *ptmp = tmp[c][y].dptr_;
+        for (index_t x = 0; x < acc.size(1); ++x) {
+          ptmp[x] = pgrad[x] * pin[x] * pscale[x] / pnorm[x];
+        }
+      }
+    }
+    acc = 0.0f;
+    for (int c = 0; c < half; ++c) {
+      LRNAccumulate<false>(acc, tmp, c, 1.0f);
+    }
+    for (int c = 0; c < nchannel; ++c) {
+      LRNAccumulate<false>(acc, tmp, c + half, 1.0f);
+      LRNAccumulate<false>(acc, tmp, c - half - 1, -1.0f);
+      for (index_t y = 0; y < acc.size(0); ++y) {
+        const real_t *a = acc[y].dptr_;
+        real_t *pin = in[n][c][y].dptr_;
+        const real_t *pgrad = out[n][c][y].dptr_;
+        const real_t *pscale = scale[n][c][y].dptr_;
+        for (index_t x = 0; x < acc.size(1); ++x) {
+          pin[x] = pgrad[x] * pscale[x] + k * a[x] * pin[x];
+        }
+      }
+    }
+  }
+}
 
 template<typename xpu>
 class LRNLayer : public ILayer<xpu> {
@@ -15,6 +140,7 @@ class LRNLayer : public ILayer<xpu> {
     // default values
     this->knorm_ = 1.0f;
     this->nsize_ = 3;
+    this->fused_ = 0;
   }
   virtual ~LRNLayer(void){}
   virtual void SetParam(const char *name, const char *val) {
@@ -22,9 +148,7 @@ class LRNLayer : public ILayer<xpu> {
     if (!strcmp(name, "alpha")) alpha_ = static_cast<real_t>(atof(val));
     if (!strcmp(name, "beta")) beta_ = static_cast<real_t>(atof(val));
     if (!strcmp(name, "knorm")) knorm_ = static_cast<real_t>(atof(val));
-  }
-  virtual void SetStream(mshadow::Stream<xpu> *stream) {
-    tmp_in.set_stream(stream);
+    if (!strcmp(name, "fused")) fused_ = atoi(val);
   }
   virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                               const std::vector<Node<xpu>*> &nodes_out,
@@ -32,16 +156,31 @@ class LRNLayer : public ILayer<xpu> {
     utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
                  "LRNLayer: only support 1-1 connection");
     nodes_out[0]->data.shape_ = nodes_in[0]->data.shape_;
+    const mshadow::Shape<4> ishape = nodes_in[0]->data.shape_;
+    if (this->UseFused()) {
+      // state 0 for normalizer, state 1 for pow(normalizer, -beta)
+      p_cstate->states.resize(2);
+      p_cstate->states[0].Resize(ishape);
+      p_cstate->states[1].Resize(ishape);
+      // window sum of one plane, and temp of one instance
+      p_cstate->workspace->Request((ishape[1] + 1) * ishape[2] * ishape[3]);
+      return;
+    }
     // use 1 temp state for mask
     p_cstate->states.resize(1);
-    p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
-    // temp in is kepted in layer, since it does not go across forward/backprop
-    tmp_in.Resize(nodes_in[0]->data.shape_);
+    p_cstate->states[0].Resize(ishape);
+    // temp in is taken from workspace, since it does not go across forward/backprop
+    p_cstate->workspace->Request(ishape.Size());
   }
   virtual void OnBatchSizeChanged(const std::vector<Node<xpu>*> &nodes_in,
                                   const std::vector<Node<xpu>*> &nodes_out,
                                   ConnectState<xpu> *p_cstate) {
-    p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
+    for (size_t i = 0; i < p_cstate->states.size(); ++i) {
+      p_cstate->states[i].Resize(nodes_in[0]->data.shape_);
+    }
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
   }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
@@ -51,6 +190,14 @@ class LRNLayer : public ILayer<xpu> {
     using namespace mshadow::expr;
     mshadow::Tensor<xpu,4> &tmp_norm = p_cstate->states[0];
     const real_t salpha = alpha_ / nsize_;
+    if (this->UseFused()) {
+      mshadow::Shape<4> ishape = nodes_in[0]->data.shape_;
+      LRNForwardFused(nodes_in[0]->data, nodes_out[0]->data,
+                      tmp_norm, p_cstate->states[1],
+                      p_cstate->workspace->Get(mshadow::Shape2(ishape[2], ishape[3])),
+                      nsize_, salpha, beta_, knorm_);
+      return;
+    }
     // stores normalizer without power
     tmp_norm = chpool<red::sum>(F<op::square>(nodes_in[0]->data) , nsize_) * salpha + knorm_;
     nodes_out[0]->data = nodes_in[0]->data * F<op::power>(tmp_norm, -beta_);
@@ -61,9 +208,22 @@ class LRNLayer : public ILayer<xpu> {
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow;
     using namespace mshadow::expr;
-    tmp_in.Resize(nodes_in[0]->data.shape_);
     mshadow::Tensor<xpu,4> &tmp_norm = p_cstate->states[0];
     const real_t salpha = alpha_ / nsize_;
+    if (this->UseFused()) {
+      if (prop_grad) {
+        mshadow::Shape<4> ishape = nodes_in[0]->data.shape_;
+        mshadow::Shape<2> pshape = mshadow::Shape2(ishape[2], ishape[3]);
+        LRNBackpropFused(nodes_in[0]->data, nodes_out[0]->data,
+                         tmp_norm, p_cstate->states[1],
+                         p_cstate->workspace->Get(pshape),
+                         p_cstate->workspace->Get(mshadow::Shape3(ishape[1], ishape[2], ishape[3]),
+                                                  pshape.Size()),
+                         nsize_, salpha, beta_);
+      }
+      return;
+    }
+    mshadow::Tensor<xpu,4> tmp_in = p_cstate->workspace->Get(nodes_in[0]->data.shape_);
     if (prop_grad) {
       // backup input data
       mshadow::Copy(tmp_in, nodes_in[0]->data, tmp_in.stream_);
@@ -76,8 +236,10 @@ class LRNLayer : public ILayer<xpu> {
   }
   
  private:
-  /*! \brief input temp data */
-  mshadow::TensorContainer<xpu,4> tmp_in;
+  /*! \brief whether to use fused kernel, cpu only */
+  inline bool UseFused(void) const {
+    return xpu::kDevCPU && fused_ != 0;
+  }
   /*! \brief alpha */
   real_t alpha_;
   /*! \brief beta */
@@ -86,6 +248,8 @@ class LRNLayer : public ILayer<xpu> {
   real_t knorm_;
   /*! \brief neighbor size */
   index_t nsize_;
+  /*! \brief use fused kernel on cpu */
+  int fused_;
 }; // class lrn layer
 }  // namespace layer
 }  // namespace cxxnet
@@ -22,6 +22,13 @@ struct identity_grad {
     return 1.0f;
   }
 };
+/*! \brief unary operation taking an unused second operand, to be chained with binary ones */
+template<typename OP>
+struct with_param {
+  MSHADOW_XINLINE static real_t Map(real_t a, real_t b) {
+    return OP::Map(a);
+  }
+};
 
 /*! \brief sigmoid unit */
 struct sigmoid {
@@ -93,6 +100,34 @@ struct power {
   }
 };
 
+/*! \brief absolute value */
+struct abs {
+  MSHADOW_XINLINE static real_t Map(real_t a) {
+    return a > 0.0f ? a : -a;
+  }
+};
+
+/*! \brief sign, zero is taken as negative */
+struct sign {
+  MSHADOW_XINLINE static real_t Map(real_t a) {
+    return a > 0.0f ? 1.0f : -1.0f;
+  }
+};
+
+/*! \brief used for generate one hot mask */
+struct equal {
+  MSHADOW_XINLINE static real_t Map(real_t a, real_t b) {
+    return a == b ? 1.0f : 0.0f;
+  }
+};
+
+/*! \brief keep a where mask is 0, otherwise the lowest real_t, used to drop entries from a maximum */
+struct mask_lowest {
+  MSHADOW_XINLINE static real_t Map(real_t a, real_t mask) {
+    return mask != 0.0f ? -3.402823466e+38f : a;
+  }
+};
+
 /*!\ \brief used for generate element sqrt */
 struct square_root {
   MSHADOW_XINLINE static real_t Map(real_t a) {
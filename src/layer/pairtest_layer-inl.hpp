@@ -48,6 +48,7 @@ class PairTestLayer : public ILayer<xpu> {
     for (size_t i = 0; i < nodes_out.size(); ++i) {
       slave_.nodes_out[i] = &snodes_out_[i];
     }
+    slave_.state.workspace = p_cstate->workspace;
     slave_.layer->InitConnection(slave_.nodes_in,
                                  slave_.nodes_out,
                                  &slave_.state);   
@@ -49,8 +49,10 @@ struct LayerParam {
   int num_input_channel;
   /*! \brief number of input hidden nodes, used by fullc */
   int num_input_node;
+  /*! \brief block size of the pruned weight kept in block sparse form, 0 if dense */
+  int sparse_block;
   /*! \brief reserved fields, for future compatibility */
-  int reserved[64];
+  int reserved[63];
   /*! \brief construtor */
   LayerParam(void) {
     init_sigma = 0.01f;
@@ -69,6 +71,7 @@ struct LayerParam {
     silent = 0;
     num_input_channel = 0;
     num_input_node = 0;
+    sparse_block = 0;
     // 64 MB
     temp_col_max = 64<<18;
     memset(reserved, 0, sizeof(reserved));
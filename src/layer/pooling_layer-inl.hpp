@@ -1,12 +1,180 @@
 #ifndef CXXNET_LAYER_POOLING_LAYER_INL_HPP_
 #define CXXNET_LAYER_POOLING_LAYER_INL_HPP_
 
+#include <algorithm>
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./param.h"
+#include "../utils/utils.h"
 
 namespace cxxnet {
 namespace layer {
+/*!
+ * \brief max pooling that writes the result into out and records
+ *   the offset of the maximum of each window in its input plane,
+ *   the offset is -1 when the maximum comes from the padding
+ */
+template<typename xpu>
+inline void MaxPoolArgmaxForward(mshadow::Tensor<xpu, 4> in,
+                                 mshadow::Tensor<xpu, 4> out,
+                                 int *argmax, int ksize_y, int ksize_x,
+                                 int stride, int pad_y, int pad_x) {
+  utils::Error("pool_argmax is only supported on cpu");
+}
+inline void MaxPoolArgmaxForward(mshadow::Tensor<cpu, 4> in,
+                                 mshadow::Tensor<cpu, 4> out,
+                                 int *argmax, int ksize_y, int ksize_x,
+                                 int stride, int pad_y, int pad_x) {
+  const int ih = static_cast<int>(in.size(2));
+  const int iw = static_cast<int>(in.size(3));
+  // window is clipped by the padded input, the same as pool(pad(in))
+  const int ph = ih + 2 * pad_y, pw = iw + 2 * pad_x;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      mshadow::Tensor<cpu, 2> dst = out[n][c];
+      for (index_t py = 0; py < dst.size(0); ++py) {
+        const int ys = static_cast<int>(py) * stride;
+        const int ye = std::min(ys + ksize_y, ph);
+        for (index_t px = 0; px < dst.size(1); ++px) {
+          const int xs = static_cast<int>(px) * stride;
+          const int xe = std::min(xs + ksize_x, pw);
+          real_t vmax = 0.0f; int imax = -1;
+          bool first = true;
+          for (int y = ys; y < ye; ++y) {
+            const int sy = y - pad_y;
+            for (int x = xs; x < xe; ++x) {
+              const int sx = x - pad_x;
+              if (sy >= 0 && sy < ih && sx >= 0 && sx < iw) {
+                const real_t v = src[sy][sx];
+                if (first || v > vmax) {
+                  vmax = v; imax = sy * static_cast<int>(src.stride_) + sx;
+                }
+              } else if (first || 0.0f > vmax) {
+                vmax = 0.0f; imax = -1;
+              }
+              first = false;
+            }
+          }
+          dst[py][px] = vmax;
+          *argmax++ = imax;
+        }
+      }
+    }
+  }
+}
+/*!
+ * \brief backprop of max pooling, scatter gradient of out
+ *  to the recorded maximum of each window
+ */
+template<typename xpu>
+inline void MaxPoolArgmaxBackward(mshadow::Tensor<xpu, 4> in,
+                                  mshadow::Tensor<xpu, 4> out,
+                                  const int *argmax) {
+  utils::Error("pool_argmax is only supported on cpu");
+}
+inline void MaxPoolArgmaxBackward(mshadow::Tensor<cpu, 4> in,
+                                  mshadow::Tensor<cpu, 4> out,
+                                  const int *argmax) {
+  in = 0.0f;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      real_t *src = in[n][c].dptr_;
+      mshadow::Tensor<cpu, 2> dst = out[n][c];
+      for (index_t py = 0; py < dst.size(0); ++py) {
+        for (index_t px = 0; px < dst.size(1); ++px, ++argmax) {
+          if (*argmax >= 0) src[*argmax] += dst[py][px];
+        }
+      }
+    }
+  }
+}
+
+/*!
+ * \brief pool(pad(in)) of a square window whose size and stride are known at
+ *   compile time, windows are clipped by the padded input and the padding
+ *   reads as zero, the same as the mshadow expression
+ */
+template<int mode, int ksize, int kstride>
+inline void PoolFixedForward(mshadow::Tensor<cpu, 4> in,
+                             mshadow::Tensor<cpu, 4> out,
+                             int pad_y, int pad_x) {
+  const int ih = static_cast<int>(in.size(2));
+  const int iw = static_cast<int>(in.size(3));
+  const int ph = ih + 2 * pad_y, pw = iw + 2 * pad_x;
+  const real_t scale = mode == kAvgPooling ? 1.0f / (ksize * ksize) : 1.0f;
+  for (index_t n = 0; n < in.size(0); ++n) {
+    for (index_t c = 0; c < in.size(1); ++c) {
+      mshadow::Tensor<cpu, 2> src = in[n][c];
+      mshadow::Tensor<cpu, 2> dst = out[n][c];
+      for (index_t py = 0; py < dst.size(0); ++py) {
+        const int ys = static_cast<int>(py) * kstride - pad_y;
+        const int ye = std::min(static_cast<int>(py) * kstride + ksize, ph) - pad_y;
+        const bool yinside = ys >= 0 && ys + ksize <= ih;
+        real_t *pd = dst[py].dptr_;
+        for (index_t px = 0; px < dst.size(1); ++px) {
+          const int xs = static_cast<int>(px) * kstride - pad_x;
+          real_t res;
+          if (yinside && xs >= 0 && xs + ksize <= iw) {
+            // whole window inside the input, the loops are unrolled
+            res = mode == kMaxPooling ? src[ys][xs] : 0.0f;
+            for (int ky = 0; ky < ksize; ++ky) {
+              const real_t *ps = src[ys + ky].dptr_ + xs;
+              for (int kx = 0; kx < ksize; ++kx) {
+                if (mode == kMaxPooling) {
+                  res = std::max(res, ps[kx]);
+                } else {
+                  res += ps[kx];
+                }
+              }
+            }
+          } else {
+            const int xe = std::min(static_cast<int>(px) * kstride + ksize, pw) - pad_x;
+            bool first = true;
+            res = 0.0f;
+            for (int y = ys; y < ye; ++y) {
+              for (int x = xs; x < xe; ++x) {
+                const real_t v = (y >= 0 && y < ih && x >= 0 && x < iw) ? src[y][x] : 0.0f;
+                if (mode != kMaxPooling) {
+                  res += v;
+                } else if (first || v > res) {
+                  res = v;
+                }
+                first = false;
+              }
+            }
+          }
+          pd[px] = res * scale;
+        }
+      }
+    }
+  }
+}
+/*! \brief signature of the specialized pooling kernels */
+typedef void (*PoolFixedFn)(mshadow::Tensor<cpu, 4> in, mshadow::Tensor<cpu, 4> out,
+                            int pad_y, int pad_x);
+/*! \brief pooling kernel specialized for the shape, NULL for other shapes */
+template<int mode>
+inline PoolFixedFn SelectPoolFixed(int ksize_y, int ksize_x, int stride) {
+  if (ksize_y != ksize_x || stride != 2) return NULL;
+  if (ksize_y == 2) return PoolFixedForward<mode, 2, 2>;
+  if (ksize_y == 3) return PoolFixedForward<mode, 3, 2>;
+  return NULL;
+}
+/*! \brief run the specialized pooling kernel, cpu version is overloaded below */
+template<typename xpu>
+inline void PoolFixed(PoolFixedFn kernel,
+                      mshadow::Tensor<xpu, 4> in,
+                      mshadow::Tensor<xpu, 4> out,
+                      int pad_y, int pad_x) {
+  utils::Error("PoolingLayer: shape_kernel is only supported on cpu");
+}
+inline void PoolFixed(PoolFixedFn kernel,
+                      mshadow::Tensor<cpu, 4> in,
+                      mshadow::Tensor<cpu, 4> out,
+                      int pad_y, int pad_x) {
+  kernel(in, out, pad_y, pad_x);
+}
 
 template<typename Reducer,
          int mode,
@@ -16,9 +184,12 @@ template<typename Reducer,
          typename BackOp = op::identity_grad>
 class PoolingLayer : public ILayer<xpu> {
  public:
+  PoolingLayer(void) : pool_argmax_(0), use_shape_kernel_(1), shape_kernel_(NULL) {}
   virtual ~PoolingLayer(void) {}
   virtual void SetParam(const char *name, const char* val) {
     param_.SetParam(name, val);
+    if (!strcmp(name, "pool_argmax")) pool_argmax_ = atoi(val);
+    if (!strcmp(name, "shape_kernel")) use_shape_kernel_ = atoi(val);
   }
   virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
                               const std::vector<Node<xpu>*> &nodes_out,
@@ -30,6 +201,9 @@ class PoolingLayer : public ILayer<xpu> {
                                   ConnectState<xpu> *p_cstate) {
     p_cstate->states[0].Resize(nodes_out[0]->data.shape_);
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return is_identity;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
@@ -41,10 +215,19 @@ class PoolingLayer : public ILayer<xpu> {
     const int pad_y = param_.pad_y;
     const int pad_x = param_.pad_x;
     mshadow::Shape<2> pshape = nodes_out[0]->data[0][0].shape_;
+    if (this->UseArgmax()) {
+      // state stores int32 index instead of pooled result
+      MaxPoolArgmaxForward(nodes_in[0]->data, nodes_out[0]->data,
+                           reinterpret_cast<int*>(tmp.dptr_),
+                           ksize_y, ksize_x, param_.stride, pad_y, pad_x);
+      return;
+    }
     if (!is_identity) {
       nodes_in[0]->data = F<ForwardOp>(nodes_in[0]->data);
     }
-    if (mode == kMaxPooling || mode == kSumPooling) {
+    if (shape_kernel_ != NULL) {
+      PoolFixed(shape_kernel_, nodes_in[0]->data, tmp, pad_y, pad_x);
+    } else if (mode == kMaxPooling || mode == kSumPooling) {
       tmp = pool<Reducer>(pad(nodes_in[0]->data, pad_y, pad_x), pshape, ksize_y, ksize_x, param_.stride);
     }else if (mode == kAvgPooling) {
       tmp = pool<Reducer>(pad(nodes_in[0]->data, pad_y, pad_x), pshape, ksize_y, ksize_x, param_.stride)
@@ -60,6 +243,11 @@ class PoolingLayer : public ILayer<xpu> {
                         ConnectState<xpu> *p_cstate) {
     using namespace mshadow::expr;
     mshadow::Tensor<xpu,4> &tmp = p_cstate->states[0];
+    if (prop_grad && this->UseArgmax()) {
+      MaxPoolArgmaxBackward(nodes_in[0]->data, nodes_out[0]->data,
+                            reinterpret_cast<const int*>(tmp.dptr_));
+      return;
+    }
     if (prop_grad) {
       const int ksize_y = param_.kernel_height;
       const int ksize_x = param_.kernel_width;
@@ -101,6 +289,10 @@ class PoolingLayer : public ILayer<xpu> {
   }
 
  protected:
+  /*! \brief whether to use the argmax kernel */
+  inline bool UseArgmax(void) const {
+    return xpu::kDevCPU && pool_argmax_ != 0 && mode == kMaxPooling && is_identity;
+  }
   inline void InitNode(const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
                        ConnectState<xpu> *p_cstate) {
@@ -122,16 +314,25 @@ class PoolingLayer : public ILayer<xpu> {
                std::min(ishape[2] + 2 * param_.pad_y - ksize_y + kstride-1, ishape[2] + 2 * param_.pad_y - 1) / kstride + 1,
                std::min(ishape[3] + 2 * param_.pad_x - ksize_x + kstride-1, ishape[3] + 2 * param_.pad_x- 1) / kstride + 1);
     nodes_out[0]->data.shape_ = oshape;
-    // use 2 temp state to store pooled result (state 2 for cudnn)
-    p_cstate->states.resize(2);
+    shape_kernel_ = NULL;
+    if (xpu::kDevCPU && use_shape_kernel_ != 0 && is_identity) {
+      shape_kernel_ = SelectPoolFixed<mode>(param_.kernel_height, param_.kernel_width,
+                                            param_.stride);
+    }
+    // use 1 temp state to store pooled result, or argmax index when pool_argmax is set
+    p_cstate->states.resize(1);
     p_cstate->states[0].set_pad(false);
-    p_cstate->states[1].set_pad(false);
     p_cstate->states[0].Resize(oshape);
-    p_cstate->states[1].Resize(ishape);
   }
   /*! \brief parameters that potentially be useful */
   LayerParam param_;
   mshadow::Shape<2> in_shape_;
+  /*! \brief record argmax of max pooling in forward, cpu only */
+  int pool_argmax_;
+  /*! \brief whether to use the kernels specialized for common shapes on cpu */
+  int use_shape_kernel_;
+  /*! \brief specialized forward kernel of the shape of this layer */
+  PoolFixedFn shape_kernel_;
 };   // class PoolingLayer
 }  // namespace layer
 }  // namespace cxxnet
@@ -5,6 +5,7 @@
 #include <mshadow/tensor.h>
 #include "./layer.h"
 #include "./op.h"
+#include "../utils/philox.h"
 
 namespace cxxnet {
 namespace op {
@@ -52,11 +53,15 @@ class PReluLayer : public ILayer<xpu> {
     init_slope_ = 0.25f;
     init_random_ = 0;
     random_ = 0;
+    rand_nthread_ = 0;
+    philox_seed_ = 0;
   }
   virtual void SetParam(const char *name, const char* val) {
     if (!strcmp(name, "init_slope")) init_slope_ = atof(val);
     if (!strcmp(name, "random_slope")) init_random_ = atoi(val);
     if (!strcmp(name, "random")) random_ = atof(val);
+    if (!strcmp(name, "rand_nthread")) rand_nthread_ = atoi(val);
+    if (!strcmp(name, "philox_seed")) philox_seed_ = utils::ParsePhiloxSeed(val);
   }
   virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit("bias", slope_, gslope_);
@@ -75,6 +80,12 @@ class PReluLayer : public ILayer<xpu> {
       // This is a conv layer
       channel_ = nodes_in[0]->data.size(1);
     }
+    if (xpu::kDevCPU && rand_nthread_ != 0) {
+      rng_.Seed(philox_seed_);
+      rng_.set_nthread(rand_nthread_);
+    } else {
+      rand_nthread_ = 0;
+    }
     p_cstate->states.resize(1);
     p_cstate->states[0].Resize(nodes_in[0]->data.shape_);
   }
@@ -108,6 +119,9 @@ class PReluLayer : public ILayer<xpu> {
                                   ConnectState<xpu> *p_cstate) {
     // Do nothing for now
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
@@ -116,7 +130,15 @@ class PReluLayer : public ILayer<xpu> {
     mshadow::Tensor<xpu, 4> &in = nodes_in[0]->data;
     mshadow::Tensor<xpu, 4> &out = nodes_out[0]->data;
     mshadow::TensorContainer<xpu,4> &mask = p_cstate->states[0];
-    if (in.size(1) != 1){
+    if (is_train && rand_nthread_ != 0) {
+      // noise factor in [1 - random, 1 + random)
+      rng_.SampleUniform(mask.FlatTo2D(), 1.0f - random_, 1.0f + random_);
+      if (in.size(1) != 1) {
+        mask *= broadcast<1>(slope_, in.shape_);
+      } else {
+        mask *= broadcast<3>(slope_, in.shape_);
+      }
+    } else if (in.size(1) != 1){
       if (is_train){
         mask = broadcast<1>(slope_, in.shape_) *
           (1 + prnd_->uniform(mask.shape_) * random_ * 2.0f - random_);
@@ -170,6 +192,12 @@ class PReluLayer : public ILayer<xpu> {
   int init_random_;
   /*! \brief indicate the noise injected in training */
   float random_;
+  /*! \brief number of threads of counter based generator, 0 to use prnd_ */
+  int rand_nthread_;
+  /*! \brief seed of counter based generator, set by the net */
+  uint64_t philox_seed_;
+  /*! \brief counter based generator on cpu */
+  utils::PhiloxStream rng_;
 };  // class PReluLayer
 
 } // namespace layer
@@ -0,0 +1,185 @@
+#ifndef CXXNET_LAYER_SPARSE_FULLC_LAYER_INL_HPP_
+#define CXXNET_LAYER_SPARSE_FULLC_LAYER_INL_HPP_
+/*!
+ * \file sparse_fullc_layer-inl.hpp
+ * \brief fully connected layer over the sparse rows of the input batch,
+ *   the weight keeps one row per input feature, so a batch only reads and
+ *   writes the rows of the features it contains
+ */
+#include <mshadow/tensor.h>
+#include "./layer.h"
+#include "./param.h"
+#include "./op.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace layer {
+/*! \brief out = sparse * wmat, cpu kernel is overloaded below */
+template<typename xpu>
+inline void SparseDotForward(const SparseInput &sparse,
+                             mshadow::Tensor<xpu, 2> wmat,
+                             mshadow::Tensor<xpu, 2> out) {
+  utils::Error("SparseFullConnectLayer: only supported on cpu");
+}
+/*! \brief gwmat += sparse.T() * grad, appends the touched rows to rows */
+template<typename xpu>
+inline void SparseDotBackward(const SparseInput &sparse,
+                              mshadow::Tensor<xpu, 2> grad,
+                              mshadow::Tensor<xpu, 2> gwmat,
+                              std::vector<index_t> *rows) {
+  utils::Error("SparseFullConnectLayer: only supported on cpu");
+}
+inline void SparseDotForward(const SparseInput &sparse,
+                             mshadow::Tensor<cpu, 2> wmat,
+                             mshadow::Tensor<cpu, 2> out) {
+  const index_t nhidden = out.size(1);
+  for (index_t i = 0; i < out.size(0); ++i) {
+    real_t *po = out[i].dptr_;
+    for (index_t j = 0; j < nhidden; ++j) po[j] = 0.0f;
+    for (size_t k = sparse.row_ptr[i]; k < sparse.row_ptr[i + 1]; ++k) {
+      const SparseInst::Entry &e = sparse.data[k];
+      utils::Check(e.findex < wmat.size(0),
+                   "SparseFullConnectLayer: feature index exceed nfeature");
+      const real_t *pw = wmat[e.findex].dptr_;
+      const real_t v = e.fvalue;
+      for (index_t j = 0; j < nhidden; ++j) {
+        po[j] += v * pw[j];
+      }
+    }
+  }
+}
+inline void SparseDotBackward(const SparseInput &sparse,
+                              mshadow::Tensor<cpu, 2> grad,
+                              mshadow::Tensor<cpu, 2> gwmat,
+                              std::vector<index_t> *rows) {
+  const index_t nhidden = grad.size(1);
+  for (index_t i = 0; i < grad.size(0); ++i) {
+    const real_t *pg = grad[i].dptr_;
+    for (size_t k = sparse.row_ptr[i]; k < sparse.row_ptr[i + 1]; ++k) {
+      const SparseInst::Entry &e = sparse.data[k];
+      real_t *pw = gwmat[e.findex].dptr_;
+      const real_t v = e.fvalue;
+      for (index_t j = 0; j < nhidden; ++j) {
+        pw[j] += v * pg[j];
+      }
+      rows->push_back(e.findex);
+    }
+  }
+}
+
+template<typename xpu>
+class SparseFullConnectLayer : public ILayer<xpu> {
+ public:
+  SparseFullConnectLayer(mshadow::Random<xpu> *p_rnd) : prnd_(p_rnd) {}
+  virtual ~SparseFullConnectLayer(void) {}
+  virtual void SetParam(const char *name, const char* val) {
+    param_.SetParam(name, val);
+    if (!strcmp(name, "nfeature")) param_.num_input_node = atoi(val);
+  }
+  virtual void ApplyVisitor(typename ILayer<xpu>::IVisitor *pvisitor) {
+    pvisitor->Visit("wmat", wmat_, gwmat_);
+    if (param_.no_bias == 0) {
+      pvisitor->Visit("bias", bias_, gbias_);
+    }
+  }
+  virtual std::vector<index_t> *GradRows(const char *tag) {
+    if (!strcmp(tag, "wmat")) return &grad_rows_;
+    return NULL;
+  }
+  virtual void InitModel(void) {
+    utils::Check(param_.num_input_node > 0,
+                 "SparseFullConnectLayer: must set nfeature correctly");
+    // one row for each input feature
+    wmat_.Resize(mshadow::Shape2(param_.num_input_node, param_.num_hidden));
+    bias_.Resize(mshadow::Shape1(param_.num_hidden));
+    param_.RandInitWeight(this->prnd_, wmat_, wmat_.size(0), wmat_.size(1));
+    bias_ = param_.init_bias;
+    // setup gradient weight
+    gwmat_.Resize(wmat_.shape_);
+    gbias_.Resize(bias_.shape_);
+    gwmat_ = 0.0f; gbias_ = 0.0f;
+  }
+  virtual void SaveModel(utils::IStream &fo) const {
+    fo.Write(&param_, sizeof(LayerParam));
+    wmat_.SaveBinary(fo);
+    bias_.SaveBinary(fo);
+  }
+  virtual void LoadModel(utils::IStream &fi) {
+    utils::Check(fi.Read(&param_, sizeof(LayerParam)) != 0,
+                 "SparseFullConnectLayer:LoadModel invalid model file");
+    wmat_.LoadBinary(fi);
+    bias_.LoadBinary(fi);
+    // setup gradient weight
+    gwmat_.Resize(wmat_.shape_);
+    gbias_.Resize(bias_.shape_);
+    gwmat_ = 0.0f; gbias_ = 0.0f;
+  }
+  virtual void SetStream(mshadow::Stream<xpu> *stream) {
+    wmat_.set_stream(stream);
+    bias_.set_stream(stream);
+    gwmat_.set_stream(stream);
+    gbias_.set_stream(stream);
+  }
+  virtual void InitConnection(const std::vector<Node<xpu>*> &nodes_in,
+                              const std::vector<Node<xpu>*> &nodes_out,
+                              ConnectState<xpu> *p_cstate) {
+    utils::Check(nodes_in.size() == 1 && nodes_out.size() == 1,
+                 "SparseFullConnectLayer: Layer only support 1-1 connection");
+    utils::Check(param_.num_hidden > 0,
+                 "SparseFullConnectLayer: must set nhidden correctly");
+    utils::Check(param_.num_input_node > 0,
+                 "SparseFullConnectLayer: must set nfeature correctly");
+    // the dense content of the input node is not used
+    nodes_out[0]->data.shape_ =
+        mshadow::Shape4(nodes_in[0]->data.size(0), 1, 1, param_.num_hidden);
+  }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
+  virtual void Forward(bool is_train,
+                       const std::vector<Node<xpu>*> &nodes_in,
+                       const std::vector<Node<xpu>*> &nodes_out,
+                       ConnectState<xpu> *p_cstate) {
+    using namespace mshadow::expr;
+    const SparseInput &sparse = nodes_in[0]->sparse;
+    mshadow::Tensor<xpu, 2> m_out = nodes_out[0]->mat();
+    utils::Check(sparse.row_ptr != NULL && sparse.nrow == m_out.size(0),
+                 "SparseFullConnectLayer: input batch must be sparse");
+    SparseDotForward(sparse, wmat_, m_out);
+    if (param_.no_bias == 0) {
+      m_out += repmat(bias_, m_out.size(0));
+    }
+  }
+  virtual void Backprop(bool prop_grad,
+                        const std::vector<Node<xpu>*> &nodes_in,
+                        const std::vector<Node<xpu>*> &nodes_out,
+                        ConnectState<xpu> *p_cstate) {
+    using namespace mshadow::expr;
+    mshadow::Tensor<xpu, 2> m_out = nodes_out[0]->mat();
+    // only rows of the features in the batch get gradient
+    SparseDotBackward(nodes_in[0]->sparse, m_out, gwmat_, &grad_rows_);
+    if (param_.no_bias == 0) {
+      gbias_ += sum_rows(m_out);
+    }
+    // no gradient for a sparse input
+  }
+
+ protected:
+  /*! \brief random number generator */
+  mshadow::Random<xpu> *prnd_;
+  /*! \brief parameters that potentially be useful */
+  LayerParam param_;
+  /*! \brief weight matrix, of shape (nfeature, nhidden) */
+  mshadow::TensorContainer<xpu,2> wmat_;
+  /*! \brief bias */
+  mshadow::TensorContainer<xpu,1> bias_;
+  /*! \brief accumulates the gradient of weight matrix */
+  mshadow::TensorContainer<xpu,2> gwmat_;
+  /*! \brief accumulates the gradient of bias */
+  mshadow::TensorContainer<xpu,1> gbias_;
+  /*! \brief rows of gwmat_ touched since the last update, can repeat */
+  std::vector<index_t> grad_rows_;
+};
+}  // namespace layer
+}  // namespace cxxnet
+#endif  // CXXNET_LAYER_SPARSE_FULLC_LAYER_INL_HPP_
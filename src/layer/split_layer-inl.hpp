@@ -8,6 +8,40 @@
 namespace cxxnet {
 namespace layer {
 
+/*! \brief add all grads to dst, cpu kernel is overloaded below */
+template<typename xpu>
+inline void SplitAccumulate(mshadow::Tensor<xpu, 4> dst,
+                            const std::vector<mshadow::Tensor<xpu, 4> > &grads) {
+  size_t i = 0;
+  for (; i + 3 <= grads.size(); i += 3) {
+    dst += grads[i] + grads[i + 1] + grads[i + 2];
+  }
+  if (i + 2 == grads.size()) {
+    dst += grads[i] + grads[i + 1];
+  } else if (i + 1 == grads.size()) {
+    dst += grads[i];
+  }
+}
+inline void SplitAccumulate(mshadow::Tensor<cpu, 4> dst,
+                            const std::vector<mshadow::Tensor<cpu, 4> > &grads) {
+  if (grads.size() == 0) return;
+  mshadow::Tensor<cpu, 2> out = dst.FlatTo2D();
+  std::vector<mshadow::Tensor<cpu, 2> > in(grads.size());
+  for (size_t k = 0; k < grads.size(); ++k) {
+    in[k] = grads[k].FlatTo2D();
+  }
+  // one pass over dst for all the inputs
+  for (index_t y = 0; y < out.size(0); ++y) {
+    real_t *p = out[y].dptr_;
+    for (size_t k = 0; k < in.size(); ++k) {
+      const real_t *q = in[k][y].dptr_;
+      for (index_t x = 0; x < out.size(1); ++x) {
+        p[x] += q[x];
+      }
+    }
+  }
+}
+
 template<typename xpu>
 class SplitLayer : public ILayer<xpu> {
  public:
@@ -21,11 +55,16 @@ class SplitLayer : public ILayer<xpu> {
       nodes_out[i]->data.shape_ = oshape;
     }
   }
+  virtual bool ForwardKeepsInput(void) const {
+    return true;
+  }
   virtual void Forward(bool is_train,
                        const std::vector<Node<xpu>*> &nodes_in,
                        const std::vector<Node<xpu>*> &nodes_out,
                        ConnectState<xpu> *p_cstate) {
     for (index_t i = 0; i < nodes_out.size(); ++i){
+      // outputs that are views of the input need no copy
+      if (nodes_out[i]->data.dptr_ == nodes_in[0]->data.dptr_) continue;
       mshadow::Copy(nodes_out[i]->data, nodes_in[0]->data,
         nodes_out[i]->data.stream_);
     }
@@ -35,11 +74,18 @@ class SplitLayer : public ILayer<xpu> {
                         const std::vector<Node<xpu>*> &nodes_out,
                         ConnectState<xpu> *p_cstate) {
     if (prop_grad){
-      mshadow::Copy(nodes_in[0]->data, nodes_out[0]->data,
-        nodes_in[0]->data.stream_);
+      mshadow::Tensor<xpu, 4> in = nodes_in[0]->data;
+      // when the first output is a view, its gradient is already in place
+      if (nodes_out[0]->data.dptr_ != in.dptr_) {
+        mshadow::Copy(in, nodes_out[0]->data, in.stream_);
+      }
+      std::vector<mshadow::Tensor<xpu, 4> > grads;
       for (index_t i = 1; i < nodes_out.size(); ++i){
-        nodes_in[0]->data += nodes_out[i]->data;
+        // an output still pointing to the input got no gradient
+        if (nodes_out[i]->data.dptr_ == in.dptr_) continue;
+        grads.push_back(nodes_out[i]->data);
       }
+      SplitAccumulate(in, grads);
     }
   }
 }; //class SplitLayer
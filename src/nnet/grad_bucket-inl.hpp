@@ -0,0 +1,171 @@
+#ifndef CXXNET_NNET_GRAD_BUCKET_INL_HPP_
+#define CXXNET_NNET_GRAD_BUCKET_INL_HPP_
+/*!
+ * \file grad_bucket-inl.hpp
+ * \brief gradients of consecutive layers pushed to the parameter server as one
+ *   message, the buckets are contiguous ranges of the gradient arena
+ */
+#include <vector>
+#include <mshadow/tensor.h>
+#include <mshadow-ps/mshadow_ps.h>
+#include "../updater/updater.h"
+#include "../utils/utils.h"
+#include "./param_arena-inl.hpp"
+
+namespace cxxnet {
+namespace nnet {
+/*!
+ * \brief buckets of gradients, filled in reverse order of layers during backprop.
+ *  a bucket is pushed as soon as the backprop of its first layer is done, and the
+ *  updaters of its layers are run when the summed gradient is pulled back
+ */
+template<typename xpu>
+class GradBuckets {
+ public:
+  /*! \brief a bucket of gradients */
+  struct Bucket {
+    /*! \brief key of the bucket in the parameter server */
+    int key;
+    /*! \brief the layers in the bucket are [layer_begin, layer_end) */
+    int layer_begin, layer_end;
+    /*! \brief gradient of the layers, a range of the gradient arena */
+    mshadow::Tensor<xpu, 2> grad;
+    /*! \brief updaters of the layers, run after the pull */
+    std::vector<updater::IAsyncUpdater<xpu>*> updaters;
+  };
+  /*! \brief the buckets, the first one holds the last layers */
+  std::vector<Bucket> buckets;
+  /*! \brief bucket of each layer, -1 if the layer pushes its gradients by itself */
+  std::vector<int> layer_bucket;
+
+  GradBuckets(void) : pserver_(NULL), devid_(0), stream_(NULL) {}
+  /*!
+   * \brief group the layers into buckets of at least bucket_bytes, must be called
+   *  after the updaters are configured and before they are initialized.
+   *  a layer joins a bucket only if all its fields are in the arena and all its
+   *  updaters leave push and pull to the bucket, other layers split the buckets
+   * \param key_base the key of the first bucket, larger than any key of a layer
+   */
+  inline void Init(const ParamArena<xpu> &arena,
+                   const std::vector<std::vector<updater::IAsyncUpdater<xpu>*> > &updaters,
+                   mshadow::ps::ISharedModel<xpu, real_t> *pserver,
+                   int devid, int key_base, size_t bucket_bytes,
+                   mshadow::Stream<xpu> *stream) {
+    pserver_ = pserver; devid_ = devid; stream_ = stream;
+    key_base_ = key_base;
+    buckets.clear();
+    layer_bucket.assign(updaters.size(), -1);
+    // range of each layer in the arena
+    const size_t nlayer = updaters.size();
+    std::vector<size_t> lbegin(nlayer, 0), lend(nlayer, 0), nfield(nlayer, 0);
+    for (size_t i = 0; i < arena.entries.size(); ++i) {
+      const size_t l = static_cast<size_t>(arena.entries[i].layer_index);
+      if (nfield[l] == 0) lbegin[l] = arena.entries[i].offset;
+      lend[l] = arena.entries[i].offset + arena.Span(i);
+      nfield[l] += 1;
+    }
+    bool open = false;
+    size_t begin = 0, end = 0;
+    Bucket cur;
+    for (size_t i = nlayer; i != 0; --i) {
+      const size_t l = i - 1;
+      if (updaters[l].size() == 0) continue;
+      bool ok = nfield[l] == updaters[l].size();
+      for (size_t k = 0; k < updaters[l].size(); ++k) {
+        ok = ok && updaters[l][k]->CanBucket();
+      }
+      // the range of a bucket must hold nothing but the layers in it
+      if (open && (!ok || lend[l] != begin)) {
+        this->Close(arena, begin, end, &cur);
+        open = false;
+      }
+      if (!ok) continue;
+      if (!open) {
+        cur = Bucket();
+        cur.layer_end = static_cast<int>(l) + 1;
+        end = lend[l];
+        open = true;
+      }
+      begin = lbegin[l];
+      cur.layer_begin = static_cast<int>(l);
+      cur.updaters.insert(cur.updaters.end(), updaters[l].begin(), updaters[l].end());
+      layer_bucket[l] = static_cast<int>(buckets.size());
+      if ((end - begin) * sizeof(real_t) >= bucket_bytes) {
+        this->Close(arena, begin, end, &cur);
+        open = false;
+      }
+    }
+    if (open) this->Close(arena, begin, end, &cur);
+    size_t nbucketed = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      nbucketed += buckets[i].updaters.size();
+    }
+    utils::TrackerPrintf("grad_bucket: %lu buckets hold %lu fields\n",
+                         static_cast<unsigned long>(buckets.size()),
+                         static_cast<unsigned long>(nbucketed));
+  }
+  /*! \brief whether the gradients of layer l are pushed by a bucket */
+  inline bool Covers(size_t l) const {
+    return l < layer_bucket.size() && layer_bucket[l] >= 0;
+  }
+  /*!
+   * \brief called after the updaters of layer l are notified of the backprop,
+   *  push the bucket of the layer if it is the last layer of the bucket to finish
+   */
+  inline void AfterBackprop(size_t l, bool do_update) {
+    if (!do_update || !this->Covers(l)) return;
+    Bucket &b = buckets[layer_bucket[l]];
+    if (static_cast<int>(l) != b.layer_begin) return;
+    // the gradients of all layers in the bucket must be ready before the push
+    stream_->Wait();
+    pserver_->Push(b.grad, b.key, devid_, -b.layer_begin);
+    pserver_->PullReq(b.grad, b.key, devid_, -b.layer_begin,
+                      ApplyUpdate_, &b);
+  }
+  /*! \brief block until the update of the bucket of layer l is finished */
+  inline void UpdateWait(size_t l) {
+    if (!this->Covers(l)) return;
+    pserver_->PullWait(buckets[layer_bucket[l]].key, devid_);
+  }
+  /*! \brief block until the updates of all buckets are finished */
+  inline void UpdateWaitAll(void) {
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      pserver_->PullWait(buckets[i].key, devid_);
+    }
+  }
+  /*! \brief forget the buckets, the updaters are owned by the net */
+  inline void Clear(void) {
+    buckets.clear();
+    layer_bucket.clear();
+  }
+
+ private:
+  // finish the bucket over [begin, end) of the arena
+  inline void Close(const ParamArena<xpu> &arena, size_t begin, size_t end, Bucket *b) {
+    b->key = key_base_ + static_cast<int>(buckets.size());
+    b->grad = mshadow::Tensor<xpu, 2>(arena.gspace.dptr_ + begin,
+                                      mshadow::Shape2(1, end - begin));
+    b->grad.set_stream(stream_);
+    for (size_t k = 0; k < b->updaters.size(); ++k) {
+      b->updaters[k]->SetBucketed();
+    }
+    pserver_->InitKey(b->grad.shape_, b->key, devid_);
+    buckets.push_back(*b);
+  }
+  // run the updaters on the pulled gradient
+  inline static void ApplyUpdate_(mshadow::Stream<xpu> *stream, void *arg) {
+    Bucket *b = static_cast<Bucket*>(arg);
+    for (size_t k = 0; k < b->updaters.size(); ++k) {
+      b->updaters[k]->ApplyBucketUpdate(stream);
+    }
+  }
+  /*! \brief parameter server */
+  mshadow::ps::ISharedModel<xpu, real_t> *pserver_;
+  /*! \brief device id and key of the first bucket */
+  int devid_, key_base_;
+  /*! \brief stream of the net */
+  mshadow::Stream<xpu> *stream_;
+};
+}  // namespace nnet
+}  // namespace cxxnet
+#endif  // CXXNET_NNET_GRAD_BUCKET_INL_HPP_
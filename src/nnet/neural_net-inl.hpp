@@ -7,15 +7,21 @@
  */
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
 #include "../layer/layer.h"
 #include "../layer/visitor.h"
 #include "../updater/updater.h"
+#include "../updater/fused_updater-inl.hpp"
 #include "../utils/utils.h"
 #include "../utils/io.h"
 #include "../utils/thread.h"
+#include "../utils/philox.h"
 #include "./nnet_config.h"
+#include "./param_arena-inl.hpp"
+#include "./grad_bucket-inl.hpp"
+#include "./topk_select-inl.hpp"
 
 namespace cxxnet {
 namespace nnet {
@@ -32,32 +38,93 @@ struct NeuralNet {
   std::vector<layer::Node<xpu> > nodes;
   /*! \brief layers in the neural net */
   std::vector<layer::Connection<xpu> > connections;
+  /*! \brief scratch space shared by the connections */
+  layer::Workspace<xpu> workspace;
+  /*! \brief whether nodes can be views of other nodes to save copies */
+  int node_alias;
+  /*!
+   * \brief groups of nodes that share the memory of their input in forward only,
+   *  all nodes of a group are materialized before any of them is used in backprop
+   */
+  std::vector<std::vector<layer::Node<xpu>*> > lazy_views;
+  /*! \brief whether weights and gradients of all layers are kept in one arena */
+  int param_arena;
+  /*! \brief the arena of weights and gradients, used if param_arena is set */
+  ParamArena<xpu> arena;
+  /*! \brief size of a bucket of gradients pushed together in MB, 0 to push each field */
+  float grad_bucket;
+  /*! \brief buckets of gradients, used if grad_bucket is set */
+  GradBuckets<xpu> buckets;
   /*! \brief updaters in the neural net */
   std::vector<std::vector<updater::IAsyncUpdater<xpu>*> > updaters;
+  /*! \brief local updates deferred to the end of backprop, run by one fused kernel */
+  std::vector<updater::FusedStep> fused_steps;
+  /*! \brief top-k selection of the output node in prediction */
+  TopKSelector<xpu> topk;
   /*! \brief random number generator */
   mshadow::Random<xpu> rnd;
   /*! \brief stream for this  */
   mshadow::Stream<xpu> *stream;
+  /*! \brief seed of rnd, also seeds the counter based generators of layers */
+  int seed;
   // constructor do nothing
   NeuralNet(const NetConfig &cfg,
             mshadow::index_t batch_size,
             int seed,
             mshadow::Stream<xpu> *stream)
-      : cfg(cfg), rnd(seed), stream(stream) {
+      : cfg(cfg), rnd(seed), stream(stream), seed(seed) {
     // set maximum batch
     this->max_batch = batch_size;
     rnd.set_stream(stream);
     label_info.name2findex = &cfg.label_name_map;
+    node_alias = 0;
+    param_arena = 0;
+    grad_bucket = 0.0f;
+    for (size_t i = 0; i < cfg.defcfg.size(); ++i) {
+      if (cfg.defcfg[i].first == "node_alias") {
+        node_alias = atoi(cfg.defcfg[i].second.c_str());
+      }
+      if (cfg.defcfg[i].first == "param_arena") {
+        param_arena = atoi(cfg.defcfg[i].second.c_str());
+      }
+      if (cfg.defcfg[i].first == "grad_bucket") {
+        grad_bucket = static_cast<float>(atof(cfg.defcfg[i].second.c_str()));
+      }
+    }
+    for (size_t i = 0; i < cfg.defcfg.size(); ++i) {
+      // the server of dist decodes the layer from the key, buckets are local only
+      if (cfg.defcfg[i].first == "param_server" &&
+          !strncmp(cfg.defcfg[i].second.c_str(), "dist", 4) && grad_bucket > 0.0f) {
+        utils::TrackerPrintf("grad_bucket is ignored by param_server=%s\n",
+                             cfg.defcfg[i].second.c_str());
+        grad_bucket = 0.0f;
+      }
+    }
   }
   ~NeuralNet(void) {
     this->FreeSpace();
   }
+  /*!
+   * \brief gradient buckets are only used with a parameter server, where they are
+   *  ranges of the arena, must be called before the model is initialized or loaded
+   * \param has_pserver whether the net pushes its gradients to a parameter server
+   */
+  inline void ConfigBucket(bool has_pserver) {
+    if (grad_bucket <= 0.0f) return;
+    if (!has_pserver) {
+      utils::TrackerPrintf("grad_bucket is ignored without a parameter server\n");
+      grad_bucket = 0.0f;
+      return;
+    }
+    param_arena = 1;
+  }
   /*! \brief save model to file */
   inline void SaveModel(utils::IStream &fo) const {
     for (index_t i = 0; i < connections.size(); ++i) {
       for (size_t j = 0; j < updaters[i].size(); ++j) {
         updaters[i][j]->UpdateWait();
       }
+      buckets.UpdateWait(i);
       if (connections[i].type != layer::kSharedLayer) {
         connections[i].layer->SaveModel(fo);
       }
@@ -78,11 +145,13 @@ struct NeuralNet {
       c.layer->InitConnection(c.nodes_in, c.nodes_out, &c.state);
       c.SetStream(stream);
     }
+    this->InitWorkspace();
     for (size_t i = 0; i < connections.size(); ++i) {
       if (connections[i].type != layer::kSharedLayer) {
         connections[i].layer->InitModel();
       }
     }
+    if (param_arena != 0) arena.Bind(connections, stream);
   }
   /*! \brief load model from stream */
   inline void LoadModel(utils::IStream &fi, bool init_connection = true) {
@@ -101,24 +170,37 @@ struct NeuralNet {
         c.layer->InitConnection(c.nodes_in, c.nodes_out, &c.state);
         c.SetStream(stream);
       }
+      this->InitWorkspace();
     }
+    if (param_arena != 0) arena.Bind(connections, stream);
   }
   /*!
    * \brief forward prop
    * \param is_train whether is training phase
-   * \param batch the input batch
+   * \param batch the input batch, can have no content when the batch is sparse
+   * \param sparse the sparse rows of the input batch, if any
    */
   inline void Forward(bool is_train,
                       mshadow::Tensor<cpu,4> batch,
                       std::vector<mshadow::Tensor<cpu,4> > extra_data,
+                      const layer::SparseInput &sparse,
                       bool need_sync) {
     // check if we need to adjust batch size according to the input
     this->AdjustBatchSize(batch.size(0));
-    // copy data into node
-    mshadow::Copy(nodes[0].data, batch, stream);
+    // copy data into node, sparse rows are read by the layers directly
+    nodes[0].sparse = sparse;
+    if (batch.dptr_ != NULL) {
+      mshadow::Copy(nodes[0].data, batch, stream);
+    }
     for (size_t i = 0; i < extra_data.size(); ++i) {
       mshadow::Copy(nodes[i + 1].data, extra_data[i], stream);
     }
+    // lazy views point back to their input
+    for (size_t i = 0; i < lazy_views.size(); ++i) {
+      for (size_t j = 0; j < lazy_views[i].size(); ++j) {
+        lazy_views[i][j]->ResetView();
+      }
+    }
     // setup updater notification
     for (size_t i = connections.size(); i != 0; --i) {
       for (size_t j = 0; j < updaters[i - 1].size(); ++j) {
@@ -131,6 +213,7 @@ struct NeuralNet {
       for (size_t j = 0; j < updaters[i].size(); ++j) {
         updaters[i][j]->UpdateWait();
       }
+      buckets.UpdateWait(i);
       c.layer->Forward(is_train, c.nodes_in, c.nodes_out, &c.state);
     }
   }
@@ -146,13 +229,21 @@ struct NeuralNet {
       for (size_t j = 0; j < updaters[i - 1].size(); ++j) {
         updaters[i - 1][j]->BeforeBackprop(c.nodes_in, c.nodes_out);
       }
+      this->MaterializeViews(c.nodes_in);
       c.layer->Backprop(i != 1 || prop_to_input,
                         c.nodes_in, c.nodes_out, &c.state);
-      // wait backprop to complete before call update
-      if (updaters[i - 1].size() != 0) stream->Wait();
+      // wait backprop to complete before call update,
+      // a bucket only waits once the backprop of all its layers is issued
+      if (updaters[i - 1].size() != 0 && !buckets.Covers(i - 1)) stream->Wait();
       for (size_t j = 0; j < updaters[i - 1].size(); ++j) {
         updaters[i - 1][j]->AfterBackprop(need_update, update_epoch);
       }
+      buckets.AfterBackprop(i - 1, need_update);
+    }
+    // weights updated locally are updated in one pass over all of them
+    if (fused_steps.size() != 0) {
+      updater::FusedUpdate(fused_steps);
+      fused_steps.clear();
     }
   }
   /*!
@@ -170,6 +261,7 @@ struct NeuralNet {
         updaters[i][j]->UpdateWait();
       }
     }
+    buckets.UpdateWaitAll();
   }
   /*!
    * \brief update model parameters
@@ -214,16 +306,35 @@ struct NeuralNet {
                              cfg.layercfg[i][j].second.c_str());
           }
           out[k]->SetStream(stream);
-          out[k]->Init();
+          out[k]->SetFusedQueue(&fused_steps);
         }
       }
       updaters.push_back(out);
     }
     CHECK(updaters.size() == connections.size())
         << "updater size do not match number of layers";
+    // the updaters in a bucket do not need a key of their own
+    if (grad_bucket > 0.0f && ps != NULL) {
+      buckets.Init(arena, updaters, ps, devid,
+                   cfg.param.num_layers * updater::kDataKeyStep,
+                   static_cast<size_t>(grad_bucket * (1 << 20)), stream);
+    }
+    for (size_t i = 0; i < updaters.size(); ++i) {
+      for (size_t j = 0; j < updaters[i].size(); ++j) {
+        updaters[i][j]->Init();
+      }
+    }
+  }
+  // allocate the workspace requested by connections
+  inline void InitWorkspace(void) {
+    workspace.data.set_stream(stream);
+    workspace.AllocSpace();
+    utils::TrackerPrintf("workspace.size: %lu\n",
+                         static_cast<unsigned long>(workspace.max_request));
   }
   // intialize the space of nodes
   inline void InitNodes(void) {
+    if (node_alias != 0) this->PlanAlias();
     for (size_t i = 0; i < nodes.size(); ++ i) {
       mshadow::Shape<4> s = nodes[i].data.shape_;
       nodes[i].AllocSpace();
@@ -250,6 +361,7 @@ struct NeuralNet {
       const NetConfig::LayerInfo &info = cfg.layers[i];
       layer::Connection<xpu> c;
       c.type = info.type;
+      c.state.workspace = &workspace;
       for (size_t j = 0; j < info.nindex_in.size(); ++j) {
         c.nodes_in.push_back(&nodes[info.nindex_in[j]]);
       }
@@ -269,6 +381,134 @@ struct NeuralNet {
       connections.push_back(c);
     }
   }
+  // give lazy views own memory before a layer writes gradient into them
+  inline void MaterializeViews(const std::vector<layer::Node<xpu>*> &nodes_in) {
+    for (size_t i = 0; i < lazy_views.size(); ++i) {
+      const std::vector<layer::Node<xpu>*> &group = lazy_views[i];
+      bool used = false;
+      for (size_t j = 0; j < nodes_in.size(); ++j) {
+        used = used || std::count(group.begin(), group.end(), nodes_in[j]) != 0;
+      }
+      if (!used) continue;
+      for (size_t j = 0; j < group.size(); ++j) {
+        group[j]->Materialize(stream);
+      }
+    }
+  }
+  // let nodes be views of other nodes where it saves the copy in a layer
+  inline void PlanAlias(void) {
+    for (int i = 0; i < cfg.param.num_layers; ++i) {
+      const NetConfig::LayerInfo &info = cfg.layers[i];
+      // concat on channel is not a single strided view, it keeps copying
+      if (connections[i].type == layer::kConcat) {
+        bool ok = true;
+        for (size_t j = 0; j < info.nindex_in.size(); ++j) {
+          ok = ok && this->CanAlias(info.nindex_in[j], i);
+        }
+        if (!ok) continue;
+        // inputs are consecutive columns of the output
+        layer::Node<xpu> &out = nodes[info.nindex_out[0]];
+        index_t offset = 0;
+        for (size_t j = 0; j < info.nindex_in.size(); ++j) {
+          layer::Node<xpu> &in = nodes[info.nindex_in[j]];
+          in.Alias(&out, offset);
+          this->PrintAlias(info.nindex_in[j], info.nindex_out[0], offset);
+          offset += in.data.size(3);
+        }
+      }
+      if (connections[i].type == layer::kSplit) {
+        const int nin = info.nindex_in[0];
+        bool ok = nodes[nin].alias_src == NULL && !this->WrittenAfter(nin, i);
+        for (size_t j = 0; j < info.nindex_out.size(); ++j) {
+          ok = ok && this->CanShareRead(info.nindex_out[j]);
+        }
+        if (!ok) continue;
+        // first output takes the input memory, others copy it before backprop
+        std::vector<layer::Node<xpu>*> group;
+        for (size_t j = 0; j < info.nindex_out.size(); ++j) {
+          layer::Node<xpu> &out = nodes[info.nindex_out[j]];
+          if (j == 0) {
+            out.Alias(&nodes[nin], 0);
+          } else {
+            out.AliasUntilBackprop(&nodes[nin]);
+          }
+          group.push_back(&out);
+          this->PrintAlias(info.nindex_out[j], nin, 0);
+        }
+        lazy_views.push_back(group);
+      }
+      if (connections[i].type == layer::kFlatten) {
+        const int nin = info.nindex_in[0], nout = info.nindex_out[0];
+        if (nodes[nin].alias_src != NULL || nout <= cfg.param.extra_data_num ||
+            nodes[nout].alias_src != NULL || !this->OnlyReader(nin, i)) continue;
+        // same bytes, the output is a reshape of the input
+        nodes[nout].Alias(&nodes[nin], 0);
+        this->PrintAlias(nout, nin, 0);
+      }
+      if (connections[i].layer->ForwardInPlace()) {
+        const int nin = info.nindex_in[0], nout = info.nindex_out[0];
+        if (nin == nout || nodes[nin].alias_lazy ||
+            !this->OnlyReader(nin, i) || !this->CanShareRead(nout)) continue;
+        // output is the input in forward, it only takes memory when trained
+        nodes[nout].AliasUntilBackprop(&nodes[nin]);
+        lazy_views.push_back(std::vector<layer::Node<xpu>*>(1, &nodes[nout]));
+        utils::TrackerPrintf("layer[%d] runs in place on node[%s]\n", i,
+                             this->cfg.node_names[nin].c_str());
+      }
+    }
+  }
+  // whether node nid can be a view read by all its readers without copy
+  inline bool CanShareRead(int nid) const {
+    const layer::Node<xpu> &n = nodes[nid];
+    if (nid <= cfg.param.extra_data_num || n.alias_src != NULL || n.must_contiguous) {
+      return false;
+    }
+    for (int i = 0; i < cfg.param.num_layers; ++i) {
+      const NetConfig::LayerInfo &info = cfg.layers[i];
+      if (std::count(info.nindex_in.begin(), info.nindex_in.end(), nid) == 0) continue;
+      // readers must not write the node in forward
+      if (std::count(info.nindex_out.begin(), info.nindex_out.end(), nid) != 0 ||
+          !connections[i].layer->ForwardKeepsInput()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // whether node nid is written in place by a layer after lid
+  inline bool WrittenAfter(int nid, int lid) const {
+    for (int i = lid + 1; i < cfg.param.num_layers; ++i) {
+      const std::vector<int> &lout = cfg.layers[i].nindex_out;
+      if (std::count(lout.begin(), lout.end(), nid) != 0) return true;
+    }
+    return false;
+  }
+  // whether node nid can be a view, connection lid must be its only reader
+  inline bool CanAlias(int nid, int lid) const {
+    const layer::Node<xpu> &n = nodes[nid];
+    if (nid <= cfg.param.extra_data_num || n.alias_src != NULL || n.must_contiguous) {
+      return false;
+    }
+    return this->OnlyReader(nid, lid);
+  }
+  // whether connection lid is the only reader of node nid and nothing changes it after lid
+  inline bool OnlyReader(int nid, int lid) const {
+    const std::vector<int> &lin = cfg.layers[lid].nindex_in;
+    if (std::count(lin.begin(), lin.end(), nid) != 1) return false;
+    for (int i = 0; i < cfg.param.num_layers; ++i) {
+      if (i == lid) continue;
+      const NetConfig::LayerInfo &info = cfg.layers[i];
+      const bool in = std::count(info.nindex_in.begin(), info.nindex_in.end(), nid) != 0;
+      const bool out = std::count(info.nindex_out.begin(), info.nindex_out.end(), nid) != 0;
+      // read by another layer, or changed in place after lid
+      if (in && (!out || i > lid)) return false;
+    }
+    return true;
+  }
+  inline void PrintAlias(int nid, int src, index_t offset) const {
+    utils::TrackerPrintf("node[%s] is a view of node[%s], offset=%u\n",
+                         this->cfg.node_names[nid].c_str(),
+                         this->cfg.node_names[src].c_str(), offset);
+  }
   // configure the parameters of layer
   inline void ConfigConntions(void) {
     for (int i = 0; i < cfg.param.num_layers; ++ i) {
@@ -281,6 +521,9 @@ struct NeuralNet {
         connections[i].layer->SetParam(cfg.layercfg[i][j].first.c_str(),
                                        cfg.layercfg[i][j].second.c_str());
       }
+      char s[32];
+      sprintf(s, "%llu", static_cast<unsigned long long>(utils::PhiloxSeed(seed, i)));
+      connections[i].layer->SetParam("philox_seed", s);
     }
   }
   // adjust batch size to a new value, the batch_size must be smaller than max_batch
@@ -313,7 +556,16 @@ struct NeuralNet {
         delete updaters[i][j];
       }
     }
+    workspace.data.Release();
+    workspace.max_request = 0;
+    arena.entries.clear();
+    arena.wspace.Release();
+    arena.gspace.Release();
+    buckets.Clear();
+    lazy_views.clear();
     nodes.clear(); connections.clear(); updaters.clear();
+    fused_steps.clear();
+    topk.FreeSpace();
   }
 };
 
@@ -346,6 +598,7 @@ class NeuralNetThread {
       mshadow::InitTensorEngine<xpu>(device_id);
       stream = mshadow::NewStream<xpu>();
       net_ = new NeuralNet<xpu>(cfg, batch_size, seed, stream);
+      net_->ConfigBucket(pserver != NULL);
     }
   }
   // destructor
@@ -408,6 +661,7 @@ class NeuralNetThread {
   /*! \brief run a training forward backprop pass */
   inline void TrainForwardBackprop(mshadow::Tensor<cpu,4> batch,
                                    const std::vector<mshadow::Tensor<mshadow::cpu, 4> >& extra_data,
+                                   const layer::SparseInput &sparse,
                                    const layer::LabelInfo &label_info,
                                    const std::vector<std::pair<int, mshadow::Tensor<cpu, 4> > >& req,
                                    bool prop_to_input,
@@ -423,14 +677,17 @@ class NeuralNetThread {
     iparam_need_update = need_update;
     iparam_epoch = update_epoch;
     iparam_extra_data = extra_data;
+    iparam_sparse = sparse;
     this->task = kTrainProp;
     this->ExecTask();
   }
   /*! \brief run a predicting forward pass, copy final layer  */
   inline void PredictForward(mshadow::Tensor<cpu, 4> batch,
-                             const std::vector<mshadow::Tensor<mshadow::cpu, 4> > &extra_data) {
+                             const std::vector<mshadow::Tensor<mshadow::cpu, 4> > &extra_data,
+                             const layer::SparseInput &sparse) {
     iparam_batch = batch;
     iparam_extra_data = extra_data;
+    iparam_sparse = sparse;
     this->task = kPredForward;
     this->ExecTask();
   }
@@ -441,6 +698,13 @@ class NeuralNetThread {
     this->task = kCopyNode;
     this->ExecTask();
   }
+  // copy the k largest entries of each row of the last node out
+  inline void CopyTopK(int k, mshadow::Tensor<cpu, 2> out_pairs) {
+    iparam_topk = k;
+    oparam_pairs = out_pairs;
+    this->task = kCopyTopK;
+    this->ExecTask();
+  }
   // copy layer from a fs
   inline void CopyLayer(int lid, utils::IStream &fi) {
     iparam_fp = &fi;
@@ -487,6 +751,7 @@ class NeuralNetThread {
     kTrainProp,
     kPredForward,
     kCopyNode,
+    kCopyTopK,
     kCopyLayer,
     kSetWeight,
     kGetWeight,
@@ -503,6 +768,7 @@ class NeuralNetThread {
     stream = mshadow::NewStream<xpu>();
     // allocate net
     net_ = new NeuralNet<xpu>(cfg, batch_size, seed, stream);
+    net_->ConfigBucket(pserver != NULL);
     // tell the master that net is created
     job_end.Post();
     while (!destroy_signal) {
@@ -545,7 +811,8 @@ class NeuralNetThread {
       case kSyncParam: net_->SyncParam(); return;
       case kTrainProp: {
         if (iparam_batch.size(0) == 0) return;
-        net_->Forward(true, iparam_batch, iparam_extra_data, iparam_need_sync);
+        net_->Forward(true, iparam_batch, iparam_extra_data,
+                      iparam_sparse, iparam_need_sync);
         for (index_t i = 0; i < oparam_req.size(); ++i) {
           index_t id = oparam_req[i].first + (oparam_req[i].first < 0 ? net_->nodes.size() : 0);
           CHECK(id < net_->nodes.size());
@@ -556,7 +823,7 @@ class NeuralNetThread {
         return;
       }
       case kPredForward: {
-        net_->Forward(false, iparam_batch, iparam_extra_data, true);
+        net_->Forward(false, iparam_batch, iparam_extra_data, iparam_sparse, true);
         return;
       }
       case kCopyNode: {
@@ -566,9 +833,16 @@ class NeuralNetThread {
         stream->Wait();
         return;
       }
+      case kCopyTopK: {
+        if (oparam_pairs.size(0) == 0) return;
+        net_->topk.Select(net_->nodes.back().data, iparam_topk, oparam_pairs, stream);
+        return;
+      }
       case kCopyLayer: {
         CHECK(iparam_lid < static_cast<int>(net_->connections.size()));
         net_->connections[iparam_lid].layer->LoadModel(*iparam_fp);
+        // loading gives the fields storage of their own
+        if (net_->param_arena != 0) net_->arena.Reattach(net_->connections, iparam_lid);
         return;
       }
       case kSetWeight: {
@@ -607,6 +881,8 @@ class NeuralNetThread {
   mshadow::Tensor<cpu, 4> oparam_node;
   // used to copy out fields in a given layer
   std::vector<std::pair<int, mshadow::Tensor<cpu, 4> > > oparam_req;
+  // used to copy out top-k pairs of the last layer
+  mshadow::Tensor<cpu, 2> oparam_pairs;
   // output weight parameter
   mshadow::TensorContainer<cpu, 2> *oparam_weight;
   // output shape parameter
@@ -619,6 +895,8 @@ class NeuralNetThread {
   size_t iparam_epoch;
   // input node id
   int iparam_nid;
+  // input k of top-k
+  int iparam_topk;
   // input layer id
   int iparam_lid;
   // input parameters of file pointers
@@ -631,6 +909,8 @@ class NeuralNetThread {
   mshadow::Tensor<cpu, 4> iparam_batch;
   // input extra data
   std::vector<mshadow::Tensor<cpu,4> > iparam_extra_data;
+  // input sparse rows
+  layer::SparseInput iparam_sparse;
   // current task
   TaskType task;
   // intenal net implementation
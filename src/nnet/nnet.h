@@ -50,7 +50,8 @@ class INetTrainer{
                                const char *data_name) = 0;
   /*!
    * \brief predict labels for a given data batch
-   * \param out_preds the prediction result for each data sample
+   * \param out_preds the prediction result for each data sample,
+   *   when pred_topk = k is set, k pairs of (label, score) for each sample
    * \param batch the data to be predicted
    */
   virtual void Predict(mshadow::TensorContainer<mshadow::cpu, 1> *out_preds,
@@ -73,7 +74,7 @@ class INetTrainer{
   /*!
    * \brief set weight of certain layer
    * \param layer_name the name of the layer
-   * \param weight_tag type of weight can be "wmat" or "bias"
+   * \param weight_tag type of weight can be "wmat", "bias", or "bn_wmat", "bn_bias" of conv_bn_relu
    */
   virtual void SetWeight(mshadow::Tensor<mshadow::cpu, 2> weight,
                          const char *layer_name,
@@ -83,7 +84,7 @@ class INetTrainer{
    * \param out_weight hold the output weight data, Flattened to 2D
    * \param out_shape hold the shape of the weight
    * \param 
-   * \param weight_tag type of weight can be "wmat" or "bias"
+   * \param weight_tag type of weight can be "wmat", "bias", or "bn_wmat", "bn_bias" of conv_bn_relu
    */
   virtual void GetWeight(mshadow::TensorContainer<mshadow::cpu, 2> *out_weight,
                          std::vector<index_t> *out_shape,
@@ -1,5 +1,6 @@
 #include <utility>
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <cstring>
 #include <cstdlib>
@@ -26,6 +27,7 @@ class CXXNetThreadTrainer : public INetTrainer {
     update_period = 1;
     sample_counter = 0;
     eval_train = 1;
+    pred_topk = 0;
     epoch_counter = 0;
     seed = 0;
     silent = 0;
@@ -68,6 +70,7 @@ class CXXNetThreadTrainer : public INetTrainer {
     if (!strcmp(name, "batch_size")) batch_size = static_cast<mshadow::index_t>(atoi(val));
     if (!strcmp(name, "update_period")) update_period = atoi(val);
     if (!strcmp(name, "eval_train")) eval_train = atoi(val);
+    if (!strcmp(name, "pred_topk")) pred_topk = atoi(val);
     if (!strcmp(name, "seed")) seed = atoi(val);
     if (!strcmp(name, "param_server")) type_pserver = val;
     if (!strncmp(name, "metric", 6)) {
@@ -139,6 +142,15 @@ class CXXNetThreadTrainer : public INetTrainer {
           std::string data;
           utils::MemoryBufferStream fs(&data);
           old_net.connections[i].layer->SaveModel(fs);
+          if (net_cfg.layers[j].type == layer::kConvBNRelu &&
+              old_cfg.layers[i].type == layer::kConv) {
+            // conv_bn_relu saves as conv then batch_norm, take the batch_norm after conv
+            const int k = FindBatchNorm(old_cfg, old_cfg.layers[i].nindex_out[0]);
+            utils::Check(k >= 0, "conv_bn_relu %s: no batch_norm after conv %s in old model",
+                         new_name.c_str(), old_name.c_str());
+            printf("Copying layer %s into %s\n", old_cfg.layers[k].name.c_str(), new_name.c_str());
+            old_net.connections[k].layer->SaveModel(fs);
+          }
           for (index_t k = 0; k < nets_.size(); ++k){
             fs.Seek(0);
             nets_[k]->CopyLayer(j, fs);
@@ -179,8 +191,9 @@ class CXXNetThreadTrainer : public INetTrainer {
         batch_eval_req.push_back(
           std::make_pair(eval_req[j].first, eval_req[j].second.Slice(begin, end)));
       }
-      nets_[i - 1]->TrainForwardBackprop(data.data.Slice(begin, end),
+      nets_[i - 1]->TrainForwardBackprop(SliceInput(data, begin, end),
                                          extra_data,
+                                         SliceSparse(data, begin, end),
                                          info.Slice(begin, end),
                                          batch_eval_req,
                                          false, need_sync,
@@ -203,6 +216,20 @@ class CXXNetThreadTrainer : public INetTrainer {
   virtual void Predict(mshadow::TensorContainer<mshadow::cpu, 1> *out_preds,
                        const DataBatch &data) {
     mshadow::TensorContainer<mshadow::cpu, 1> &preds = *out_preds;
+    if (pred_topk > 0) {
+      // k pairs of (index, score) for each instance, selected on the device
+      // of each net so the output node is not copied out
+      preds.Resize(mshadow::Shape1(batch_size * pred_topk * 2));
+      mshadow::Tensor<cpu, 2> pairs(preds.dptr_, mshadow::Shape2(batch_size, pred_topk * 2));
+      const mshadow::index_t step = this->ForwardAll(data);
+      for (mshadow::index_t i = nets_.size(); i != 0; --i) {
+        mshadow::index_t begin = std::min((i - 1) * step, data.batch_size);
+        mshadow::index_t end = std::min(i * step, data.batch_size);
+        nets_[i - 1]->CopyTopK(pred_topk, pairs.Slice(begin, end));
+      }
+      this->WaitAllJobs();
+      return;
+    }
     std::vector<std::pair<int, mshadow::TensorContainer<cpu, 4> > > req;
     req.push_back(std::make_pair(nets_[0]->net().nodes.size() - 1, out_temp));
     mshadow::Shape<4> s = nets_[0]->net().nodes.back().data.shape_;
@@ -278,8 +305,10 @@ class CXXNetThreadTrainer : public INetTrainer {
                          const char *layer_name,
                          const char *weight_tag) {
     utils::Check(!strcmp(weight_tag, "bias") ||
-                 !strcmp(weight_tag, "wmat"),
-                 "NNet.SetWeight: weight tag can only be bias or wmat");
+                 !strcmp(weight_tag, "wmat") ||
+                 !strcmp(weight_tag, "bn_wmat") ||
+                 !strcmp(weight_tag, "bn_bias"),
+                 "NNet.SetWeight: weight tag can only be bias, wmat, bn_wmat or bn_bias");
     int layer_index = net_cfg.GetLayerIndex(layer_name);
     for (size_t i = 0; i < nets_.size(); ++i) {
       nets_[i]->SetWeight(layer_index, weight, weight_tag);
@@ -291,14 +320,26 @@ class CXXNetThreadTrainer : public INetTrainer {
                          const char *layer_name,
                          const char *weight_tag) {
     utils::Check(!strcmp(weight_tag, "bias") ||
-                 !strcmp(weight_tag, "wmat"),
-                 "NNet.GetWeight: weight tag can only be bias or wmat");
+                 !strcmp(weight_tag, "wmat") ||
+                 !strcmp(weight_tag, "bn_wmat") ||
+                 !strcmp(weight_tag, "bn_bias"),
+                 "NNet.GetWeight: weight tag can only be bias, wmat, bn_wmat or bn_bias");
     int layer_index = net_cfg.GetLayerIndex(layer_name);
     nets_[0]->GetWeight(layer_index, out_weight, out_shape, weight_tag);
     nets_[0]->WaitJob();
   }
 
  private:
+  // index of the batch_norm layer (with moving average) that reads node nid, -1 if none
+  inline static int FindBatchNorm(const NetConfig &cfg, int nid) {
+    for (size_t k = 0; k < cfg.layers.size(); ++k) {
+      if (cfg.layers[k].type == layer::kBatchNorm &&
+          cfg.layers[k].nindex_in.size() == 1 && cfg.layers[k].nindex_in[0] == nid) {
+        return static_cast<int>(k);
+      }
+    }
+    return -1;
+  }
   inline layer::LabelInfo GetLabelInfo(const DataBatch &data) const {
     layer::LabelInfo info;
     layer::LabelRecord rec;
@@ -314,6 +355,24 @@ class CXXNetThreadTrainer : public INetTrainer {
     }
     return info;
   }
+  // dense input of rows [begin, end), only carries the shape for a sparse batch
+  inline static mshadow::Tensor<cpu, 4> SliceInput(const DataBatch &data,
+                                                   index_t begin, index_t end) {
+    if (data.is_sparse() && data.data.dptr_ == NULL) {
+      return mshadow::Tensor<cpu, 4>(NULL, mshadow::Shape4(end - begin, 1, 1, 1));
+    }
+    return data.data.Slice(begin, end);
+  }
+  // sparse rows [begin, end) of the input, empty if the batch is dense
+  inline static layer::SparseInput SliceSparse(const DataBatch &data,
+                                               index_t begin, index_t end) {
+    layer::SparseInput sparse;
+    if (!data.is_sparse()) return sparse;
+    sparse.row_ptr = data.sparse_row_ptr;
+    sparse.data = data.sparse_data;
+    sparse.nrow = data.batch_size;
+    return sparse.Slice(begin, end);
+  }
   inline float TransformPred(mshadow::Tensor<cpu,1> pred) {
     if (pred.size(0) != 1) {
       return GetMaxIndex(pred);
@@ -331,29 +390,34 @@ class CXXNetThreadTrainer : public INetTrainer {
   inline void ForwardTo(std::vector<std::pair<int, mshadow::TensorContainer<cpu, 4> > >& req,
                         const DataBatch &data) {
     this->InitEvalReq(req);
+    const mshadow::index_t step = this->ForwardAll(data);
+    // copy results out
+    for (mshadow::index_t j = 0; j < req.size(); ++j) {
+      for (mshadow::index_t i = nets_.size(); i != 0; --i) {
+        mshadow::index_t begin = std::min((i - 1) * step, data.batch_size);
+        mshadow::index_t end = std::min(i * step, data.batch_size);
+        nets_[i - 1]->CopyNodeData(req[j].first, req[j].second.Slice(begin, end));
+      }
+      this->WaitAllJobs();
+    }
+  }
+  /*! \brief predicting forward pass of all nets, return the rows given to each net */
+  inline mshadow::index_t ForwardAll(const DataBatch &data) {
     const size_t ndevice = devices_.size();
     mshadow::index_t step = std::max(static_cast<mshadow::index_t>((batch_size + ndevice - 1) / ndevice), \
                                      static_cast<mshadow::index_t>(1UL));
     for (mshadow::index_t i = nets_.size(); i != 0; --i) {
       mshadow::index_t begin = std::min((i - 1) * step, data.batch_size);
       mshadow::index_t end = std::min(i * step, data.batch_size);
-      mshadow::Tensor<cpu, 4> mbatch = data.data.Slice(begin, end);
+      mshadow::Tensor<cpu, 4> mbatch = SliceInput(data, begin, end);
       std::vector<mshadow::Tensor<mshadow::cpu, 4> > extra_data;
       for (mshadow::index_t j = 0; j < data.extra_data.size(); ++j){
         extra_data.push_back(data.extra_data[j].Slice(begin, end));
       }
-      nets_[i - 1]->PredictForward(mbatch, extra_data);
+      nets_[i - 1]->PredictForward(mbatch, extra_data, SliceSparse(data, begin, end));
     }
     this->WaitAllJobs();
-    // copy results out
-    for (mshadow::index_t j = 0; j < req.size(); ++j) {
-      for (mshadow::index_t i = nets_.size(); i != 0; --i) {
-        mshadow::index_t begin = std::min((i - 1) * step, data.batch_size);
-        mshadow::index_t end = std::min(i * step, data.batch_size);
-        nets_[i - 1]->CopyNodeData(req[j].first, req[j].second.Slice(begin, end));
-      }
-      this->WaitAllJobs();
-    }
+    return step;
   }
 
   inline void WaitAllJobs(void) {
@@ -461,6 +525,8 @@ class CXXNetThreadTrainer : public INetTrainer {
   int sample_counter;
   /*! \brief show train eval */
   int eval_train;
+  /*! \brief number of top scores given by predict, 0 to give the best label */
+  int pred_topk;
   /*! \brief evaluator */
   utils::MetricSet metric;
   /*! \brief evaluator for train */
@@ -2,12 +2,15 @@
 #define _CRT_SECURE_NO_DEPRECATE
 
 #include <map>
+#include <string>
 #include <sstream>
+#include <dmlc/timer.h>
 #include <mshadow-ps/mshadow_ps.h>
 #include "./nnet_config.h"
 #include "../layer/param.h"
 #include "../utils/config.h"
 #include "../updater/updater.h"
+#include "../updater/fused_updater-inl.hpp"
 
 #if MSHADOW_DIST_PS
 namespace PS {
@@ -21,15 +24,24 @@ class CXXNetUpdater : public mshadow::ps::IModelUpdater<real_t> {
  public:
   CXXNetUpdater(void) : rnd(0) {
     seed = 0;
+    server_nthread = 0;
+    server_report = 0;
+    bigarray_bound = 1000 * 1000;
   }
   virtual ~CXXNetUpdater(void) {
     for (std::map<int, UpdaterEntry*>::iterator
              it = updaters.begin(); it != updaters.end(); ++it) {
+      if (server_report != 0) it->second->Report();
       delete it->second;
     }
   }
   virtual void SetParam(const char *name, const char *val) {
     if (!strcmp(name, "seed")) seed = atoi(val);
+    if (!strcmp(name, "server_nthread")) server_nthread = atoi(val);
+    if (!strcmp(name, "server_report")) server_report = atoi(val);
+    if (!strcmp(name, "bigarray_bound")) {
+      bigarray_bound = static_cast<size_t>(atol(val));
+    }
     cfgvec.push_back(std::make_pair(std::string(name), std::string(val)));
   }
 
@@ -63,13 +75,17 @@ class CXXNetUpdater : public mshadow::ps::IModelUpdater<real_t> {
     updaters[key] = new UpdaterEntry();
     UpdaterEntry &e = *updaters[key];
     e.key = key;
+    e.nthread = server_nthread;
+    e.bigarray_bound = bigarray_bound;
+    e.report = server_report;
     e.weight = mshadow::Tensor<cpu, 1>
         (dptr, mshadow::Shape1(size)).FlatTo2D();
     e.updater = updater::CreateUpdater<cpu>
         (cfg.updater_type.c_str(),
          &rnd, e.weight, e.weight,
          updater::DecodeTag(key));
-    e.is_bias = !strcmp(updater::DecodeTag(key), "bias");
+    e.tag = updater::DecodeTag(key);
+    e.is_bias = e.tag == "bias";
     const int i = key / updater::kDataKeyStep;
     CHECK(i < cfg.param.num_layers) << "layer index exceed bound";
     e.layer_type = cfg.layers[i].type;
@@ -94,18 +110,33 @@ class CXXNetUpdater : public mshadow::ps::IModelUpdater<real_t> {
  private:
   struct UpdaterEntry {
     int key;
+    // tag of the weight
+    std::string tag;
     // whether this is bias
     bool is_bias;
+    // initial value of batch norm slope and bias of conv_bn_relu
+    float init_slope, bn_init_bias;
     // type of layer
     layer::LayerType layer_type;
     // epoch we run
     long epoch;
+    // number of threads that split the update, 0 to use the default of OpenMP
+    int nthread;
+    // keys of at least this size are split across threads
+    size_t bigarray_bound;
+    // report the latency every report updates, 0 to only report at exit
+    int report;
+    // total time spent in update, in second
+    double update_time;
+    // steps of the fused update, the weight split into rows
+    std::vector<updater::FusedStep> steps;
     // parameters
     layer::LayerParam param;
     updater::IUpdater<cpu> *updater;
     mshadow::Tensor<cpu, 2> weight;
     // constructor
-    UpdaterEntry(void) : epoch(0) {
+    UpdaterEntry(void) : init_slope(1.0f), bn_init_bias(0.0f), epoch(0), nthread(0),
+                         bigarray_bound(1000 * 1000), report(0), update_time(0.0) {
       updater = NULL;
     }
     ~UpdaterEntry(void) {
@@ -115,13 +146,19 @@ class CXXNetUpdater : public mshadow::ps::IModelUpdater<real_t> {
                          const char *val) {
       updater->SetParam(name, val);
       param.SetParam(name, val);
+      if (!strcmp(name, "init_slope")) init_slope = static_cast<float>(atof(val));
+      if (!strcmp(name, "bn_init_bias")) bn_init_bias = static_cast<float>(atof(val));
     }
     inline void Init(mshadow::Random<cpu> *p_rnd) {
       updater->Init();
-      if (is_bias) {
+      if (tag == "bn_wmat") {
+        weight = init_slope;
+      } else if (tag == "bn_bias") {
+        weight = bn_init_bias;
+      } else if (is_bias) {
         weight = param.init_bias;
       } else {
-        if (layer_type == layer::kConv) {
+        if (layer_type == layer::kConv || layer_type == layer::kConvBNRelu) {
           param.RandInitWeight(p_rnd, weight, param.num_channel, param.kernel_height *param.kernel_width);
         } else {
           utils::Check(param.random_type != 1 || param.init_uniform > 0.0f,
@@ -134,14 +171,75 @@ class CXXNetUpdater : public mshadow::ps::IModelUpdater<real_t> {
     inline void Update(real_t *grad, size_t size) {
       CHECK(size == weight.MSize())
           << "PS: weight and gradient size inconsistent";
-      updater->Update(epoch,
-                      mshadow::Tensor<cpu, 2>(grad, weight.shape_));
+      const double tstart = dmlc::GetTime();
+      updater::FusedStep step;
+      if (updater->GetFusedStep(epoch, &step)) {
+        // the updater was created with the weight as gradient,
+        // the received gradient is consumed and cleared by the step
+        step.dw = mshadow::Tensor<cpu, 2>(grad, weight.shape_);
+        this->SplitRows(step);
+        if (size >= bigarray_bound) {
+          updater::FusedUpdate(steps, nthread);
+        } else {
+          for (size_t i = 0; i < steps.size(); ++i) {
+            for (index_t r = 0; r < steps[i].w.size(0); ++r) {
+              updater::FusedUpdateRow(steps[i], r);
+            }
+          }
+        }
+      } else {
+        updater->Update(epoch,
+                        mshadow::Tensor<cpu, 2>(grad, weight.shape_));
+      }
+      update_time += dmlc::GetTime() - tstart;
       epoch += 1;
+      if (report != 0 && epoch % report == 0) this->Report();
+    }
+    // print the average latency of update
+    inline void Report(void) const {
+      if (epoch == 0) return;
+      printf("PS: key %d, %s of layer %d, %lu values: %ld updates, %.3f ms each\n",
+             key, tag.c_str(), key / updater::kDataKeyStep,
+             static_cast<unsigned long>(weight.MSize()), epoch,
+             update_time * 1000.0 / epoch);
+    }
+
+   private:
+    // the weight is one row, view it as rows of kRowSize so it can be split,
+    // the update is elementwise and the tensors of a step are contiguous
+    inline void SplitRows(const updater::FusedStep &step) {
+      const index_t kRowSize = 1 << 12;
+      const index_t n = static_cast<index_t>(weight.MSize());
+      const index_t nrow = n / kRowSize, ntail = n % kRowSize;
+      steps.clear();
+      if (nrow != 0) {
+        steps.push_back(this->View(step, 0, mshadow::Shape2(nrow, kRowSize)));
+      }
+      if (ntail != 0) {
+        steps.push_back(this->View(step, nrow * kRowSize, mshadow::Shape2(1, ntail)));
+      }
+    }
+    inline static updater::FusedStep View(const updater::FusedStep &step,
+                                          index_t offset, mshadow::Shape<2> shape) {
+      updater::FusedStep s = step;
+      s.w = mshadow::Tensor<cpu, 2>(step.w.dptr_ + offset, shape);
+      s.dw = mshadow::Tensor<cpu, 2>(step.dw.dptr_ + offset, shape);
+      s.m1 = mshadow::Tensor<cpu, 2>(step.m1.dptr_ + offset, shape);
+      if (step.algo == updater::kFusedAdam) {
+        s.m2 = mshadow::Tensor<cpu, 2>(step.m2.dptr_ + offset, shape);
+      }
+      return s;
     }
   };
 
  private:
   int seed;
+  // number of threads of update, 0 to use the default of OpenMP
+  int server_nthread;
+  // report the latency of each key every server_report updates
+  int server_report;
+  // keys of at least this size are split across threads
+  size_t bigarray_bound;
   mshadow::Random<cpu> rnd;
   // updaters
   std::map<int, UpdaterEntry*> updaters;
@@ -0,0 +1,226 @@
+#ifndef CXXNET_NNET_PARAM_ARENA_INL_HPP_
+#define CXXNET_NNET_PARAM_ARENA_INL_HPP_
+/*!
+ * \file param_arena-inl.hpp
+ * \brief one contiguous arena for the weights and one for the gradients of all
+ *   layers, the containers of the layers become views into the arenas
+ */
+#include <vector>
+#include <string>
+#include <mshadow/tensor.h>
+#include "../layer/layer.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace nnet {
+/*!
+ * \brief weights and gradients of the layers laid out in two arenas of the same
+ *  layout, each field starts at an aligned offset and keeps the stride of its container.
+ *  after Bind the containers of the layers release their own storage and become
+ *  views into the arenas. a container that is resized later, e.g. by LoadModel of
+ *  the layer, gets new storage of its own, Reattach moves it back into the arena
+ */
+template<typename xpu>
+class ParamArena : public layer::ILayer<xpu>::IVisitor {
+ public:
+  /*! \brief alignment of each field in number of real_t, 64 bytes */
+  static const size_t kAlign = 16;
+  /*! \brief a field of a layer in the arena */
+  struct Entry {
+    /*! \brief index of the layer */
+    int layer_index;
+    /*! \brief tag of the field, e.g. wmat */
+    std::string tag;
+    /*! \brief offset in the arena */
+    size_t offset;
+    /*! \brief shape of the field flattened to 2D, the stride is shape[1] */
+    mshadow::Shape<2> shape;
+  };
+  /*! \brief fields in the arena, in order of layers */
+  std::vector<Entry> entries;
+  /*! \brief the arena of weights and the arena of gradients */
+  mshadow::TensorContainer<xpu, 1> wspace, gspace;
+  /*! \brief number of fields left in the layers, not visited as containers */
+  size_t num_loose;
+
+  ParamArena(void) : wspace(false), gspace(false), num_loose(0),
+                     reattach_(false), stream_(NULL) {}
+  /*!
+   * \brief move the weights and gradients of the connections into the arena,
+   *   shared connections are skipped. the content is kept
+   */
+  inline void Bind(const std::vector<layer::Connection<xpu> > &connections,
+                   mshadow::Stream<xpu> *stream) {
+    entries.clear(); fields_.clear(); num_loose = 0;
+    reattach_ = false; stream_ = stream;
+    size_t total = 0;
+    for (size_t i = 0; i < connections.size(); ++i) {
+      if (connections[i].type == layer::kSharedLayer) continue;
+      layer_index_ = static_cast<int>(i);
+      connections[i].layer->ApplyVisitor(this);
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+      entries[i].offset = total;
+      total += this->Span(i);
+    }
+    wspace.set_stream(stream);
+    gspace.set_stream(stream);
+    wspace.Resize(mshadow::Shape1(total));
+    gspace.Resize(mshadow::Shape1(total));
+    // padding between and inside fields stays zero
+    wspace = 0.0f; gspace = 0.0f;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      fields_[i].attach(fields_[i].weight, this->Weight(i), stream);
+      fields_[i].attach(fields_[i].grad, this->Grad(i), stream);
+    }
+    fields_.clear();
+    utils::TrackerPrintf("param_arena: %lu fields, %lu bytes of weight, %lu left in layers\n",
+                         static_cast<unsigned long>(entries.size()),
+                         static_cast<unsigned long>(total * sizeof(real_t)),
+                         static_cast<unsigned long>(num_loose));
+  }
+  /*!
+   * \brief move the fields of layer layer_index that got storage of their own
+   *  back into the arena, the shapes must be the same as in Bind
+   */
+  inline void Reattach(const std::vector<layer::Connection<xpu> > &connections,
+                       int layer_index) {
+    if (entries.size() == 0) return;
+    reattach_ = true;
+    layer_index_ = layer_index;
+    cursor_ = 0;
+    while (cursor_ < entries.size() && entries[cursor_].layer_index != layer_index) {
+      ++cursor_;
+    }
+    connections[layer_index].layer->ApplyVisitor(this);
+    reattach_ = false;
+  }
+  /*! \brief number of real_t taken by field i in the arena, padding included */
+  inline size_t Span(size_t i) const {
+    return (entries[i].shape.Size() + kAlign - 1) / kAlign * kAlign;
+  }
+  /*! \brief weight of field i in the arena, flattened to 2D */
+  inline mshadow::Tensor<xpu, 2> Weight(size_t i) const {
+    mshadow::Tensor<xpu, 2> w(wspace.dptr_ + entries[i].offset, entries[i].shape);
+    w.set_stream(stream_);
+    return w;
+  }
+  /*! \brief gradient of field i in the arena, flattened to 2D */
+  inline mshadow::Tensor<xpu, 2> Grad(size_t i) const {
+    mshadow::Tensor<xpu, 2> g(gspace.dptr_ + entries[i].offset, entries[i].shape);
+    g.set_stream(stream_);
+    return g;
+  }
+  // fields visited as tensors can not be moved
+  virtual void Visit(const char *field_name,
+                     mshadow::Tensor<xpu, 1> weight,
+                     mshadow::Tensor<xpu, 1> grad) {
+    if (!reattach_) num_loose += 1;
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::Tensor<xpu, 2> weight,
+                     mshadow::Tensor<xpu, 2> grad) {
+    if (!reattach_) num_loose += 1;
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::Tensor<xpu, 3> weight,
+                     mshadow::Tensor<xpu, 3> grad) {
+    if (!reattach_) num_loose += 1;
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::Tensor<xpu, 4> weight,
+                     mshadow::Tensor<xpu, 4> grad) {
+    if (!reattach_) num_loose += 1;
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::TensorContainer<xpu, 1> &weight,
+                     mshadow::TensorContainer<xpu, 1> &grad) {
+    this->Add(field_name, weight, grad);
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::TensorContainer<xpu, 2> &weight,
+                     mshadow::TensorContainer<xpu, 2> &grad) {
+    this->Add(field_name, weight, grad);
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::TensorContainer<xpu, 3> &weight,
+                     mshadow::TensorContainer<xpu, 3> &grad) {
+    this->Add(field_name, weight, grad);
+  }
+  virtual void Visit(const char *field_name,
+                     mshadow::TensorContainer<xpu, 4> &weight,
+                     mshadow::TensorContainer<xpu, 4> &grad) {
+    this->Add(field_name, weight, grad);
+  }
+
+ private:
+  /*! \brief the containers of a field waiting for the arena, type erased over dimension */
+  struct Field {
+    void *weight, *grad;
+    void (*attach)(void *container, mshadow::Tensor<xpu, 2> dst,
+                   mshadow::Stream<xpu> *stream);
+  };
+  /*!
+   * \brief copy the content of the container to dst, release its storage
+   *  and make it a view of dst
+   */
+  template<int dim>
+  inline static void Attach(void *container, mshadow::Tensor<xpu, 2> dst,
+                            mshadow::Stream<xpu> *stream) {
+    mshadow::TensorContainer<xpu, dim> &c =
+        *static_cast<mshadow::TensorContainer<xpu, dim>*>(container);
+    if (c.dptr_ == dst.dptr_) return;
+    utils::Check(c.FlatTo2D().size(0) == dst.size(0) && c.stride_ == dst.size(1),
+                 "ParamArena: shape of a field changed after Bind");
+    mshadow::Copy(dst, mshadow::Tensor<xpu, 2>(c.dptr_, dst.shape_), stream);
+    // wait the copy before the storage is released
+    if (stream != NULL) stream->Wait();
+    mshadow::Shape<dim> shape = c.shape_;
+    const index_t stride = c.stride_;
+    c.Release();
+    c.dptr_ = dst.dptr_;
+    c.shape_ = shape;
+    c.stride_ = stride;
+  }
+  template<int dim>
+  inline void Add(const char *field_name,
+                  mshadow::TensorContainer<xpu, dim> &w,
+                  mshadow::TensorContainer<xpu, dim> &g) {
+    utils::Check(w.shape_ == g.shape_ && w.stride_ == g.stride_,
+                 "ParamArena: weight and gradient of %s must have same layout", field_name);
+    if (reattach_) {
+      utils::Check(cursor_ < entries.size() &&
+                   entries[cursor_].layer_index == layer_index_ &&
+                   entries[cursor_].tag == field_name,
+                   "ParamArena: fields of layer %d changed after Bind", layer_index_);
+      Attach<dim>(&w, this->Weight(cursor_), stream_);
+      Attach<dim>(&g, this->Grad(cursor_), stream_);
+      ++cursor_;
+      return;
+    }
+    Entry e;
+    e.layer_index = layer_index_;
+    e.tag = field_name;
+    e.offset = 0;
+    // keep the stride so the content is copied in one piece
+    e.shape = mshadow::Shape2(w.FlatTo2D().size(0), w.stride_);
+    entries.push_back(e);
+    Field f;
+    f.weight = &w; f.grad = &g;
+    f.attach = &ParamArena::template Attach<dim>;
+    fields_.push_back(f);
+  }
+  /*! \brief layer being visited */
+  int layer_index_;
+  /*! \brief whether the visit moves fields of a bound layer back */
+  bool reattach_;
+  /*! \brief next entry of the layer being reattached */
+  size_t cursor_;
+  /*! \brief stream of the arena */
+  mshadow::Stream<xpu> *stream_;
+  /*! \brief containers of the entries, during Bind */
+  std::vector<Field> fields_;
+};
+}  // namespace nnet
+}  // namespace cxxnet
+#endif  // CXXNET_NNET_PARAM_ARENA_INL_HPP_
@@ -0,0 +1,159 @@
+#ifndef CXXNET_NNET_TOPK_SELECT_INL_HPP_
+#define CXXNET_NNET_TOPK_SELECT_INL_HPP_
+/*!
+ * \file topk_select-inl.hpp
+ * \brief the k largest scores of each row of the output node, selected on the
+ *   device of the net, so only k (index, score) pairs of a row are copied to host
+ */
+#include <vector>
+#include <algorithm>
+#include <mshadow/tensor.h>
+#include "../layer/op.h"
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace nnet {
+/*!
+ * \brief select the m largest entries of each row of pred, ties go to the smaller index,
+ *   row 2j of out is the index of the j-th largest entry and row 2j + 1 its score.
+ *   takes m rounds of row maximum by mshadow expressions, cpu kernel is overloaded below
+ * \param score temp space of shape of pred, the selected entries are dropped from it
+ * \param tmp temp space of shape of pred
+ * \param rmax temp space of shape (batch, 1, 1, 1)
+ * \param colidx index of each column, ridx is nclass minus the index
+ */
+template<typename xpu>
+inline void TopKSelect(mshadow::Tensor<xpu, 4> pred, index_t m,
+                       mshadow::Tensor<xpu, 4> score, mshadow::Tensor<xpu, 4> tmp,
+                       mshadow::Tensor<xpu, 4> rmax,
+                       mshadow::Tensor<xpu, 1> colidx, mshadow::Tensor<xpu, 1> ridx,
+                       mshadow::Tensor<xpu, 2> out, std::vector<index_t> *index) {
+  using namespace mshadow::expr;
+  const index_t n = pred.size(0), nclass = pred.size(3);
+  mshadow::Shape<2> pshape = mshadow::Shape2(1, 1);
+  mshadow::Tensor<xpu, 2> s = score.FlatTo2D(), t = tmp.FlatTo2D();
+  mshadow::Tensor<xpu, 1> vmax = rmax.FlatTo1D();
+  mshadow::Copy(score, pred, pred.stream_);
+  for (index_t j = 0; j < m; ++j) {
+    rmax = pool<mshadow::red::maximum>(score, pshape, 1, nclass, 1);
+    mshadow::Copy(out[2 * j + 1], vmax, pred.stream_);
+    // the largest nclass - index among the maximums is the smallest index
+    t = F<op::equal>(s, broadcast<0>(vmax, s.shape_)) * repmat(ridx, n);
+    rmax = pool<mshadow::red::maximum>(tmp, pshape, 1, nclass, 1);
+    out[2 * j] = scalar<real_t>(static_cast<real_t>(nclass)) - vmax;
+    s = F<op::mask_lowest>(s, F<op::equal>(repmat(colidx, n),
+                                           broadcast<0>(out[2 * j], s.shape_)));
+  }
+}
+/*! \brief compare index by score, ties go to the smaller index */
+struct TopKScoreGreater {
+  const real_t *score;
+  explicit TopKScoreGreater(const real_t *score) : score(score) {}
+  inline bool operator()(index_t a, index_t b) const {
+    return score[a] > score[b] || (score[a] == score[b] && a < b);
+  }
+};
+inline void TopKSelect(mshadow::Tensor<cpu, 4> pred, index_t m,
+                       mshadow::Tensor<cpu, 4> score, mshadow::Tensor<cpu, 4> tmp,
+                       mshadow::Tensor<cpu, 4> rmax,
+                       mshadow::Tensor<cpu, 1> colidx, mshadow::Tensor<cpu, 1> ridx,
+                       mshadow::Tensor<cpu, 2> out, std::vector<index_t> *index) {
+  // the node is in host memory, partial sort of each row in place
+  const index_t nclass = pred.size(3);
+  for (index_t i = 0; i < pred.size(0); ++i) {
+    const real_t *p = pred[i][0][0].dptr_;
+    index->resize(nclass);
+    for (index_t k = 0; k < nclass; ++k) {
+      (*index)[k] = k;
+    }
+    std::partial_sort(index->begin(), index->begin() + m, index->end(),
+                      TopKScoreGreater(p));
+    for (index_t j = 0; j < m; ++j) {
+      out[2 * j][i] = static_cast<real_t>((*index)[j]);
+      out[2 * j + 1][i] = p[(*index)[j]];
+    }
+  }
+}
+/*! \brief top-k selection of the output node, the temp space is kept between batches */
+template<typename xpu>
+class TopKSelector {
+ public:
+  TopKSelector(void)
+      : score_(false), tmp_(false), rmax_(false),
+        colidx_(false), ridx_(false), dout_(false), hout_(false) {}
+  /*!
+   * \brief write the k largest entries of each row of pred to out as (index, score)
+   *   pairs in descending order of score, pairs beyond nclass are (-1, 0)
+   * \param pred scores of shape (batch, 1, 1, nclass)
+   * \param out k pairs of each row, of shape (batch, 2k)
+   */
+  inline void Select(mshadow::Tensor<xpu, 4> pred, int k,
+                     mshadow::Tensor<cpu, 2> out, mshadow::Stream<xpu> *stream) {
+    utils::Check(pred.size(1) == 1 && pred.size(2) == 1,
+                 "pred_topk: output node must be of shape (batch, 1, 1, nclass)");
+    utils::Check(out.size(0) == pred.size(0) && out.size(1) == static_cast<index_t>(2 * k),
+                 "pred_topk: output size mismatch");
+    const index_t n = pred.size(0), nclass = pred.size(3);
+    const index_t m = std::min(static_cast<index_t>(k), nclass);
+    this->SetStream(stream);
+    if (!xpu::kDevCPU) {
+      score_.Resize(pred.shape_);
+      tmp_.Resize(pred.shape_);
+      rmax_.Resize(mshadow::Shape4(n, 1, 1, 1));
+      if (colidx_.size(0) != nclass) {
+        mshadow::TensorContainer<cpu, 1> hidx(mshadow::Shape1(nclass));
+        for (index_t c = 0; c < nclass; ++c) {
+          hidx[c] = static_cast<real_t>(c);
+        }
+        colidx_.Resize(hidx.shape_);
+        mshadow::Copy(colidx_, hidx, stream);
+        for (index_t c = 0; c < nclass; ++c) {
+          hidx[c] = static_cast<real_t>(nclass - c);
+        }
+        ridx_.Resize(hidx.shape_);
+        mshadow::Copy(ridx_, hidx, stream);
+        // hidx must outlive the copies
+        stream->Wait();
+      }
+    }
+    dout_.Resize(mshadow::Shape2(2 * m, n));
+    TopKSelect(pred, m, score_, tmp_, rmax_, colidx_, ridx_, dout_, &index_);
+    hout_.Resize(dout_.shape_);
+    mshadow::Copy(hout_, dout_, stream);
+    stream->Wait();
+    for (index_t i = 0; i < n; ++i) {
+      for (index_t j = 0; j < static_cast<index_t>(k); ++j) {
+        if (j < m) {
+          out[i][j * 2] = hout_[2 * j][i];
+          out[i][j * 2 + 1] = hout_[2 * j + 1][i];
+        } else {
+          out[i][j * 2] = -1.0f; out[i][j * 2 + 1] = 0.0f;
+        }
+      }
+    }
+  }
+  /*! \brief free the temp space */
+  inline void FreeSpace(void) {
+    score_.Release(); tmp_.Release(); rmax_.Release();
+    colidx_.Release(); ridx_.Release(); dout_.Release(); hout_.Release();
+  }
+
+ private:
+  inline void SetStream(mshadow::Stream<xpu> *stream) {
+    score_.set_stream(stream); tmp_.set_stream(stream); rmax_.set_stream(stream);
+    colidx_.set_stream(stream); ridx_.set_stream(stream); dout_.set_stream(stream);
+  }
+  /*! \brief temp space on device, not padded so they can be flattened */
+  mshadow::TensorContainer<xpu, 4> score_, tmp_, rmax_;
+  /*! \brief index of each class, and nclass minus it */
+  mshadow::TensorContainer<xpu, 1> colidx_, ridx_;
+  /*! \brief selected pairs on device, row 2j holds the index of the j-th largest */
+  mshadow::TensorContainer<xpu, 2> dout_;
+  /*! \brief selected pairs copied to host */
+  mshadow::TensorContainer<cpu, 2> hout_;
+  /*! \brief index of the cpu kernel */
+  std::vector<index_t> index_;
+};
+}  // namespace nnet
+}  // namespace cxxnet
+#endif  // CXXNET_NNET_TOPK_SELECT_INL_HPP_
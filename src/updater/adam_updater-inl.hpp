@@ -7,8 +7,10 @@
  */
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
+#include <vector>
 #include "./updater.h"
 #include "./param.h"
+#include "./fused_updater-inl.hpp"
 #include "../layer/op.h"
 
 namespace cxxnet {
@@ -22,6 +24,7 @@ class AdamUpdater : public IUpdater<xpu> {
     param.tag = tag;
     decay1 = 0.1f;
     decay2 = 0.001f;
+    fused_ = 1;
   }
   virtual ~AdamUpdater(void) {}
   virtual void Init(void) {
@@ -38,6 +41,10 @@ class AdamUpdater : public IUpdater<xpu> {
     m_w2.set_stream(stream);
   }
   virtual void Update(long epoch) {
+    FusedStep step;
+    if (this->GetFusedStep(epoch, &step)) {
+      FusedUpdate(step); return;
+    }
     this->ApplyUpdate(epoch, dw);
     // dw accumulate gradient instead of storing them
     // updater need to reset then to 0 after each update
@@ -49,6 +56,40 @@ class AdamUpdater : public IUpdater<xpu> {
     this->ApplyUpdate(epoch, mshadow::Tensor<xpu, dim>
                       (grad.dptr_, w.shape_, grad.stride_, w.stream_));
   }
+  virtual void UpdateRows(long epoch, const std::vector<index_t> &rows) {
+    using namespace mshadow::expr;
+    UniqueRows(rows, &row_index);
+    float fix1 = 1.0f - powf(1.0f - decay1, epoch + 1);
+    float fix2 = 1.0f - powf(1.0f - decay2, epoch + 1);
+    float lr_t = param.base_lr_ * sqrt(fix2) / fix1;
+    mshadow::Tensor<xpu, 2> w2 = w.FlatTo2D(), dw2 = dw.FlatTo2D();
+    mshadow::Tensor<xpu, 2> m1 = m_w1.FlatTo2D(), m2 = m_w2.FlatTo2D();
+    // untouched rows keep their moments, and get no weight decay
+    for (size_t i = 0; i < row_index.size(); ++i) {
+      const index_t r = row_index[i];
+      mshadow::Tensor<xpu, 1> rw = w2[r], grad = dw2[r];
+      mshadow::Tensor<xpu, 1> rm1 = m1[r], rm2 = m2[r];
+      if (param.wd > 0.0f) grad -= param.wd * rw;
+      rm1 += decay1 * (grad - rm1);
+      rm2 += decay2 * (F<op::square>(grad) - rm2);
+      rw -= lr_t * (rm1 / (F<op::square_root>(rm2) + 1e-8f));
+      grad = 0.0f;
+    }
+  }
+  virtual bool GetFusedStep(long epoch, FusedStep *out) {
+    if (!xpu::kDevCPU || fused_ == 0) return false;
+    float fix1 = 1.0f - powf(1.0f - decay1, epoch + 1);
+    float fix2 = 1.0f - powf(1.0f - decay2, epoch + 1);
+    out->algo = kFusedAdam;
+    out->w = FusedView(w); out->dw = FusedView(dw);
+    out->m1 = FusedView(m_w1);
+    out->m2 = FusedView(m_w2);
+    out->lr = param.base_lr_ * sqrt(fix2) / fix1;
+    out->wd = param.wd;
+    out->momentum = decay1; out->decay2 = decay2;
+    out->clip = 0.0f;
+    return true;
+  }
   virtual void StartRound(int round) {
     param.round = round;
   }
@@ -56,6 +97,7 @@ class AdamUpdater : public IUpdater<xpu> {
     param.SetParam(name, val);
     if (!strcmp(name, "beta1")) decay1 = atof(val);
     if (!strcmp(name, "beta2")) decay2 = atof(val);
+    if (!strcmp(name, "fused_update")) fused_ = atoi(val);
   }
   virtual void ApplyVisitor(typename IUpdater<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit(param.tag.c_str(), w, dw);
@@ -70,6 +112,10 @@ class AdamUpdater : public IUpdater<xpu> {
   mshadow::TensorContainer<xpu,dim> m_w2;
   float decay1;
   float decay2;
+  // use the fused kernel on cpu
+  int fused_;
+  // unique rows of a row sparse update
+  std::vector<index_t> row_index;
   // update function
   virtual void ApplyUpdate(long epoch,
                            mshadow::Tensor<xpu, dim> grad) {
@@ -9,6 +9,8 @@
 #include <mshadow/tensor.h>
 #include <dmlc/timer.h>
 #include "./updater.h"
+#include "./grad_compress-inl.hpp"
+#include "./fused_updater-inl.hpp"
 
 namespace cxxnet {
 namespace updater {
@@ -19,11 +21,15 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
                mshadow::Tensor<xpu, 2> w, mshadow::Tensor<xpu, 2> dw,
                layer::LayerType layer_type, const char *tag,
                mshadow::ps::ISharedModel<xpu, real_t> *pserver,
-               IUpdater<xpu> *updater)
+               IUpdater<xpu> *updater,
+               std::vector<index_t> *grad_rows)
       : data_key(data_key), devid(devid),
         priority(priority), w(w), dw(dw),
         layer_type(layer_type), tag(tag),
-        pserver(pserver), updater(updater), tnode(false) {
+        pserver(pserver), updater(updater),
+        grad_rows(grad_rows), fused_queue(NULL), bucketed(false),
+        compressing(false), cresid(false), cgrad(false), hframe(false),
+        cframe(false), tnode(false) {
     fullc_gather = 0;
     local_batch_size = 0;
     total_batch_size = 0;
@@ -47,7 +53,23 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
         sprintf(name, "push_op[%d]", data_key);
         pserver->SetParam(name, "gather");
       }
-      pserver->InitKey(dw.shape_, data_key, devid);
+      compressing = this->UseCompress_();
+      if (compressing) {
+        // frames of all workers are gathered, the sum is done after the pull
+        char name[32];
+        sprintf(name, "push_op[%d]", data_key);
+        pserver->SetParam(name, "gather");
+        cresid.Resize(dw.shape_, 0.0f);
+        cgrad.Resize(dw.shape_);
+        const size_t nframe = compress.FrameSize(dw.MSize());
+        utils::TrackerPrintf("grad_compress[%d]: %s, %lu values pushed as %lu, ratio %.1f\n",
+                             data_key, compress.Name(),
+                             static_cast<unsigned long>(dw.MSize()),
+                             static_cast<unsigned long>(nframe),
+                             static_cast<double>(dw.MSize()) / nframe);
+      }
+      // the key of a bucketed gradient is never used
+      if (!bucketed) pserver->InitKey(dw.shape_, data_key, devid);
       if (test_on_server != 0|| init_on_worker != 0) {
         pserver->SetWeight_(w.FlatTo2D(), data_key, devid);
       }
@@ -60,10 +82,15 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
       utils::Check(update_on_server == 0 && test_on_server == 0,
                    "parameter server must not be empty");
     }
+    utils::Check(compress.method == kCompressNone || update_on_server == 0,
+                 "grad_compress can not use update_on_server");
+    utils::Check(grad_rows == NULL || update_on_server == 0,
+                 "layers with sparse gradient, e.g. embedding, can not use update_on_server");
   }
   virtual void SetStream(mshadow::Stream<xpu> *stream) {
     if (updater != NULL) updater->SetStream(stream);
     tnode.set_stream(stream);
+    cframe.set_stream(stream);
   }
   virtual void BeforeBackprop(const std::vector<layer::Node<xpu>*> &nodes_in,
                               const std::vector<layer::Node<xpu>*> &nodes_out) {
@@ -91,15 +118,53 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
       mshadow::Copy(tin.Slice(0, local_batch_size), in, tnode.stream_);
       mshadow::Copy(tout.Slice(0, local_batch_size), out, tnode.stream_);
     }
+    if (compressing) {
+      // one frame for each device of each worker, as in fullc_gather
+      local_batch_size = nodes_in[0]->data.size(0);
+      utils::Check(total_batch_size % local_batch_size == 0,
+                   "when you use grad_compress, the batch_size "\
+                   "must be multiple of number of devices");
+      mshadow::Shape<2> fshape =
+          mshadow::Shape2(total_batch_size / local_batch_size,
+                          static_cast<index_t>(compress.FrameSize(dw.MSize())));
+      cframe.Resize(fshape);
+      hframe.Resize(fshape);
+    }
   }
   virtual void AfterBackprop(bool do_update, long epoch) {
     if (fullc_gather == 0) {
       if (do_update && pserver == NULL) {
+        if (grad_rows != NULL) {
+          updater->UpdateRows(epoch, *grad_rows);
+          grad_rows->clear(); return;
+        }
+        FusedStep step;
+        if (fused_queue != NULL && updater->GetFusedStep(epoch, &step)) {
+          // run together with the other weights of the net
+          fused_queue->push_back(step); return;
+        }
         updater->Update(epoch); return;
       }
+      if (do_update && bucketed) {
+        // pushed and pulled by the bucket
+        this->update_epoch = epoch;
+        if (grad_rows != NULL) grad_rows->clear();
+        return;
+      }
+      if (do_update && compressing) {
+        this->update_epoch = epoch;
+        if (grad_rows != NULL) grad_rows->clear();
+        this->EncodeGrad(cframe.stream_);
+        pserver->Push(cframe.Slice(0, 1), data_key, devid, priority);
+        pserver->PullReq(cframe, data_key, devid, priority,
+                         ApplyCompressedUpdate_, this);
+        return;
+      }
       if (do_update) {
         this->update_epoch = epoch;
         pserver->Push(dw, data_key, devid, priority);
+        // the server sums dense gradients, the touched rows are found again after the pull
+        if (grad_rows != NULL) grad_rows->clear();
         if (update_on_server == 0) {
           if (pull_at_backprop != 0) {
             pserver->PullReq(dw, data_key, devid, priority,
@@ -138,8 +203,21 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
       pull_not_issued = false;
     }
   }
+  virtual void SetFusedQueue(std::vector<FusedStep> *queue) {
+    fused_queue = queue;
+  }
+  virtual bool CanBucket(void) const {
+    return pserver != NULL && fullc_gather == 0 && update_on_server == 0
+        && test_on_server == 0 && init_on_worker == 0 && !this->UseCompress_();
+  }
+  virtual void SetBucketed(void) {
+    bucketed = true;
+  }
+  virtual void ApplyBucketUpdate(mshadow::Stream<xpu> *stream) {
+    ApplyUpdate_(stream, this);
+  }
   virtual void UpdateWait(void) {
-    if (pserver == NULL) return;
+    if (pserver == NULL || bucketed) return;
     pserver->PullWait(data_key, devid);
   }
   virtual void StartRound(int round) {
@@ -182,6 +260,9 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
     if (!strcmp(name, "init_on_worker")) {
       init_on_worker = atoi(val);
     }
+    if (!strcmp(name, "grad_compress")) {
+      compress.Set(val);
+    }
   }
   virtual void ApplyVisitor(typename IUpdater<xpu>::IVisitor *pvisitor) {
     updater->ApplyVisitor(pvisitor);
@@ -198,6 +279,57 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
                                  tnode.stride_, stream);
     dw += dot(tout.T(), tin);
   }
+  // whether the gradient is compressed, only for large dense gradients
+  inline bool UseCompress_(void) const {
+    return compress.method != kCompressNone && pserver != NULL
+        && fullc_gather == 0 && update_on_server == 0 && test_on_server == 0
+        && dw.MSize() >= bigarray_bound;
+  }
+  // add dw to the residual and encode it into the first frame
+  inline void EncodeGrad(mshadow::Stream<xpu> *stream) {
+    mshadow::Copy(cgrad, dw, stream);
+    if (stream != NULL) stream->Wait();
+    cresid += cgrad;
+    CompressEncode(compress, cresid.FlatTo1D(), hframe[0], &cindex);
+    mshadow::Copy(cframe.Slice(0, 1), hframe.Slice(0, 1), stream);
+    // the frame must be ready before the push
+    if (stream != NULL) stream->Wait();
+  }
+  inline static void ApplyCompressedUpdate_(mshadow::Stream<xpu> *stream, void *arg) {
+    AsyncUpdater<xpu> *up = static_cast<AsyncUpdater<xpu>*>(arg);
+    mshadow::Copy(up->hframe, up->cframe, stream);
+    if (stream != NULL) stream->Wait();
+    up->cgrad = 0.0f;
+    for (index_t i = 0; i < up->hframe.size(0); ++i) {
+      CompressDecodeAdd(up->compress, up->hframe[i], up->cgrad.FlatTo1D());
+    }
+    up->dw.set_stream(stream);
+    mshadow::Copy(up->dw, up->cgrad, stream);
+    up->UpdateMerged(stream);
+  }
+  /*!
+   * \brief update with the gradient summed over devices. a sparse gradient only
+   *  updates the rows touched on some device, the union of grad_rows of all devices,
+   *  which are the rows that are non-zero in the sum
+   */
+  inline void UpdateMerged(mshadow::Stream<xpu> *stream) {
+    updater->SetStream(stream);
+    if (grad_rows == NULL || !xpu::kDevCPU) {
+      updater->Update(update_epoch); return;
+    }
+    if (stream != NULL) stream->Wait();
+    mshadow::Tensor<mshadow::cpu, 2> g = FusedView(dw);
+    merged_rows.clear();
+    for (index_t r = 0; r < g.size(0); ++r) {
+      const real_t *pg = g[r].dptr_;
+      for (index_t j = 0; j < g.size(1); ++j) {
+        if (pg[j] != 0.0f) {
+          merged_rows.push_back(r); break;
+        }
+      }
+    }
+    updater->UpdateRows(update_epoch, merged_rows);
+  }
   inline static void CleanGrad_(mshadow::Stream<xpu> *stream, void *arg) {
     AsyncUpdater<xpu> *up = static_cast<AsyncUpdater<xpu>*>(arg);
     CHECK(up->update_on_server != 0) << "update_on_server consistency";
@@ -207,8 +339,7 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
   inline static void ApplyUpdate_(mshadow::Stream<xpu> *stream, void *arg) {
     AsyncUpdater<xpu> *up = static_cast<AsyncUpdater<xpu>*>(arg);
     if (up->update_on_server == 0) {
-      up->updater->SetStream(stream);
-      up->updater->Update(up->update_epoch);
+      up->UpdateMerged(stream);
     }
   }
   inline static void ApplyGatherUpdate_(mshadow::Stream<xpu> *stream, void *arg) {
@@ -227,6 +358,24 @@ class AsyncUpdater: public IAsyncUpdater<xpu> {
   std::string tag;
   mshadow::ps::ISharedModel<xpu, real_t> *pserver;
   IUpdater<xpu> *updater;
+  // rows of dw that can be non-zero, owned by the layer, NULL if dense
+  std::vector<index_t> *grad_rows;
+  // rows of the gradient summed over devices that are non-zero
+  std::vector<index_t> merged_rows;
+  // local updates that can be fused are appended here, owned by the net
+  std::vector<FusedStep> *fused_queue;
+  // whether push and pull are done by a bucket of the net
+  bool bucketed;
+  // compression of the pushed gradient
+  GradCompressParam compress;
+  // whether the gradient is compressed
+  bool compressing;
+  // scratch space of top-k
+  std::vector<unsigned> cindex;
+  // residual of compression and gradient on host, the frames of all workers
+  mshadow::TensorContainer<mshadow::cpu, 2> cresid, cgrad, hframe;
+  // the frames on the device, pushed and pulled
+  mshadow::TensorContainer<xpu, 2> cframe;
   // whether issue pull request at backprop
   int pull_at_backprop;
   // whether there is un-issued pullreq
@@ -0,0 +1,125 @@
+#ifndef CXXNET_UPDATER_FUSED_UPDATER_INL_HPP_
+#define CXXNET_UPDATER_FUSED_UPDATER_INL_HPP_
+/*!
+ * \file fused_updater-inl.hpp
+ * \brief fused kernel of SGD, NAG and Adam on cpu, runs the whole update of many
+ *   weights, gradient clearing included, in one multi-threaded pass
+ */
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <dmlc/omp.h>
+#include <mshadow/tensor.h>
+#include "./updater.h"
+
+namespace cxxnet {
+namespace updater {
+/*! \brief used for gradient clipping and nan detection */
+struct clip {
+  MSHADOW_XINLINE static real_t Map(real_t a, real_t b) {
+    if (isnan(a)) return 0.0f;
+    if (a < -b) return -b;
+    if (a > b) return b;
+    return a;
+  }
+};
+/*! \brief update row r of the weight of step s */
+inline void FusedUpdateRow(const FusedStep &s, index_t r) {
+  real_t *w = s.w[r].dptr_, *g = s.dw[r].dptr_, *m1 = s.m1[r].dptr_;
+  const index_t n = s.w.size(1);
+  const real_t lr = s.lr, wd = s.wd, mom = s.momentum;
+  switch (s.algo) {
+    case kFusedSGD: {
+      if (s.clip != 0.0f) {
+        for (index_t j = 0; j < n; ++j) {
+          m1[j] = m1[j] * mom + (-lr) * (clip::Map(g[j], s.clip) + wd * w[j]);
+          w[j] += m1[j];
+          g[j] = 0.0f;
+        }
+      } else {
+        for (index_t j = 0; j < n; ++j) {
+          m1[j] = m1[j] * mom + (-lr) * (g[j] + wd * w[j]);
+          w[j] += m1[j];
+          g[j] = 0.0f;
+        }
+      }
+      return;
+    }
+    case kFusedNAG: {
+      for (index_t j = 0; j < n; ++j) {
+        const real_t old = m1[j];
+        m1[j] = m1[j] * mom + (-lr) * (g[j] + wd * w[j]);
+        w[j] += (1 + mom) * m1[j] - mom * old;
+        g[j] = 0.0f;
+      }
+      return;
+    }
+    case kFusedAdam: {
+      real_t *m2 = s.m2[r].dptr_;
+      const real_t d2 = s.decay2;
+      // same as AdamUpdater, the decay only applies if wd > 0
+      const real_t awd = wd > 0.0f ? wd : 0.0f;
+      for (index_t j = 0; j < n; ++j) {
+        const real_t grad = g[j] - awd * w[j];
+        m1[j] += mom * (grad - m1[j]);
+        m2[j] += d2 * (grad * grad - m2[j]);
+        w[j] -= lr * (m1[j] / (std::sqrt(m2[j]) + 1e-8f));
+        g[j] = 0.0f;
+      }
+      return;
+    }
+    default: utils::Error("FusedUpdate: unknown algorithm");
+  }
+}
+/*!
+ * \brief run the steps, the weights are split into blocks of rows of
+ *  similar size, the blocks of all steps are run in parallel
+ * \param nthread number of threads, 0 to use the default of OpenMP
+ */
+inline void FusedUpdate(const std::vector<FusedStep> &steps, int nthread = 0) {
+  // about 16K elements in a block
+  const index_t kBlock = 1 << 14;
+  std::vector<size_t> bstep;
+  std::vector<index_t> bbegin, bend;
+  for (size_t i = 0; i < steps.size(); ++i) {
+    const index_t nrow = steps[i].w.size(0);
+    const index_t step = std::max(kBlock / std::max(steps[i].w.size(1), static_cast<index_t>(1)),
+                                  static_cast<index_t>(1));
+    for (index_t r = 0; r < nrow; r += step) {
+      bstep.push_back(i);
+      bbegin.push_back(r);
+      bend.push_back(std::min(r + step, nrow));
+    }
+  }
+  const int nblock = static_cast<int>(bstep.size());
+  if (nthread > 0) {
+    #pragma omp parallel for schedule(dynamic) num_threads(nthread)
+    for (int i = 0; i < nblock; ++i) {
+      const FusedStep &s = steps[bstep[i]];
+      for (index_t r = bbegin[i]; r < bend[i]; ++r) {
+        FusedUpdateRow(s, r);
+      }
+    }
+  } else {
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nblock; ++i) {
+      const FusedStep &s = steps[bstep[i]];
+      for (index_t r = bbegin[i]; r < bend[i]; ++r) {
+        FusedUpdateRow(s, r);
+      }
+    }
+  }
+}
+/*! \brief run one step */
+inline void FusedUpdate(const FusedStep &step) {
+  FusedUpdate(std::vector<FusedStep>(1, step));
+}
+/*! \brief view of a tensor of any device as a cpu tensor flattened to 2D */
+template<typename xpu, int dim>
+inline mshadow::Tensor<mshadow::cpu, 2> FusedView(mshadow::Tensor<xpu, dim> t) {
+  mshadow::Tensor<xpu, 2> t2 = t.FlatTo2D();
+  return mshadow::Tensor<mshadow::cpu, 2>(t2.dptr_, t2.shape_, t2.stride_, NULL);
+}
+}  // namespace updater
+}  // namespace cxxnet
+#endif  // CXXNET_UPDATER_FUSED_UPDATER_INL_HPP_
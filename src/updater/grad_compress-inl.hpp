@@ -0,0 +1,171 @@
+#ifndef CXXNET_UPDATER_GRAD_COMPRESS_INL_HPP_
+#define CXXNET_UPDATER_GRAD_COMPRESS_INL_HPP_
+/*!
+ * \file grad_compress-inl.hpp
+ * \brief compression of gradients sent to the parameter server, top-k
+ *   sparsification or 1-bit sign with a per-tensor scale. the part of the
+ *   gradient that is not sent is kept as residual and added to the next one
+ */
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <mshadow/tensor.h>
+#include "../utils/utils.h"
+
+namespace cxxnet {
+namespace updater {
+/*! \brief compression methods */
+const int kCompressNone = 0;
+const int kCompressTopK = 1;
+const int kCompressOneBit = 2;
+/*!
+ * \brief a compressed gradient is a frame of real_t of fixed size,
+ *  so frames of several workers can be gathered into one tensor.
+ *  top-k: k pairs of (index, value), the index stored as bits of real_t
+ *  1-bit: the scale, then the signs packed 32 in one real_t
+ */
+struct GradCompressParam {
+  /*! \brief the method */
+  int method;
+  /*! \brief fraction of entries sent by top-k */
+  float ratio;
+  GradCompressParam(void) : method(kCompressNone), ratio(0.01f) {}
+  /*! \brief set from none, onebit, topk or topk:ratio */
+  inline void Set(const char *val) {
+    if (!strcmp(val, "none")) {
+      method = kCompressNone;
+    } else if (!strcmp(val, "onebit")) {
+      method = kCompressOneBit;
+    } else if (!strncmp(val, "topk", 4)) {
+      method = kCompressTopK;
+      if (val[4] == ':') ratio = static_cast<float>(atof(val + 5));
+      utils::Check(ratio > 0.0f && ratio <= 1.0f, "grad_compress: topk ratio must be in (0, 1]");
+    } else {
+      utils::Error("grad_compress: unknown method %s, use none, topk[:ratio] or onebit", val);
+    }
+    utils::Check(sizeof(real_t) == sizeof(unsigned), "grad_compress: need 32 bit real_t");
+  }
+  /*! \brief number of entries sent by top-k for a gradient of size n */
+  inline size_t TopK(size_t n) const {
+    return std::max(static_cast<size_t>(n * ratio), static_cast<size_t>(1));
+  }
+  /*! \brief size of the frame of a gradient of size n */
+  inline size_t FrameSize(size_t n) const {
+    switch (method) {
+      case kCompressTopK: return 2 * this->TopK(n);
+      case kCompressOneBit: return 1 + (n + 31) / 32;
+      default: return n;
+    }
+  }
+  /*! \brief name of the method, used in log */
+  inline const char *Name(void) const {
+    switch (method) {
+      case kCompressTopK: return "topk";
+      case kCompressOneBit: return "onebit";
+      default: return "none";
+    }
+  }
+};
+/*! \brief bits of an unsigned stored in a real_t and back */
+inline real_t CompressPackBits(unsigned u) {
+  real_t f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+inline unsigned CompressUnpackBits(real_t f) {
+  unsigned u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+/*! \brief order of indices by absolute value of the gradient, largest first */
+struct CompressAbsGreater {
+  const real_t *r;
+  explicit CompressAbsGreater(const real_t *r) : r(r) {}
+  inline bool operator()(unsigned a, unsigned b) const {
+    return std::fabs(r[a]) > std::fabs(r[b]);
+  }
+};
+/*!
+ * \brief encode resid into frame, resid holds the gradient plus the residual of
+ *  the last step, and keeps the part that is not sent on return
+ * \param index scratch space of top-k, kept by the caller to avoid allocation
+ */
+inline void CompressEncode(const GradCompressParam &p,
+                           mshadow::Tensor<mshadow::cpu, 1> resid,
+                           mshadow::Tensor<mshadow::cpu, 1> frame,
+                           std::vector<unsigned> *index) {
+  const size_t n = resid.size(0);
+  real_t *r = resid.dptr_, *f = frame.dptr_;
+  utils::Check(frame.size(0) == p.FrameSize(n), "CompressEncode: frame size mismatch");
+  if (p.method == kCompressTopK) {
+    const size_t k = p.TopK(n);
+    index->resize(n);
+    for (size_t i = 0; i < n; ++i) (*index)[i] = static_cast<unsigned>(i);
+    std::nth_element(index->begin(), index->begin() + (k - 1), index->end(),
+                     CompressAbsGreater(r));
+    for (size_t i = 0; i < k; ++i) {
+      const unsigned j = (*index)[i];
+      f[2 * i] = CompressPackBits(j);
+      f[2 * i + 1] = r[j];
+      r[j] = 0.0f;
+    }
+    return;
+  }
+  if (p.method == kCompressOneBit) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += std::fabs(r[i]);
+    const real_t scale = n != 0 ? static_cast<real_t>(sum / n) : 0.0f;
+    f[0] = scale;
+    for (size_t w = 0; w * 32 < n; ++w) {
+      unsigned bits = 0;
+      const size_t end = std::min(n, w * 32 + 32);
+      for (size_t i = w * 32; i < end; ++i) {
+        if (r[i] >= 0.0f) {
+          bits |= 1U << (i - w * 32);
+          r[i] -= scale;
+        } else {
+          r[i] += scale;
+        }
+      }
+      f[1 + w] = CompressPackBits(bits);
+    }
+    return;
+  }
+  mshadow::Copy(frame, resid);
+  resid = 0.0f;
+}
+/*! \brief add the gradient encoded in frame to out */
+inline void CompressDecodeAdd(const GradCompressParam &p,
+                              mshadow::Tensor<mshadow::cpu, 1> frame,
+                              mshadow::Tensor<mshadow::cpu, 1> out) {
+  const size_t n = out.size(0);
+  const real_t *f = frame.dptr_;
+  real_t *o = out.dptr_;
+  utils::Check(frame.size(0) == p.FrameSize(n), "CompressDecodeAdd: frame size mismatch");
+  if (p.method == kCompressTopK) {
+    const size_t k = p.TopK(n);
+    for (size_t i = 0; i < k; ++i) {
+      const unsigned j = CompressUnpackBits(f[2 * i]);
+      utils::Check(j < n, "CompressDecodeAdd: index exceed bound");
+      o[j] += f[2 * i + 1];
+    }
+    return;
+  }
+  if (p.method == kCompressOneBit) {
+    const real_t scale = f[0];
+    for (size_t w = 0; w * 32 < n; ++w) {
+      const unsigned bits = CompressUnpackBits(f[1 + w]);
+      const size_t end = std::min(n, w * 32 + 32);
+      for (size_t i = w * 32; i < end; ++i) {
+        o[i] += (bits >> (i - w * 32)) & 1U ? scale : -scale;
+      }
+    }
+    return;
+  }
+  out += frame;
+}
+}  // namespace updater
+}  // namespace cxxnet
+#endif  // CXXNET_UPDATER_GRAD_COMPRESS_INL_HPP_
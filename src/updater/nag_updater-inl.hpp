@@ -9,6 +9,7 @@
 #include <mshadow/tensor.h>
 #include "./updater.h"
 #include "./param.h"
+#include "./fused_updater-inl.hpp"
 
 namespace cxxnet {
 namespace updater {
@@ -19,6 +20,7 @@ class NAGUpdater : public IUpdater<xpu> {
   NAGUpdater(mshadow::Tensor<xpu,dim> w, mshadow::Tensor<xpu,dim> dw, const char *tag)
       :w(w), dw(dw) {
     param.tag = tag;
+    fused_ = 1;
   }
   virtual ~NAGUpdater(void) {}
   virtual void Init(void) {
@@ -35,6 +37,10 @@ class NAGUpdater : public IUpdater<xpu> {
     old_m_w.set_stream(stream);
   }
   virtual void Update(long epoch) {
+    FusedStep step;
+    if (this->GetFusedStep(epoch, &step)) {
+      FusedUpdate(step); return;
+    }
     this->ApplyUpdate(epoch, dw);
     // dw accumulate gradient instead of storing them
     // updater need to reset then to 0 after each update
@@ -46,11 +52,24 @@ class NAGUpdater : public IUpdater<xpu> {
     this->ApplyUpdate(epoch, mshadow::Tensor<xpu, dim>
                       (grad.dptr_, w.shape_, grad.stride_, w.stream_));
   }
+  virtual bool GetFusedStep(long epoch, FusedStep *out) {
+    if (!xpu::kDevCPU || fused_ == 0) return false;
+    param.ScheduleEpoch(epoch);
+    // the old momentum is kept in register, old_m_w is not used
+    out->algo = kFusedNAG;
+    out->w = FusedView(w); out->dw = FusedView(dw);
+    out->m1 = FusedView(m_w);
+    out->lr = param.learning_rate; out->wd = param.wd;
+    out->momentum = param.momentum;
+    out->clip = 0.0f;
+    return true;
+  }
   virtual void StartRound(int round) {
     param.round = round;
   }
   virtual void SetParam(const char *name, const char *val) {
     param.SetParam(name, val);
+    if (!strcmp(name, "fused_update")) fused_ = atoi(val);
   }
   virtual void ApplyVisitor(typename IUpdater<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit(param.tag.c_str(), w, dw);
@@ -62,6 +81,8 @@ class NAGUpdater : public IUpdater<xpu> {
   mshadow::Tensor<xpu,dim> w, dw;
   // momentum variable
   mshadow::TensorContainer<xpu,dim> m_w, old_m_w;
+  // use the fused kernel on cpu
+  int fused_;
   
   inline void ApplyUpdate(long epoch,
                           mshadow::Tensor<xpu, dim> grad) {
@@ -8,20 +8,13 @@
 #include <dmlc/logging.h>
 #include <mshadow/tensor.h>
 #include <cmath>
+#include <vector>
 #include "./updater.h"
 #include "./param.h"
+#include "./fused_updater-inl.hpp"
 
 namespace cxxnet {
 namespace updater {
-/*! \brief used for gradient clipping and nan detection */
-struct clip {
-  MSHADOW_XINLINE static real_t Map(real_t a, real_t b) {
-    if (isnan(a)) return 0.0f;
-    if (a < -b) return -b;
-    if (a > b) return b;
-    return a;
-  }
-};
 
 // SGD updater with momentum
 template<typename xpu, int dim>
@@ -30,6 +23,7 @@ class SGDUpdater : public IUpdater<xpu> {
   SGDUpdater(mshadow::Tensor<xpu,dim> w, mshadow::Tensor<xpu,dim> dw, const char *tag)
       :w(w), dw(dw) {
     param.tag = tag;
+    fused_ = 1;
   }
   virtual ~SGDUpdater(void) {}
   virtual void Init(void) {
@@ -44,6 +38,10 @@ class SGDUpdater : public IUpdater<xpu> {
     m_w.set_stream(stream);
   }
   virtual void Update(long epoch) {
+    FusedStep step;
+    if (this->GetFusedStep(epoch, &step)) {
+      FusedUpdate(step); return;
+    }
     this->ApplyUpdate(epoch, dw);
     // dw accumulate gradient instead of storing them
     // updater need to reset then to 0 after each update
@@ -55,11 +53,43 @@ class SGDUpdater : public IUpdater<xpu> {
     this->ApplyUpdate(epoch, mshadow::Tensor<xpu, dim>
                       (grad.dptr_, w.shape_, grad.stride_, w.stream_));
   }
+  virtual void UpdateRows(long epoch, const std::vector<index_t> &rows) {
+    using namespace mshadow::expr;
+    param.ScheduleEpoch(epoch);
+    UniqueRows(rows, &row_index);
+    mshadow::Tensor<xpu, 2> w2 = w.FlatTo2D(), dw2 = dw.FlatTo2D();
+    mshadow::Tensor<xpu, 2> m2 = m_w.FlatTo2D();
+    // untouched rows keep their momentum until they are touched again
+    for (size_t i = 0; i < row_index.size(); ++i) {
+      mshadow::Tensor<xpu, 1> rw = w2[row_index[i]], rdw = dw2[row_index[i]];
+      mshadow::Tensor<xpu, 1> rm = m2[row_index[i]];
+      rm *= param.momentum;
+      if (param.clip_gradient != 0.0f) {
+        rm += (-param.learning_rate) * (F<clip>(rdw, param.clip_gradient) + param.wd * rw);
+      } else {
+        rm += (-param.learning_rate) * (rdw + param.wd * rw);
+      }
+      rw += rm;
+      rdw = 0.0f;
+    }
+  }
+  virtual bool GetFusedStep(long epoch, FusedStep *out) {
+    if (!xpu::kDevCPU || fused_ == 0) return false;
+    param.ScheduleEpoch(epoch);
+    out->algo = kFusedSGD;
+    out->w = FusedView(w); out->dw = FusedView(dw);
+    out->m1 = FusedView(m_w);
+    out->lr = param.learning_rate; out->wd = param.wd;
+    out->momentum = param.momentum;
+    out->clip = param.clip_gradient;
+    return true;
+  }
   virtual void StartRound(int round) {
     param.round = round;
   }
   virtual void SetParam(const char *name, const char *val) {
     param.SetParam(name, val);
+    if (!strcmp(name, "fused_update")) fused_ = atoi(val);
   }
   virtual void ApplyVisitor(typename IUpdater<xpu>::IVisitor *pvisitor) {
     pvisitor->Visit(param.tag.c_str(), w, dw);
@@ -71,6 +101,10 @@ class SGDUpdater : public IUpdater<xpu> {
   mshadow::Tensor<xpu,dim> w, dw;
   // momentum variable
   mshadow::TensorContainer<xpu,dim> m_w;
+  // unique rows of a row sparse update
+  std::vector<index_t> row_index;
+  // use the fused kernel on cpu
+  int fused_;
   // update function
   virtual void ApplyUpdate(long epoch,
                            mshadow::Tensor<xpu, dim> grad) {
@@ -2,6 +2,7 @@
 #define CXXNET_UPDATER_UPDATER_H_
 
 #include <vector>
+#include <algorithm>
 #include <mshadow/tensor.h>
 #include <mshadow-ps/mshadow_ps.h>
 #include "../global.h"
@@ -10,6 +11,30 @@
 namespace cxxnet {
 /*! \brief namespace of updating algorithms */
 namespace updater {
+/*! \brief algorithms run by the fused update kernel */
+const int kFusedSGD = 0;
+const int kFusedNAG = 1;
+const int kFusedAdam = 2;
+/*!
+ * \brief one update of a weight in the form run by the fused kernel, see FusedUpdate.
+ *  the tensors are on cpu and flattened to 2D, the gradient is cleared by the update
+ */
+struct FusedStep {
+  /*! \brief algorithm, one of kFusedSGD, kFusedNAG and kFusedAdam */
+  int algo;
+  /*! \brief weight and gradient */
+  mshadow::Tensor<mshadow::cpu, 2> w, dw;
+  /*! \brief state of the updater, momentum, or first and second moment of adam */
+  mshadow::Tensor<mshadow::cpu, 2> m1, m2;
+  /*! \brief learning rate and weight decay of the step */
+  float lr, wd;
+  /*! \brief momentum, or decay of first moment of adam */
+  float momentum;
+  /*! \brief decay of second moment of adam */
+  float decay2;
+  /*! \brief clip the gradient to [-clip, clip], do nothing if 0 */
+  float clip;
+};
 /*!
  * \brief interface of parameter updater,
  *        it defines the updating behavior of parameters
@@ -61,10 +86,39 @@ class IUpdater {
    *        be called before passing in the gradient value
    */
   virtual void Update(long epoch, mshadow::Tensor<xpu, 2> grad) = 0;
+  /*!
+   * \brief update only given rows of the parameter flattened to 2D,
+   *        the gradient of other rows must be 0, in default do a full update
+   * \param epoch what current epoch is
+   * \param rows the rows to be updated, can be unsorted and repeated
+   */
+  virtual void UpdateRows(long epoch, const std::vector<index_t> &rows) {
+    this->Update(epoch);
+  }
+  /*!
+   * \brief describe the update of Update(epoch) for the fused kernel instead of running it,
+   *        the learning rate schedule advances as in Update
+   * \param epoch what current epoch is
+   * \param out the step to be given to FusedUpdate
+   * \return false if the updater can not be fused, Update must be called then
+   */
+  virtual bool GetFusedStep(long epoch, FusedStep *out) {
+    return false;
+  }
   /*!\ brief set parameters that could be spefic to this updater */
   virtual void SetParam(const char *name, const char *val) = 0;
 };
 
+/*!
+ * \brief sort rows and remove the repeated ones, used by row sparse updates
+ * \param rows the rows given to UpdateRows
+ * \param out the unique rows in increasing order
+ */
+inline void UniqueRows(const std::vector<index_t> &rows, std::vector<index_t> *out) {
+  *out = rows;
+  std::sort(out->begin(), out->end());
+  out->erase(std::unique(out->begin(), out->end()), out->end());
+}
 /*!
  * \brief asynchronize updater,
  * BeforeBackprop and AfterBackprop are asynchronize functions calls
@@ -97,6 +151,28 @@ class IAsyncUpdater : public IUpdater<xpu> {
    * this function will directly return
    */
   virtual void UpdateWait(void) = 0;
+  /*!
+   * \brief let local updates that can be fused be appended to queue in AfterBackprop
+   *  instead of being run, the owner of queue runs FusedUpdate over it, in default do nothing
+   */
+  virtual void SetFusedQueue(std::vector<FusedStep> *queue) {}
+  /*!
+   * \brief whether the gradient can be pushed and pulled as part of a bucket
+   *  of gradients of the net, in default false
+   */
+  virtual bool CanBucket(void) const {
+    return false;
+  }
+  /*!
+   * \brief leave push and pull of the gradient to the bucket of the net,
+   *  called before Init, AfterBackprop then only records the epoch
+   */
+  virtual void SetBucketed(void) {}
+  /*!
+   * \brief apply the update after the bucket pulled the summed gradient,
+   *  called in the pull callback of the bucket
+   */
+  virtual void ApplyBucketUpdate(mshadow::Stream<xpu> *stream) {}
   // disable update function
   virtual void Update(long epoch) {
     utils::Error("IAsyncUpdater.Update call AfterBackprop instead");
@@ -144,8 +220,10 @@ void CreateAsyncUpdaters(int layer_index,
 /*!
  * \brief constant used to encode key index of parameter server
  *   data_key = layer_index * kDataKeyStep
+ *   key(layer[i].wmat) == i * kDataKeyStep + 0
  *   key(layer[i].bias) == i * kDataKeyStep + 1
- *   key(layer[i].bias) == i * kDataKeyStep + 1
+ *   key(layer[i].bn_wmat) == i * kDataKeyStep + 2
+ *   key(layer[i].bn_bias) == i * kDataKeyStep + 3
  */
 static const int kDataKeyStep = 4;
 /*!
@@ -156,7 +234,9 @@ static const int kDataKeyStep = 4;
 inline int EncodeDataKey(int layer_index, const char *tag) {
   if (!strcmp(tag, "bias")) return layer_index * kDataKeyStep + 1;
   if (!strcmp(tag, "wmat")) return layer_index * kDataKeyStep + 0;
-  utils::Error("EncodeDataKey: only support weight tag: wmat or bias");
+  if (!strcmp(tag, "bn_wmat")) return layer_index * kDataKeyStep + 2;
+  if (!strcmp(tag, "bn_bias")) return layer_index * kDataKeyStep + 3;
+  utils::Error("EncodeDataKey: only support weight tag: wmat, bias, bn_wmat or bn_bias");
   return 0;
 }
 /*!
@@ -168,6 +248,8 @@ inline const char *DecodeTag(int key) {
   switch (key % updater::kDataKeyStep) {
     case 0: return "wmat";
     case 1: return "bias";
+    case 2: return "bn_wmat";
+    case 3: return "bn_bias";
     default: utils::Error("invalid key"); return "";
   }
 }
@@ -38,11 +38,13 @@ CreateAsyncUpdater_(int layer_index,
                     layer::LayerType layer_type,
                     mshadow::Tensor<xpu,dim> weight,
                     mshadow::Tensor<xpu,dim> wgrad,
-                    const char *tag) {
+                    const char *tag,
+                    std::vector<index_t> *grad_rows) {
   return new AsyncUpdater<xpu>(EncodeDataKey(layer_index, tag),
                                devid, priority,
                                weight.FlatTo2D(), wgrad.FlatTo2D(), layer_type, tag,
-                               pserver, CreateUpdater_(type, p_rnd, weight, wgrad, tag));
+                               pserver, CreateUpdater_(type, p_rnd, weight, wgrad, tag),
+                               grad_rows);
 }
 
 template<typename xpu>
@@ -59,6 +61,8 @@ struct CreateAsyncUpdaterVisitor : public IUpdater<xpu>::IVisitor {
   mshadow::Random<xpu> *p_rnd;
   // layer type;
   layer::LayerType layer_type;
+  // the layer being visited
+  layer::ILayer<xpu> *p_layer;
   // output updaters
   std::vector<IAsyncUpdater<xpu>*> *out_updaters;
   // constructor
@@ -69,40 +73,46 @@ struct CreateAsyncUpdaterVisitor : public IUpdater<xpu>::IVisitor {
    const char *type,
    mshadow::Random<xpu> *p_rnd,
    layer::LayerType layer_type,
+   layer::ILayer<xpu> *p_layer,
    std::vector<IAsyncUpdater<xpu>*> *out_updaters)
       : layerid(layerid),
         devid(devid),
         pserver(pserver),
         type(type), p_rnd(p_rnd),
         layer_type(layer_type),
+        p_layer(p_layer),
         out_updaters(out_updaters) {}
   virtual void Visit(const char *field_name,
                      mshadow::Tensor<xpu,1> weight,
                      mshadow::Tensor<xpu,1> grad) {
     out_updaters->push_back(CreateAsyncUpdater_(layerid, devid, -layerid, pserver,
                                                 type, p_rnd, layer_type,
-                                                weight, grad, field_name));
+                                                weight, grad, field_name,
+                                                p_layer->GradRows(field_name)));
   }
   virtual void Visit(const char *field_name,
                      mshadow::Tensor<xpu,2> weight,
                      mshadow::Tensor<xpu,2> grad) {
     out_updaters->push_back(CreateAsyncUpdater_(layerid, devid, -layerid, pserver,
                                                 type, p_rnd, layer_type,
-                                                weight, grad, field_name));
+                                                weight, grad, field_name,
+                                                p_layer->GradRows(field_name)));
   }
   virtual void Visit(const char *field_name,
                      mshadow::Tensor<xpu,3> weight,
                      mshadow::Tensor<xpu,3> grad) {
     out_updaters->push_back(CreateAsyncUpdater_(layerid, devid, -layerid, pserver,
                                                 type, p_rnd, layer_type,
-                                                weight, grad, field_name));
+                                                weight, grad, field_name,
+                                                p_layer->GradRows(field_name)));
   }
   virtual void Visit(const char *field_name,
                      mshadow::Tensor<xpu,4> weight,
                      mshadow::Tensor<xpu,4> grad) {
     out_updaters->push_back(CreateAsyncUpdater_(layerid, devid, -layerid, pserver,
                                                 type, p_rnd, layer_type,
-                                                weight, grad, field_name));
+                                                weight, grad, field_name,
+                                                p_layer->GradRows(field_name)));
   }
 
 };
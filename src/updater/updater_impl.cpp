@@ -23,7 +23,8 @@ void CreateAsyncUpdaters<cpu>(int layer_index,
                               layer::ILayer<cpu> *p_layer,
                               std::vector<IAsyncUpdater<cpu>*> *out_updaters) {
   CreateAsyncUpdaterVisitor<cpu> visitor(layer_index, device_id, param_server,
-                                         type, p_rnd, layer_type, out_updaters);  
+                                         type, p_rnd, layer_type, p_layer,
+                                         out_updaters);  
   p_layer->ApplyVisitor(&visitor);  
 }
 }  // namespace updater
@@ -24,7 +24,8 @@ void CreateAsyncUpdaters<gpu>(int layer_index,
                               layer::ILayer<gpu> *p_layer,
                               std::vector<IAsyncUpdater<gpu>*> *out_updaters) {
   CreateAsyncUpdaterVisitor<gpu> visitor(layer_index, device_id, param_server,
-                                         type, p_rnd, layer_type, out_updaters);
+                                         type, p_rnd, layer_type, p_layer,
+                                         out_updaters);
   p_layer->ApplyVisitor(&visitor);
 }
 }  // namespace updater
@@ -0,0 +1,184 @@
+#ifndef CXXNET_UTILS_PHILOX_H_
+#define CXXNET_UTILS_PHILOX_H_
+/*!
+ * \file philox.h
+ * \brief counter based random number generator Philox4x32-10,
+ *   the i-th block of random numbers is a function of (key, i),
+ *   so any part of a random stream can be generated independently.
+ *   see Salmon et al. "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011
+ */
+#include <cstdlib>
+#include <algorithm>
+#include <dmlc/omp.h>
+#include <mshadow/tensor.h>
+#include "./utils.h"
+
+namespace cxxnet {
+namespace utils {
+/*! \brief Philox4x32-10, generates 4 uint32 numbers per counter */
+class Philox4x32 {
+ public:
+  explicit Philox4x32(uint64_t seed = 0) {
+    this->Seed(seed);
+  }
+  /*!
+   * \brief set the key of the generator
+   * \param seed the random number seed
+   */
+  inline void Seed(uint64_t seed) {
+    key_[0] = static_cast<uint32_t>(seed);
+    key_[1] = static_cast<uint32_t>(seed >> 32);
+  }
+  /*!
+   * \brief generate the block of random numbers of given counter
+   * \param ctr the counter
+   * \param out 4 random numbers of the block
+   */
+  inline void Generate(uint64_t ctr, uint32_t out[4]) const {
+    uint32_t c[4], k[2];
+    c[0] = static_cast<uint32_t>(ctr);
+    c[1] = static_cast<uint32_t>(ctr >> 32);
+    c[2] = 0; c[3] = 0;
+    k[0] = key_[0]; k[1] = key_[1];
+    for (int r = 0; r < 10; ++r) {
+      if (r != 0) {
+        k[0] += kWeyl0; k[1] += kWeyl1;
+      }
+      const uint64_t p0 = static_cast<uint64_t>(kMul0) * c[0];
+      const uint64_t p1 = static_cast<uint64_t>(kMul1) * c[2];
+      const uint32_t hi0 = static_cast<uint32_t>(p0 >> 32);
+      const uint32_t hi1 = static_cast<uint32_t>(p1 >> 32);
+      c[0] = hi1 ^ c[1] ^ k[0];
+      c[1] = static_cast<uint32_t>(p1);
+      c[2] = hi0 ^ c[3] ^ k[1];
+      c[3] = static_cast<uint32_t>(p0);
+    }
+    out[0] = c[0]; out[1] = c[1]; out[2] = c[2]; out[3] = c[3];
+  }
+
+ private:
+  static const uint32_t kMul0 = 0xD2511F53U;
+  static const uint32_t kMul1 = 0xCD9E8D57U;
+  static const uint32_t kWeyl0 = 0x9E3779B9U;
+  static const uint32_t kWeyl1 = 0xBB67AE85U;
+  /*! \brief key of the generator */
+  uint32_t key_[2];
+};
+/*!
+ * \brief fill dst with uniform random numbers in [a, b), element i of dst
+ *   takes number i of the stream starting at block counter. rows are filled
+ *   in parallel, the result does not depend on the number of threads
+ * \param nthread number of threads used
+ */
+inline void SampleUniform(mshadow::Tensor<mshadow::cpu, 2> dst,
+                          const Philox4x32 &rng, uint64_t counter,
+                          float a, float b, int nthread) {
+  typedef mshadow::default_real_t real_t;
+  const mshadow::index_t ncol = dst.size(1);
+  const int nrow = static_cast<int>(dst.size(0));
+  // top 24 bits of each number
+  const float scale = (b - a) * (1.0f / 16777216.0f);
+  #pragma omp parallel for num_threads(nthread) schedule(static)
+  for (int y = 0; y < nrow; ++y) {
+    real_t *p = dst[y].dptr_;
+    const uint64_t start = static_cast<uint64_t>(y) * ncol;
+    uint64_t blk = counter + (start >> 2);
+    uint32_t rnd[4];
+    mshadow::index_t x = 0;
+    // head of the row inside a block shared with previous row
+    if ((start & 3) != 0) {
+      rng.Generate(blk++, rnd);
+      for (uint64_t k = start & 3; k < 4 && x < ncol; ++k, ++x) {
+        p[x] = a + static_cast<float>(rnd[k] >> 8) * scale;
+      }
+    }
+    for (; x + 4 <= ncol; x += 4) {
+      rng.Generate(blk++, rnd);
+      p[x + 0] = a + static_cast<float>(rnd[0] >> 8) * scale;
+      p[x + 1] = a + static_cast<float>(rnd[1] >> 8) * scale;
+      p[x + 2] = a + static_cast<float>(rnd[2] >> 8) * scale;
+      p[x + 3] = a + static_cast<float>(rnd[3] >> 8) * scale;
+    }
+    if (x < ncol) {
+      rng.Generate(blk, rnd);
+      for (uint64_t k = 0; x < ncol; ++k, ++x) {
+        p[x] = a + static_cast<float>(rnd[k] >> 8) * scale;
+      }
+    }
+  }
+}
+/*!
+ * \brief a random stream on top of Philox4x32, each draw takes the next
+ *   part of the stream, which can be skipped ahead without generating it
+ */
+class PhiloxStream {
+ public:
+  PhiloxStream(void) : counter_(0), nthread_(1) {}
+  /*! \brief set the key and restart the stream */
+  inline void Seed(uint64_t seed) {
+    rng_.Seed(seed);
+    counter_ = 0;
+  }
+  /*! \brief set number of threads used to fill tensors */
+  inline void set_nthread(int nthread) {
+    nthread_ = std::max(nthread, 1);
+  }
+  inline int nthread(void) const {
+    return nthread_;
+  }
+  /*! \brief the underlying generator */
+  inline const Philox4x32 &generator(void) const {
+    return rng_;
+  }
+  /*! \brief block counter where the next draw starts */
+  inline uint64_t counter(void) const {
+    return counter_;
+  }
+  /*! \brief skip nblock blocks of 4 numbers */
+  inline void Skip(uint64_t nblock) {
+    counter_ += nblock;
+  }
+  /*!
+   * \brief take the part of the stream for n numbers, every draw starts
+   *   at a new block
+   * \return start block of the part
+   */
+  inline uint64_t Take(uint64_t n) {
+    const uint64_t start = counter_;
+    counter_ += (n + 3) / 4;
+    return start;
+  }
+  /*! \brief fill dst with uniform random numbers in [a, b) */
+  template<typename xpu>
+  inline void SampleUniform(mshadow::Tensor<xpu, 2> dst, float a, float b) {
+    utils::Error("PhiloxStream: only supported on cpu");
+  }
+  inline void SampleUniform(mshadow::Tensor<mshadow::cpu, 2> dst, float a, float b) {
+    utils::SampleUniform(dst, rng_, this->Take(dst.shape_.Size()), a, b, nthread_);
+  }
+
+ private:
+  /*! \brief the generator */
+  Philox4x32 rng_;
+  /*! \brief block counter of next draw */
+  uint64_t counter_;
+  /*! \brief number of threads */
+  int nthread_;
+};
+/*!
+ * \brief seed of the Philox4x32 stream of a layer, the net passes it to the layer
+ *   as parameter philox_seed. it is made of the seed of the net and the index of
+ *   the layer instead of drawn from the random number generator of the net, so
+ *   the initial weights do not depend on whether a layer uses the stream
+ */
+inline uint64_t PhiloxSeed(int net_seed, int layer_index) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(net_seed)) << 32) |
+      static_cast<uint32_t>(layer_index);
+}
+/*! \brief parse the value of parameter philox_seed */
+inline uint64_t ParsePhiloxSeed(const char *val) {
+  return static_cast<uint64_t>(strtoull(val, NULL, 10));
+}
+}  // namespace utils
+}  // namespace cxxnet
+#endif  // CXXNET_UTILS_PHILOX_H_
@@ -0,0 +1,98 @@
+/*!
+ * \file bench_shape_kernel.cpp
+ * \brief compare the convolution im2col and pooling kernels specialized for
+ *   common shapes against the generic mshadow expressions, on cpu
+ *
+ *  usage: bench_shape_kernel [batch_size=32] [nchannel=64] [size=56] [nrepeat=10]
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dmlc/timer.h>
+#include <mshadow/tensor.h>
+#include "../src/layer/layer.h"
+#include "../src/layer/convolution_layer-inl.hpp"
+#include "../src/layer/pooling_layer-inl.hpp"
+
+using namespace mshadow;
+using namespace mshadow::expr;
+using namespace cxxnet;
+
+inline real_t MaxDiff(Tensor<cpu, 2> a, Tensor<cpu, 2> b) {
+  real_t diff = 0.0f;
+  for (index_t i = 0; i < a.size(0); ++i) {
+    for (index_t j = 0; j < a.size(1); ++j) {
+      diff = std::max(diff, std::fabs(a[i][j] - b[i][j]));
+    }
+  }
+  return diff;
+}
+
+inline void BenchConv(Tensor<cpu, 4> in, int ksize, int stride, int npad, int nrepeat) {
+  layer::ConvShapeKernel kernel;
+  kernel.Select(ksize, ksize, stride);
+  const index_t oh = (in.size(2) + 2 * npad - ksize) / stride + 1;
+  const index_t ow = (in.size(3) + 2 * npad - ksize) / stride + 1;
+  Shape<2> cshape = Shape2(in.size(1) * ksize * ksize, in.size(0) * oh * ow);
+  TensorContainer<cpu, 2> col(cshape), ref(cshape);
+  double tstart = dmlc::GetTime();
+  for (int i = 0; i < nrepeat; ++i) {
+    ref = unpack_patch2col(pad(in, npad, npad), ksize, ksize, stride);
+  }
+  const double tgeneric = (dmlc::GetTime() - tstart) / nrepeat;
+  tstart = dmlc::GetTime();
+  for (int i = 0; i < nrepeat; ++i) {
+    layer::UnpackPatchToCol(kernel, col, in, npad, npad);
+  }
+  const double tfixed = (dmlc::GetTime() - tstart) / nrepeat;
+  printf("conv %dx%d/s%d pad %d im2col: generic %.3f ms, specialized %.3f ms,"
+         " speedup %.2fx, max diff %g\n", ksize, ksize, stride, npad,
+         tgeneric * 1000.0, tfixed * 1000.0, tgeneric / tfixed, MaxDiff(col, ref));
+}
+
+inline void BenchPool(Tensor<cpu, 4> in, int ksize, int stride, int nrepeat) {
+  layer::PoolFixedFn kernel = layer::SelectPoolFixed<layer::kMaxPooling>(ksize, ksize, stride);
+  Shape<4> oshape = Shape4(in.size(0), in.size(1),
+                           std::min(in.size(2) - ksize + stride - 1, in.size(2) - 1) / stride + 1,
+                           std::min(in.size(3) - ksize + stride - 1, in.size(3) - 1) / stride + 1);
+  TensorContainer<cpu, 4> out(oshape), ref(oshape);
+  Shape<2> pshape = Shape2(oshape[2], oshape[3]);
+  double tstart = dmlc::GetTime();
+  for (int i = 0; i < nrepeat; ++i) {
+    ref = pool<red::maximum>(in, pshape, ksize, ksize, stride);
+  }
+  const double tgeneric = (dmlc::GetTime() - tstart) / nrepeat;
+  tstart = dmlc::GetTime();
+  for (int i = 0; i < nrepeat; ++i) {
+    layer::PoolFixed(kernel, in, out, 0, 0);
+  }
+  const double tfixed = (dmlc::GetTime() - tstart) / nrepeat;
+  printf("max pooling %dx%d/s%d: generic %.3f ms, specialized %.3f ms,"
+         " speedup %.2fx, max diff %g\n", ksize, ksize, stride,
+         tgeneric * 1000.0, tfixed * 1000.0, tgeneric / tfixed,
+         MaxDiff(out.FlatTo2D(), ref.FlatTo2D()));
+}
+
+int main(int argc, char *argv[]) {
+  int batch_size = 32, nchannel = 64, size = 56, nrepeat = 10;
+  for (int i = 1; i < argc; ++i) {
+    char name[256], val[256];
+    if (sscanf(argv[i], "%[^=]=%s", name, val) != 2) continue;
+    if (!strcmp(name, "batch_size")) batch_size = atoi(val);
+    if (!strcmp(name, "nchannel")) nchannel = atoi(val);
+    if (!strcmp(name, "size")) size = atoi(val);
+    if (!strcmp(name, "nrepeat")) nrepeat = atoi(val);
+  }
+  Random<cpu> rnd(0);
+  TensorContainer<cpu, 4> in(Shape4(batch_size, nchannel, size, size));
+  in = rnd.gaussian(in.shape_);
+  BenchConv(in, 1, 1, 0, nrepeat);
+  BenchConv(in, 3, 1, 1, nrepeat);
+  BenchConv(in, 3, 2, 1, nrepeat);
+  BenchConv(in, 5, 1, 2, nrepeat);
+  BenchConv(in, 7, 2, 3, nrepeat);
+  BenchPool(in, 2, 2, nrepeat);
+  BenchPool(in, 3, 2, nrepeat);
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*!
+ * \file prune_fullc.cpp
+ * \brief prune the fully connected layers of a cxxnet model by magnitude,
+ *   the pruned layers are saved in block sparse form and use the block
+ *   sparse kernel in cpu inference. reports the speedup of each layer
+ *
+ *  usage: prune_fullc model_in model_out ratio [block=4] [batch_size=32]
+ *                     [nrepeat=10] [layer_name=ratio]...
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <dmlc/timer.h>
+#include <mshadow/tensor.h>
+#include "../src/nnet/nnet_config.h"
+#include "../src/nnet/neural_net-inl.hpp"
+#include "../src/layer/fullc_layer-inl.hpp"
+#include "../src/utils/io.h"
+
+int main(int argc, char *argv[]) {
+  using namespace cxxnet;
+  using namespace mshadow;
+  using namespace mshadow::expr;
+  if (argc < 4) {
+    printf("usage: prune_fullc model_in model_out ratio [block=4] [batch_size=32]"
+           " [nrepeat=10] [layer_name=ratio]...\n"
+           "  prune the fraction ratio of weight of each fullc layer by magnitude,"
+           " in units of block x block tiles\n");
+    return 0;
+  }
+  const float ratio = static_cast<float>(atof(argv[3]));
+  int block = 4, batch_size = 32, nrepeat = 10;
+  std::map<std::string, float> layer_ratio;
+  for (int i = 4; i < argc; ++i) {
+    char name[256], val[256];
+    if (sscanf(argv[i], "%[^=]=%s", name, val) != 2) continue;
+    if (!strcmp(name, "block")) {
+      block = atoi(val);
+    } else if (!strcmp(name, "batch_size")) {
+      batch_size = atoi(val);
+    } else if (!strcmp(name, "nrepeat")) {
+      nrepeat = atoi(val);
+    } else {
+      layer_ratio[name] = static_cast<float>(atof(val));
+    }
+  }
+  utils::Check(block > 0 && batch_size > 0 && nrepeat > 0,
+               "prune_fullc: block, batch_size and nrepeat must be positive");
+  // same layout as the model saved by cxxnet
+  int net_type;
+  int epoch_counter;
+  nnet::NetConfig cfg;
+  std::string blob;
+  {
+    utils::StdFile fi(argv[1], "rb");
+    utils::Check(fi.Read(&net_type, sizeof(int)) != 0, "prune_fullc: invalid model file");
+    cfg.LoadNet(fi);
+    utils::Check(fi.Read(&epoch_counter, sizeof(epoch_counter)) != 0 &&
+                 static_cast<utils::IStream&>(fi).Read(&blob),
+                 "prune_fullc: invalid model file");
+  }
+  nnet::NeuralNet<cpu> net(cfg, batch_size, 0, NULL);
+  {
+    utils::MemoryBufferStream fs(&blob);
+    net.LoadModel(fs, false);
+  }
+  const size_t old_size = blob.length();
+  double total_dense = 0.0, total_sparse = 0.0;
+  for (size_t i = 0; i < net.connections.size(); ++i) {
+    if (net.connections[i].type != layer::kFullConnect) continue;
+    std::string name = cfg.layers[i].name;
+    if (name.length() == 0) {
+      char buf[32];
+      sprintf(buf, "layer[%d]", static_cast<int>(i));
+      name = buf;
+    }
+    const float r = layer_ratio.count(name) != 0 ? layer_ratio[name] : ratio;
+    layer::FullConnectLayer<cpu> *fc =
+        static_cast<layer::FullConnectLayer<cpu>*>(net.connections[i].layer);
+    fc->Prune(r, block);
+    const layer::BlockSparseMat &bsr = fc->sparse_weight();
+    Tensor<cpu, 2> wmat = fc->weight();
+    // time both kernels on random input of one batch
+    TensorContainer<cpu, 2> in(Shape2(batch_size, wmat.size(1)));
+    TensorContainer<cpu, 2> out(Shape2(batch_size, wmat.size(0)));
+    in = net.rnd.gaussian(in.shape_);
+    double tstart = dmlc::GetTime();
+    for (int k = 0; k < nrepeat; ++k) {
+      out = dot(in, wmat.T());
+    }
+    const double tdense = (dmlc::GetTime() - tstart) / nrepeat;
+    tstart = dmlc::GetTime();
+    for (int k = 0; k < nrepeat; ++k) {
+      layer::BlockSparseDot(bsr, in, out);
+    }
+    const double tsparse = (dmlc::GetTime() - tstart) / nrepeat;
+    const size_t nblock = static_cast<size_t>(bsr.row_ptr.size() - 1) *
+        ((bsr.ncol + block - 1) / block);
+    printf("%s: %ux%u, prune %g, kept %lu/%lu blocks, "
+           "dense %.3f ms, sparse %.3f ms, speedup %.2fx\n",
+           name.c_str(), bsr.nrow, bsr.ncol, r,
+           static_cast<unsigned long>(bsr.num_block()),
+           static_cast<unsigned long>(nblock),
+           tdense * 1000.0, tsparse * 1000.0, tdense / tsparse);
+    total_dense += tdense; total_sparse += tsparse;
+  }
+  blob.clear();
+  {
+    // no updater is attached, so the layers are saved directly
+    utils::MemoryBufferStream fs(&blob);
+    for (size_t i = 0; i < net.connections.size(); ++i) {
+      if (net.connections[i].type != layer::kSharedLayer) {
+        net.connections[i].layer->SaveModel(fs);
+      }
+    }
+  }
+  printf("fullc total: dense %.3f ms, sparse %.3f ms, speedup %.2fx\n",
+         total_dense * 1000.0, total_sparse * 1000.0,
+         total_sparse != 0.0 ? total_dense / total_sparse : 1.0);
+  printf("model size: %lu -> %lu bytes\n",
+         static_cast<unsigned long>(old_size), static_cast<unsigned long>(blob.length()));
+  utils::StdFile fo(argv[2], "wb");
+  fo.Write(&net_type, sizeof(int));
+  cfg.SaveNet(fo);
+  fo.Write(&epoch_counter, sizeof(epoch_counter));
+  static_cast<utils::IStream&>(fo).Write(blob);
+  return 0;
+}